@@ -20,9 +20,12 @@
 
 #define SMDB_BCF_DIRTY (1 << 0)
 
+#define SMDB_BC_PREFETCH_RUN 32
+
 struct smdb_bc_config {
 	smdb_u32 blk_size;
 	smdb_u32 blk_max;
+	smdb_u32 pin_max;
 };
 
 struct smdb_bc_node {
@@ -31,6 +34,10 @@ struct smdb_bc_node {
 	void *data;
 	smdb_u32 blkno;
 	smdb_u32 flags;
+	smdb_u32 dstart;
+	smdb_u32 dend;
+	smdb_u32 dgen;
+	smdb_u32 lgen;
 	long usecnt;
 };
 
@@ -41,6 +48,12 @@ struct smdb_bc_ctx {
 	smdb_u32 blk_size;
 	smdb_u32 blk_count;
 	smdb_u32 blk_max;
+	smdb_u32 pin_max;
+	int pinning;
+	smdb_u32 ndirty;
+	int intx;
+	smdb_u32 tgen;
+	smdb_offset_t tsize;
 	smdb_u32 hash_mask;
 	struct smdb_listhead *hash;
 	smdb_offset_t fsize;
@@ -52,15 +65,32 @@ int smdb_bc_create(struct smdbxi_factory *fac, struct smdbxi_file *bfile,
 		   struct smdb_bc_config const *bcfg,
 		   struct smdb_bc_ctx **pbctx);
 void smdb_bc_free(struct smdb_bc_ctx *bctx);
+int smdb_bc_flush(struct smdb_bc_ctx *bctx);
 int smdb_bc_sync(struct smdb_bc_ctx *bctx);
+int smdb_bc_begin(struct smdb_bc_ctx *bctx);
+void smdb_bc_end(struct smdb_bc_ctx *bctx);
+int smdb_bc_rollback(struct smdb_bc_ctx *bctx,
+		     int (*txn_block)(void *, smdb_u32), void *priv);
 smdb_u32 smdb_bc_block_size(struct smdb_bc_ctx *bctx);
 smdb_offset_t smdb_bc_file_size(struct smdb_bc_ctx *bctx);
 struct smdb_bc_node *smdb_bc_get_block(struct smdb_bc_ctx *bctx,
 				       smdb_u32 blkno, int excl);
+int smdb_bc_prefetch(struct smdb_bc_ctx *bctx, smdb_u32 const *blknos,
+		     unsigned long n);
+struct smdb_bc_node *smdb_bc_peek_block(struct smdb_bc_ctx *bctx,
+					smdb_u32 blkno);
+void smdb_bc_prefetch_node(struct smdb_bc_ctx *bctx, smdb_u32 blkno,
+			   int step);
 void smdb_bc_release_block(struct smdb_bc_ctx *bctx,
 			   struct smdb_bc_node *bcn);
 void smdb_bc_set_block_dirty(struct smdb_bc_ctx *bctx,
 			     struct smdb_bc_node *bcn);
+void smdb_bc_set_range_dirty(struct smdb_bc_ctx *bctx,
+			     struct smdb_bc_node *bcn, smdb_u32 offset,
+			     smdb_u32 size);
+int smdb_bc_zero_blocks(struct smdb_bc_ctx *bctx, smdb_u32 blkno,
+			smdb_u32 count);
+void smdb_bc_pin_dirty(struct smdb_bc_ctx *bctx, int pin);
 void *smdb_bc_get_block_data(struct smdb_bc_node *bcn);
 
 EXTC_END;
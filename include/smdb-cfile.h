@@ -39,10 +39,24 @@ int smdb_cf_write(struct smdb_cfile_ctx *cfctx, smdb_offset_t offset,
 		  void const *data, unsigned long size);
 struct smdb_bc_node *smdb_cf_get_block(struct smdb_cfile_ctx *cfctx,
 				       smdb_u32 blkno, int excl);
+int smdb_cf_prefetch(struct smdb_cfile_ctx *cfctx, smdb_u32 const *blknos,
+		     unsigned long n);
+struct smdb_bc_node *smdb_cf_peek_block(struct smdb_cfile_ctx *cfctx,
+					smdb_u32 blkno);
+void smdb_cf_prefetch_node(struct smdb_cfile_ctx *cfctx, smdb_u32 blkno,
+			   int step);
 void smdb_cf_release_block(struct smdb_cfile_ctx *cfctx,
 			   struct smdb_bc_node *bcn);
 void smdb_cf_set_block_dirty(struct smdb_cfile_ctx *cfctx,
 			     struct smdb_bc_node *bcn);
+void smdb_cf_set_range_dirty(struct smdb_cfile_ctx *cfctx,
+			     struct smdb_bc_node *bcn, void const *data,
+			     unsigned long size);
+void smdb_cf_pin_dirty(struct smdb_cfile_ctx *cfctx, int pin);
+int smdb_cf_begin(struct smdb_cfile_ctx *cfctx);
+void smdb_cf_end(struct smdb_cfile_ctx *cfctx);
+int smdb_cf_rollback(struct smdb_cfile_ctx *cfctx,
+		     int (*txn_block)(void *, smdb_u32), void *priv);
 int smdb_cf_copy(struct smdb_cfile_ctx *cfctx, smdb_u32 bdest, smdb_u32 bsrc,
 		 smdb_u32 nblocks);
 int smdb_cf_zero(struct smdb_cfile_ctx *cfctx, smdb_u32 blkno, smdb_u32 nblocks);
@@ -18,11 +18,35 @@
 #ifndef _SMDB_DBFILE_H
 #define _SMDB_DBFILE_H
 
+#define SMDB_DBF_MAX_FREED 32
+#define SMDB_DBF_MAX_FSDIRTY 32
+
+#define SMDB_DBF_TBL_HASH 0
+#define SMDB_DBF_TBL_LINEAR 1
+#define SMDB_DBF_TBL_ROBIN 2
+
+#define SMDB_DBF_HASH_OAT 0
+#define SMDB_DBF_HASH_XXH64 1
+
+#define SMDB_DBF_ERR_FORMAT (-2)
+
 struct smdb_db_config {
 	smdb_u32 blk_size;
 	smdb_u32 blk_count;
 	smdb_u32 cache_size;
 	smdb_u32 num_tables;
+	smdb_u32 group_max;
+	smdb_u32 group_blocks;
+	smdb_u32 ckpt_blocks;
+	smdb_u32 prealloc_blocks;
+	smdb_u32 pin_size;
+	void (*play_cb)(void *, unsigned long, unsigned long);
+	void *play_priv;
+	void (*durable_cb)(void *, smdb_u64);
+	void *durable_priv;
+	smdb_u32 durability;
+	smdb_u32 sync_ms;
+	smdb_u64 hash_seed;
 };
 
 struct smdb_db_kenum {
@@ -30,6 +54,19 @@ struct smdb_db_kenum {
 	smdb_u32 hashv;
 	smdb_u32 hsize;
 	smdb_u32 idx;
+	smdb_u32 bucket;
+};
+
+struct smdb_dbf_extent {
+	smdb_u32 blkno;
+	smdb_u32 count;
+};
+
+struct smdb_dbf_fsnode {
+	smdb_u32 size;
+	smdb_u32 head;
+	smdb_u32 tail;
+	smdb_u32 run;
 };
 
 struct smdb_dbfile_ctx {
@@ -38,6 +75,35 @@ struct smdb_dbfile_ctx {
 	struct smdbxi_file *bfile;
 	struct smdb_cfile_ctx *cfctx;
 	struct smdb_jfile_ctx *jfctx;
+	int intx;
+	unsigned int nfreed;
+	struct smdb_dbf_extent freed[SMDB_DBF_MAX_FREED];
+	smdb_u32 fs_leaves;
+	struct smdb_dbf_fsnode *fsum;
+	unsigned int nfsdirty;
+	smdb_u32 fsdirty[SMDB_DBF_MAX_FSDIRTY];
+};
+
+#define SMDB_DBF_VIEW_IOV(v) ((v)->iovs != NULL ? (v)->iovs: &(v)->iov1)
+
+struct smdb_db_view {
+	struct smdb_db_ckey key;
+	struct smdb_db_cdata data;
+	unsigned long niov;
+	struct smdb_db_iovec *iovs;
+	struct smdb_db_iovec iov1;
+	unsigned long nblks;
+	struct smdb_bc_node **bcns;
+	struct smdb_bc_node *bcn;
+	void *copy;
+};
+
+struct smdb_dbf_bop;
+
+struct smdb_dbf_batch {
+	struct smdb_dbfile_ctx *dfctx;
+	unsigned long nops;
+	struct smdb_dbf_bop *head, **ptail;
 };
 
 EXTC_BEGIN;
@@ -51,17 +117,35 @@ int smdb_dbf_open(struct smdbxi_factory *fac, struct smdbxi_file *bfile,
 void smdb_dbf_free(struct smdb_dbfile_ctx *dfctx);
 int smdb_dbf_create_table(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
 			  unsigned int tblsize);
+int smdb_dbf_create_table_mode(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
+			       unsigned int tblsize, int mode);
+int smdb_dbf_create_table_hash(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
+			       unsigned int tblsize, int mode, int hashfn);
 int smdb_dbf_free_table(struct smdb_dbfile_ctx *dfctx, unsigned int tblid);
 int smdb_dbf_sync(struct smdb_dbfile_ctx *dfctx);
 int smdb_dbf_begin(struct smdb_dbfile_ctx *dfctx);
+int smdb_dbf_begin_level(struct smdb_dbfile_ctx *dfctx, int level);
 int smdb_dbf_end(struct smdb_dbfile_ctx *dfctx);
+int smdb_dbf_end_async(struct smdb_dbfile_ctx *dfctx, smdb_u64 *pseq);
+int smdb_dbf_flush(struct smdb_dbfile_ctx *dfctx);
+smdb_u64 smdb_dbf_durable_seq(struct smdb_dbfile_ctx *dfctx);
+int smdb_dbf_wait_durable(struct smdb_dbfile_ctx *dfctx, smdb_u64 seq);
 int smdb_dbf_rollback(struct smdb_dbfile_ctx *dfctx);
+int smdb_dbf_checkpoint(struct smdb_dbfile_ctx *dfctx);
 int smdb_dbf_get(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
 		 struct smdb_db_ckey const *key, struct smdb_db_record *rec,
 		 struct smdb_db_kenum *ken);
 int smdb_dbf_get_next(struct smdb_dbfile_ctx *dfctx,
 		      struct smdb_db_ckey const *key,
 		      struct smdb_db_record *rec, struct smdb_db_kenum *ken);
+int smdb_dbf_get_view(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
+		      struct smdb_db_ckey const *key, struct smdb_db_view *view,
+		      struct smdb_db_kenum *ken);
+void smdb_dbf_release_view(struct smdb_dbfile_ctx *dfctx,
+			   struct smdb_db_view *view);
+int smdb_dbf_multi_get(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
+		       struct smdb_db_ckey const *keys, unsigned long n,
+		       struct smdb_db_record *recs);
 int smdb_dbf_first(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
 		   struct smdb_db_record *rec, struct smdb_db_kenum *ken);
 int smdb_dbf_next(struct smdb_dbfile_ctx *dfctx, struct smdb_db_record *rec,
@@ -72,6 +156,16 @@ int smdb_dbf_put(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
 		 struct smdb_db_ckey const *key, struct smdb_db_cdata *data);
 int smdb_dbf_erase(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
 		   struct smdb_db_ckey const *key, struct smdb_db_cdata const *data);
+int smdb_dbf_batch_create(struct smdb_dbfile_ctx *dfctx,
+			  struct smdb_dbf_batch **pbatch);
+void smdb_dbf_batch_free(struct smdb_dbf_batch *batch);
+int smdb_dbf_batch_put(struct smdb_dbf_batch *batch, unsigned int tblid,
+		       struct smdb_db_ckey const *key,
+		       struct smdb_db_cdata const *data);
+int smdb_dbf_batch_erase(struct smdb_dbf_batch *batch, unsigned int tblid,
+			 struct smdb_db_ckey const *key,
+			 struct smdb_db_cdata const *data);
+int smdb_dbf_batch_apply(struct smdb_dbf_batch *batch);
 
 EXTC_END;
 
@@ -64,13 +64,47 @@ struct smdbxi_file {
 	int (*truncate)(void *, smdb_offset_t);
 	int (*sync)(void *);
 	char const *(*path)(void *);
+	int (*write_range)(void *, void const *, int, int, int);
+	int (*zero)(void *, smdb_offset_t, smdb_offset_t);
+	int (*datasync)(void *);
+	int (*readahead)(void *, smdb_offset_t, smdb_offset_t);
 };
 
 #define SMDBXI_FL_SEEK(p, o, w) (*(p)->seek)((p)->priv, o, w)
 #define SMDBXI_FL_READ(p, b, n) (*(p)->read)((p)->priv, b, n)
 #define SMDBXI_FL_WRITE(p, b, n) (*(p)->write)((p)->priv, b, n)
+/*
+ * Same as SMDBXI_FL_WRITE, with the hint that only the S bytes at offset O
+ * within the buffer differ from what the file currently stores. Files with
+ * no write_range method get the whole buffer written.
+ */
+#define SMDBXI_FL_WRITE_RANGE(p, b, n, o, s) \
+	((p)->write_range != NULL ? \
+	 (*(p)->write_range)((p)->priv, b, n, o, s): SMDBXI_FL_WRITE(p, b, n))
+/*
+ * Zeroes S bytes at offset O, growing the file if needed. The file
+ * position is undefined after the call. The method can be NULL, and the
+ * library then writes zero blocks over the range (see smdb_off_zero()).
+ */
+#define SMDBXI_FL_ZERO(p, o, s) (*(p)->zero)((p)->priv, o, s)
 #define SMDBXI_FL_TRUNCATE(p, s) (*(p)->truncate)((p)->priv, s)
 #define SMDBXI_FL_SYNC(p) (*(p)->sync)((p)->priv)
+/*
+ * Same as SMDBXI_FL_SYNC, but only the file metadata needed to read the
+ * data back (like the file size) is required to hit the media. Files with
+ * no datasync method get a full sync.
+ */
+#define SMDBXI_FL_DATASYNC(p) \
+	((p)->datasync != NULL ? \
+	 (*(p)->datasync)((p)->priv): SMDBXI_FL_SYNC(p))
+/*
+ * Hints that the S bytes at offset O are going to be read soon, so that
+ * the file can start fetching them in the background. Doing nothing is
+ * a valid implementation, and so is a NULL readahead method.
+ */
+#define SMDBXI_FL_READAHEAD(p, o, s) \
+	((p)->readahead != NULL ? \
+	 (*(p)->readahead)((p)->priv, o, s): 0)
 #define SMDBXI_FL_PATH(p) (*(p)->path)((p)->priv)
 
 struct smdbxi_fs {
@@ -98,12 +132,18 @@ struct smdbxi_factory {
 	struct smdbxi_file *(*file)(void *);
 	struct smdbxi_fs *(*fs)(void *);
 	struct smdbxi_lock *(*lock)(void *);
+	smdb_u64 (*clock)(void *);
 };
 
 #define SMDBXI_FC_MEM(p) (*(p)->mem)((p)->priv)
 #define SMDBXI_FC_FILE(p) (*(p)->file)((p)->priv)
 #define SMDBXI_FC_FS(p) (*(p)->fs)((p)->priv)
 #define SMDBXI_FC_LOCK(p) (*(p)->lock)((p)->priv)
+/*
+ * Returns a monotonic time in milliseconds. The method can be NULL, and
+ * the periodic durability level is then refused.
+ */
+#define SMDBXI_FC_CLOCK(p) (*(p)->clock)((p)->priv)
 
 #endif
 
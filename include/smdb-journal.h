@@ -18,40 +18,130 @@
 #ifndef _SMDB_JOURNAL_H
 #define _SMDB_JOURNAL_H
 
+#define SMDB_DUR_DEFAULT 0
+#define SMDB_DUR_FULL 1
+#define SMDB_DUR_DATA 2
+#define SMDB_DUR_PERIODIC 3
+#define SMDB_DUR_NONE 4
+
 struct smdb_jbhash_node {
 	smdb_u32 offset;
 	smdb_u32 joffset;
+	smdb_u32 crc;
+	smdb_u32 doffset;
+	smdb_u32 dstart;
+	smdb_u32 dsize;
+};
+
+struct smdb_jf_config {
+	unsigned int blk_size;
+	unsigned int group_max;
+	unsigned long group_blocks;
+	unsigned long ckpt_blocks;
+	unsigned long prealloc_blocks;
+	unsigned long append_blocks;
+	void (*play_cb)(void *, unsigned long, unsigned long);
+	void *play_priv;
+	void (*durable_cb)(void *, smdb_u64);
+	void *durable_priv;
+	int durability;
+	unsigned long sync_ms;
 };
 
 struct smdb_jfile_ctx {
 	struct smdbxi_file file_ifc;
+	struct smdbxi_factory *fac;
 	struct smdbxi_mem *mem;
 	struct smdbxi_fs *fs;
 	struct smdbxi_file *bfile;
 	struct smdbxi_file *jfile;
 	unsigned int blk_size;
+	unsigned int group_max;
+	unsigned long group_blocks;
+	unsigned long ckpt_blocks;
+	unsigned long prealloc_blocks;
+	unsigned long append_blocks;
+	void (*play_cb)(void *, unsigned long, unsigned long);
+	void *play_priv;
+	void (*durable_cb)(void *, smdb_u64);
+	void *durable_priv;
+	int durability;
+	unsigned long sync_ms;
+	int level;
+	int glevel;
+	int ptimed;
+	smdb_u64 ctime;
 	smdb_offset_t offset;
 	smdb_offset_t fsize;
 	char *jfpath;
 	int enabled;
 	int active;
+	int failed;
+	unsigned int sealed;
+	unsigned long committed;
+	smdb_offset_t jend;
+	smdb_offset_t cend;
+	smdb_u64 seq;
+	smdb_u64 tseq;
+	smdb_u64 dseq;
+	unsigned int hslot;
+	smdb_u32 jbase;
+	smdb_offset_t bsize;
+	smdb_offset_t dlimit;
+	smdb_u32 dblock;
+	smdb_u32 dused;
+	char *abuf;
+	smdb_offset_t aoffset;
+	unsigned long acount;
+	smdb_u32 *fresh;
+	unsigned long frcount;
+	unsigned long frsize;
+	int bdirty;
+	smdb_u32 *drop;
+	unsigned long drcount;
+	unsigned long drsize;
+	unsigned long drbase;
+	struct smdb_jbhash_node *zext;
+	unsigned long zcount;
+	unsigned long zsize;
+	unsigned long zbase;
+	unsigned long zcommit;
+	struct smdb_jbhash_node *undo;
+	unsigned long ucount;
+	unsigned long usize;
 	struct smdb_jbhash_node *bhash;
 	unsigned long bhmask;
 	unsigned long bhbits;
 	unsigned long bcount;
+	unsigned long bused;
 	unsigned long bdeleted;
 	unsigned long bfree;
+	struct smdb_jbhash_node *obhash;
+	unsigned long obmask;
+	unsigned long obbits;
+	unsigned long obnext;
 };
 
 EXTC_BEGIN;
 
 int smdb_jf_create(struct smdbxi_factory *fac, struct smdbxi_file *bfile,
-		   unsigned int blk_size, struct smdb_jfile_ctx **pjfctx);
+		   struct smdb_jf_config const *jcfg,
+		   struct smdb_jfile_ctx **pjfctx);
 void smdb_jf_free(struct smdb_jfile_ctx *jfctx);
 struct smdbxi_file *smdb_jf_getfile(struct smdb_jfile_ctx *jfctx);
 int smdb_jf_begin(struct smdb_jfile_ctx *jfctx);
+int smdb_jf_begin_level(struct smdb_jfile_ctx *jfctx, int level);
 int smdb_jf_end(struct smdb_jfile_ctx *jfctx);
+int smdb_jf_end_async(struct smdb_jfile_ctx *jfctx, smdb_u64 *pseq);
 int smdb_jf_rollback(struct smdb_jfile_ctx *jfctx);
+void smdb_jf_fail(struct smdb_jfile_ctx *jfctx);
+int smdb_jf_flush(struct smdb_jfile_ctx *jfctx);
+smdb_u64 smdb_jf_durable_seq(struct smdb_jfile_ctx *jfctx);
+int smdb_jf_wait_durable(struct smdb_jfile_ctx *jfctx, smdb_u64 seq);
+int smdb_jf_checkpoint(struct smdb_jfile_ctx *jfctx);
+int smdb_jf_fresh_blocks(struct smdb_jfile_ctx *jfctx, smdb_u32 blkno,
+			 smdb_u32 count);
+int smdb_jf_txn_block(struct smdb_jfile_ctx *jfctx, smdb_u32 blkno);
 
 EXTC_END;
 
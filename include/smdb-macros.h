@@ -29,6 +29,12 @@
 #define MZERO(s) smdb_memset(&(s), 0, sizeof(s))
 #define OBJALLOC(m, t) ((t *) smdb_zalloc(m, sizeof(t)))
 
+#if defined(__GNUC__)
+#define PREFETCH(a) __builtin_prefetch(a)
+#else
+#define PREFETCH(a) ((void) (a))
+#endif
+
 #ifdef _DEBUG
 #include <stdio.h>
 
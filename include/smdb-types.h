@@ -38,6 +38,11 @@ struct smdb_db_cdata {
 	unsigned long size;
 };
 
+struct smdb_db_iovec {
+	void const *data;
+	unsigned long size;
+};
+
 struct smdb_db_record {
 	void *record;
 	struct smdb_db_key key;
@@ -24,6 +24,12 @@ struct smdb_bits_find_ctx {
 	unsigned long bfirst;
 };
 
+struct smdb_bits_runs {
+	unsigned long head;
+	unsigned long tail;
+	unsigned long run;
+};
+
 EXTC_BEGIN;
 
 void *smdb_zalloc(struct smdbxi_mem *mem, unsigned int size);
@@ -32,13 +38,20 @@ void smdb_bits_clear(smdb_u32 *bmp, unsigned long start_bit, unsigned long nbits
 int smdb_bits_find_clear(smdb_u32 const *bmp, unsigned long start_bit,
 			 unsigned long nbits, unsigned long bsize,
 			 struct smdb_bits_find_ctx *fctx, unsigned long *pbitno);
+void smdb_bits_get_runs(smdb_u32 const *bmp, unsigned long nbits,
+			struct smdb_bits_runs *runs);
 int smdb_get_order(unsigned long count);
 unsigned long smdb_get_hash(void const *data, unsigned long size,
                             unsigned long hashv);
+smdb_u64 smdb_get_hash64(void const *data, unsigned long size, smdb_u64 seed);
+smdb_u32 smdb_crc32c(smdb_u32 crc, void const *data, unsigned long size);
 int smdb_off_read(struct smdbxi_file *file, smdb_offset_t offset,
 		  void *data, int size);
 int smdb_off_write(struct smdbxi_file *file, smdb_offset_t offset,
 		   void const *data, int size);
+int smdb_off_zero(struct smdbxi_file *file, smdb_offset_t offset,
+		  smdb_offset_t size, struct smdbxi_mem *mem,
+		  unsigned int blk_size);
 
 EXTC_END;
 
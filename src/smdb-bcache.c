@@ -67,27 +67,17 @@ static int smdb_bc_read_block(struct smdb_bc_ctx *bctx, void *data)
 static int smdb_bc_file_grow(struct smdb_bc_ctx *bctx, smdb_offset_t size)
 {
 	smdb_offset_t csize;
-	void *zbuf;
 
 	/*
 	 * Current and new size MUST be block-aligned!
 	 */
 	if ((size % bctx->blk_size) != 0 ||
 	    (csize = SMDBXI_FL_SEEK(bctx->bfile, 0, SMDBXI_FL_SEEKEND)) < 0 ||
-	    (csize % bctx->blk_size) != 0 ||
-	    (zbuf = smdb_zalloc(bctx->mem, bctx->blk_size)) == NULL)
+	    (csize % bctx->blk_size) != 0)
 		return -1;
 
-	while (csize < size) {
-		if (smdb_bc_write_block(bctx, zbuf) < 0) {
-			SMDBXI_MM_FREE(bctx->mem, zbuf);
-			return -1;
-		}
-		csize += bctx->blk_size;
-	}
-	SMDBXI_MM_FREE(bctx->mem, zbuf);
-
-	return 0;
+	return csize < size ? smdb_off_zero(bctx->bfile, csize, size - csize,
+					    bctx->mem, bctx->blk_size): 0;
 }
 
 static int smdb_bc_load_node(struct smdb_bc_ctx *bctx,
@@ -121,9 +111,17 @@ static int smdb_bc_store_node(struct smdb_bc_ctx *bctx,
 		bctx->fsize = offset + bctx->blk_size;
 	}
 
-	if (SMDBXI_FL_SEEK(bctx->bfile, offset, SMDBXI_FL_SEEKSET) != offset ||
-	    smdb_bc_write_block(bctx, bcn->data) < 0)
+	if (SMDBXI_FL_SEEK(bctx->bfile, offset, SMDBXI_FL_SEEKSET) != offset)
+		return -1;
+	if (bcn->dstart == 0 && bcn->dend == bctx->blk_size) {
+		if (smdb_bc_write_block(bctx, bcn->data) < 0)
+			return -1;
+	} else if (SMDBXI_FL_WRITE_RANGE(bctx->bfile, bcn->data,
+					 (int) bctx->blk_size, (int) bcn->dstart,
+					 (int) (bcn->dend - bcn->dstart)) !=
+		   (int) bctx->blk_size)
 		return -1;
+	bcn->dstart = bcn->dend = 0;
 
 	return 0;
 }
@@ -137,78 +135,147 @@ static int smdb_bc_sync_node(struct smdb_bc_ctx *bctx,
 		if (smdb_bc_store_node(bctx, bcn) < 0)
 			return -1;
 		bcn->flags &= ~SMDB_BCF_DIRTY;
+		bctx->ndirty--;
 		syncd = 1;
 	}
 
 	return syncd;
 }
 
-static struct smdb_bc_node *smdb_bc_get_node(struct smdb_bc_ctx *bctx,
-					     smdb_u32 blkno)
+static struct smdb_bc_node *smdb_bc_lru_node(struct smdb_bc_ctx *bctx,
+					     int clean)
+{
+	struct smdb_listhead *pos;
+	struct smdb_bc_node *bcn;
+
+	/*
+	 * Pick a block from the LRU list, which is not pinned
+	 * by the upper layers.
+	 */
+	for (pos = SMDB_LIST_LAST(&bctx->lru); pos != NULL;
+	     pos = SMDB_LIST_PREV(&bctx->lru, pos)) {
+		bcn = SMDB_LIST_ENTRY(pos, struct smdb_bc_node, lrulnk);
+		if (bcn->usecnt == 0 &&
+		    (!clean || !(bcn->flags & SMDB_BCF_DIRTY)))
+			return bcn;
+	}
+
+	return NULL;
+}
+
+static struct smdb_listhead *smdb_bc_hash_head(struct smdb_bc_ctx *bctx,
+					       smdb_u32 blkno)
+{
+	return &bctx->hash[(blkno ^ (blkno >> 7)) & bctx->hash_mask];
+}
+
+static struct smdb_bc_node *smdb_bc_find_node(struct smdb_bc_ctx *bctx,
+					      smdb_u32 blkno)
 {
-	smdb_u32 idx;
 	struct smdb_listhead *head, *pos;
 	struct smdb_bc_node *bcn;
 
-	idx = (blkno ^ (blkno >> 7)) & bctx->hash_mask;
-	head = &bctx->hash[idx];
+	head = smdb_bc_hash_head(bctx, blkno);
 	SMDB_LIST_FOR_EACH(pos, head) {
 		bcn = SMDB_LIST_ENTRY(pos, struct smdb_bc_node, lnk);
-		if (bcn->blkno == blkno) {
-			SMDB_LIST_DEL(&bcn->lrulnk);
-			SMDB_LIST_ADDH(&bcn->lrulnk, &bctx->lru);
+		if (bcn->blkno == blkno)
 			return bcn;
-		}
 	}
+
+	return NULL;
+}
+
+static struct smdb_bc_node *smdb_bc_new_node(struct smdb_bc_ctx *bctx,
+					     smdb_u32 blkno)
+{
+	struct smdb_bc_node *bcn;
+
 	/*
-	 * No luck, we didn't find the block we were looking for.
+	 * While dirty blocks are pinned, only clean blocks get recycled,
+	 * and the cache is allowed to grow by pin_max blocks to hold the
+	 * dirty ones. Past that, the least recently used dirty block is
+	 * spilled to the file.
 	 */
-	if (bctx->blk_count < bctx->blk_max) {
+	bcn = NULL;
+	if (bctx->blk_count >= bctx->blk_max) {
+		if (!bctx->pinning)
+			bcn = smdb_bc_lru_node(bctx, 0);
+		else if ((bcn = smdb_bc_lru_node(bctx, 1)) == NULL &&
+			 bctx->blk_count >= bctx->blk_max + bctx->pin_max)
+			bcn = smdb_bc_lru_node(bctx, 0);
+		if (bcn == NULL &&
+		    (!bctx->pinning ||
+		     bctx->blk_count >= bctx->blk_max + bctx->pin_max))
+			return NULL;
+	}
+	if (bcn == NULL) {
 		/*
 		 * Since we are under our quota, we can allocate a new
-		 * block and load it up.
+		 * block.
 		 */
-		if ((bcn = smdb_bc_alloc_node(bctx, blkno)) == NULL ||
-		    smdb_bc_load_node(bctx, bcn) < 0) {
-			smdb_bc_free_node(bctx->mem, bcn);
+		if ((bcn = smdb_bc_alloc_node(bctx, blkno)) == NULL)
 			return NULL;
-		}
-		SMDB_LIST_ADDH(&bcn->lrulnk, &bctx->lru);
-		SMDB_LIST_ADDT(&bcn->lnk, head);
 		bctx->blk_count++;
 	} else {
-		/*
-		 * Pick a block from the LRU list, which is not pinned
-		 * by the upper layers.
-		 */
-		for (pos = SMDB_LIST_LAST(&bctx->lru); pos != NULL;
-		     pos = SMDB_LIST_PREV(&bctx->lru, pos)) {
-			bcn = SMDB_LIST_ENTRY(pos, struct smdb_bc_node, lrulnk);
-			if (bcn->usecnt == 0)
-				break;
-		}
 		/*
 		 * If we foudn a valid one, we need to sync it on media before
 		 * re-using it.
 		 */
-		if (pos == NULL ||
-		    smdb_bc_sync_node(bctx, bcn) < 0)
+		if (smdb_bc_sync_node(bctx, bcn) < 0)
 			return NULL;
 		/*
 		 * Assign the LRU-ed block to the new one.
 		 */
 		bcn->blkno = blkno;
 		bcn->flags = 0;
+		bcn->dstart = bcn->dend = 0;
+		bcn->dgen = 0;
 		SMDB_LIST_DEL(&bcn->lrulnk);
 		SMDB_LIST_DEL(&bcn->lnk);
-		if (smdb_bc_load_node(bctx, bcn) < 0) {
-			smdb_bc_free_node(bctx->mem, bcn);
-			bctx->blk_count--;
-			return NULL;
-		}
+	}
+	bcn->lgen = bctx->intx ? bctx->tgen: 0;
+
+	/*
+	 * The node is returned unlinked, and the caller fills it and hashes
+	 * it, or drops it with smdb_bc_drop_node().
+	 */
+	return bcn;
+}
+
+static void smdb_bc_drop_node(struct smdb_bc_ctx *bctx,
+			      struct smdb_bc_node *bcn)
+{
+	smdb_bc_free_node(bctx->mem, bcn);
+	bctx->blk_count--;
+}
+
+static void smdb_bc_link_node(struct smdb_bc_ctx *bctx,
+			      struct smdb_bc_node *bcn)
+{
+	SMDB_LIST_ADDH(&bcn->lrulnk, &bctx->lru);
+	SMDB_LIST_ADDT(&bcn->lnk, smdb_bc_hash_head(bctx, bcn->blkno));
+}
+
+static struct smdb_bc_node *smdb_bc_get_node(struct smdb_bc_ctx *bctx,
+					     smdb_u32 blkno)
+{
+	struct smdb_bc_node *bcn;
+
+	if ((bcn = smdb_bc_find_node(bctx, blkno)) != NULL) {
+		SMDB_LIST_DEL(&bcn->lrulnk);
 		SMDB_LIST_ADDH(&bcn->lrulnk, &bctx->lru);
-		SMDB_LIST_ADDT(&bcn->lnk, head);
+		return bcn;
+	}
+	/*
+	 * No luck, we didn't find the block we were looking for.
+	 */
+	if ((bcn = smdb_bc_new_node(bctx, blkno)) == NULL)
+		return NULL;
+	if (smdb_bc_load_node(bctx, bcn) < 0) {
+		smdb_bc_drop_node(bctx, bcn);
+		return NULL;
 	}
+	smdb_bc_link_node(bctx, bcn);
 
 	return bcn;
 }
@@ -256,6 +323,7 @@ int smdb_bc_create(struct smdbxi_factory *fac, struct smdbxi_file *bfile,
 	bctx->bfile = bfile;
 	bctx->blk_size = bcfg->blk_size;
 	bctx->blk_max = bcfg->blk_max;
+	bctx->pin_max = bcfg->pin_max;
 	SMDB_INIT_LIST_HEAD(&bctx->lru);
 	bctx->fsize = fsize;
 
@@ -290,20 +358,157 @@ void smdb_bc_free(struct smdb_bc_ctx *bctx)
 	}
 }
 
-int smdb_bc_sync(struct smdb_bc_ctx *bctx)
+static void smdb_bc_sift_down(struct smdb_bc_node **nodes, unsigned long i,
+			      unsigned long n)
 {
-	struct smdb_bc_node *bcn;
+	unsigned long c;
+	struct smdb_bc_node *tmp;
+
+	for (; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && nodes[c + 1]->blkno > nodes[c]->blkno)
+			c++;
+		if (nodes[i]->blkno >= nodes[c]->blkno)
+			break;
+		tmp = nodes[i];
+		nodes[i] = nodes[c];
+		nodes[c] = tmp;
+	}
+}
+
+static void smdb_bc_sort_nodes(struct smdb_bc_node **nodes, unsigned long n)
+{
+	unsigned long i;
+	struct smdb_bc_node *tmp;
+
+	for (i = n / 2; i > 0; i--)
+		smdb_bc_sift_down(nodes, i - 1, n);
+	for (i = n; i > 1; i--) {
+		tmp = nodes[0];
+		nodes[0] = nodes[i - 1];
+		nodes[i - 1] = tmp;
+		smdb_bc_sift_down(nodes, 0, i - 1);
+	}
+}
+
+int smdb_bc_flush(struct smdb_bc_ctx *bctx)
+{
+	unsigned long i, n;
+	struct smdb_bc_node *bcn, **nodes;
 	struct smdb_listhead *pos;
 
+	if ((n = bctx->ndirty) == 0)
+		return 0;
+	/*
+	 * Store the dirty blocks in file offset order, so that the write
+	 * set of a transaction lands in the journal as a sequential append
+	 * which maps contiguous DB blocks to contiguous journal blocks.
+	 * Fall back to LRU order if we cannot get the memory to sort them.
+	 */
+	if (n > 1 &&
+	    (nodes = (struct smdb_bc_node **)
+	     SMDBXI_MM_ALLOC(bctx->mem, n * sizeof(struct smdb_bc_node *))) != NULL) {
+		i = 0;
+		SMDB_LIST_FOR_EACH(pos, &bctx->lru) {
+			bcn = SMDB_LIST_ENTRY(pos, struct smdb_bc_node, lrulnk);
+			if (bcn->flags & SMDB_BCF_DIRTY)
+				nodes[i++] = bcn;
+		}
+		smdb_bc_sort_nodes(nodes, n);
+		for (i = 0; i < n; i++)
+			if (smdb_bc_sync_node(bctx, nodes[i]) < 0) {
+				SMDBXI_MM_FREE(bctx->mem, nodes);
+				return -1;
+			}
+		SMDBXI_MM_FREE(bctx->mem, nodes);
+	}
+
 	SMDB_LIST_FOR_EACH(pos, &bctx->lru) {
 		bcn = SMDB_LIST_ENTRY(pos, struct smdb_bc_node, lrulnk);
 		if (smdb_bc_sync_node(bctx, bcn) < 0)
 			return -1;
 	}
 
+	return 0;
+}
+
+int smdb_bc_sync(struct smdb_bc_ctx *bctx)
+{
+	if (smdb_bc_flush(bctx) < 0)
+		return -1;
+
 	return SMDBXI_FL_SYNC(bctx->bfile);
 }
 
+int smdb_bc_begin(struct smdb_bc_ctx *bctx)
+{
+	/*
+	 * Blocks dirtied before the transaction must not be mixed with the
+	 * ones changed by it, since these might be discarded by a rollback.
+	 */
+	if (smdb_bc_flush(bctx) < 0)
+		return -1;
+	/*
+	 * Blocks dirtied or loaded by the transaction are tagged with its
+	 * generation, so no pass over the cache is needed once it is over.
+	 */
+	if (++bctx->tgen == 0)
+		bctx->tgen = 1;
+	bctx->tsize = bctx->fsize;
+	bctx->intx = 1;
+
+	return 0;
+}
+
+void smdb_bc_end(struct smdb_bc_ctx *bctx)
+{
+	bctx->intx = 0;
+}
+
+static int smdb_bc_txn_node(struct smdb_bc_ctx *bctx, struct smdb_bc_node *bcn,
+			    int (*txn_block)(void *, smdb_u32), void *priv)
+{
+	return bcn->dgen == bctx->tgen ||
+		(bcn->lgen == bctx->tgen && (*txn_block)(priv, bcn->blkno));
+}
+
+int smdb_bc_rollback(struct smdb_bc_ctx *bctx,
+		     int (*txn_block)(void *, smdb_u32), void *priv)
+{
+	struct smdb_listhead *pos, *next;
+	struct smdb_bc_node *bcn;
+
+	/*
+	 * The upper layers must have released all the blocks of the
+	 * transaction, and nothing is dropped if they did not.
+	 */
+	SMDB_LIST_FOR_EACH(pos, &bctx->lru) {
+		bcn = SMDB_LIST_ENTRY(pos, struct smdb_bc_node, lrulnk);
+		if (bcn->usecnt > 0 &&
+		    smdb_bc_txn_node(bctx, bcn, txn_block, priv))
+			return -1;
+	}
+	/*
+	 * Drop the blocks dirtied by the transaction, and the ones it loaded
+	 * whose content came from the transaction itself, according to the
+	 * layer below. Everything else in the cache is still valid.
+	 */
+	SMDB_LIST_FOR_EACH_SAFE(pos, next, &bctx->lru) {
+		bcn = SMDB_LIST_ENTRY(pos, struct smdb_bc_node, lrulnk);
+		if (!smdb_bc_txn_node(bctx, bcn, txn_block, priv))
+			continue;
+		if (bcn->flags & SMDB_BCF_DIRTY)
+			bctx->ndirty--;
+		SMDB_LIST_DEL(&bcn->lrulnk);
+		SMDB_LIST_DEL(&bcn->lnk);
+		smdb_bc_free_node(bctx->mem, bcn);
+		bctx->blk_count--;
+	}
+	bctx->fsize = bctx->tsize;
+	bctx->intx = 0;
+
+	return 0;
+}
+
 struct smdb_bc_node *smdb_bc_get_block(struct smdb_bc_ctx *bctx,
 				       smdb_u32 blkno, int excl)
 {
@@ -316,16 +521,256 @@ struct smdb_bc_node *smdb_bc_get_block(struct smdb_bc_ctx *bctx,
 	return bcn;
 }
 
+static int smdb_bc_load_run(struct smdb_bc_ctx *bctx, smdb_u32 blkno,
+			    smdb_u32 count, char *buf)
+{
+	smdb_u32 i;
+	smdb_offset_t offset;
+	struct smdb_bc_node *bcn;
+
+	offset = (smdb_offset_t) blkno * bctx->blk_size;
+	if (SMDBXI_FL_SEEK(bctx->bfile, offset, SMDBXI_FL_SEEKSET) != offset ||
+	    SMDBXI_FL_READ(bctx->bfile, buf, (int) (count * bctx->blk_size)) !=
+	    (int) (count * bctx->blk_size))
+		return -1;
+	for (i = 0; i < count; i++) {
+		/*
+		 * A cache full of pinned blocks simply ends the prefetch.
+		 */
+		if ((bcn = smdb_bc_new_node(bctx, blkno + i)) == NULL)
+			break;
+		smdb_memcpy(bcn->data, buf + i * bctx->blk_size, bctx->blk_size);
+		smdb_bc_link_node(bctx, bcn);
+	}
+
+	return (int) i;
+}
+
+static int smdb_bc_missing(struct smdb_bc_ctx *bctx, smdb_u32 blkno)
+{
+	return ((smdb_offset_t) blkno + 1) * bctx->blk_size <= bctx->fsize &&
+		smdb_bc_find_node(bctx, blkno) == NULL;
+}
+
+static unsigned long smdb_bc_next_run(struct smdb_bc_ctx *bctx,
+				      smdb_u32 const *blknos, unsigned long n,
+				      unsigned long i, smdb_u32 max_count,
+				      smdb_u32 *pcount)
+{
+	smdb_u32 count;
+
+	/*
+	 * Skips the cached blocks, and the ones past the end of the file,
+	 * and returns the index of the next run of missing contiguous
+	 * blocks, whose length is stored in *pcount.
+	 */
+	for (; i < n && !smdb_bc_missing(bctx, blknos[i]); i++)
+		;
+	for (count = i < n ? 1: 0;
+	     i + count < n && count < max_count &&
+		     blknos[i + count] == blknos[i + count - 1] + 1 &&
+		     smdb_bc_missing(bctx, blknos[i + count]);
+	     count++)
+		;
+	*pcount = count;
+
+	return i;
+}
+
+int smdb_bc_prefetch(struct smdb_bc_ctx *bctx, smdb_u32 const *blknos,
+		     unsigned long n)
+{
+	int nloaded;
+	unsigned long i;
+	smdb_u32 count, quota;
+	char *buf;
+
+	/*
+	 * Loads the blocks of the ascending blknos array which are not
+	 * cached yet, reading every run of contiguous blocks with a single
+	 * I/O. At most half the cache is filled, so that the blocks loaded
+	 * first are still there when the caller gets to them. Blocks past
+	 * the end of the file are left to smdb_bc_get_block().
+	 */
+	if (n == 0 || bctx->blk_max < 2 ||
+	    (buf = (char *) SMDBXI_MM_ALLOC(bctx->mem, SMDB_BC_PREFETCH_RUN *
+					    bctx->blk_size)) == NULL)
+		return 0;
+	/*
+	 * All the runs are announced to the file before the first read, so
+	 * that it can fetch them concurrently.
+	 */
+	for (i = 0, quota = bctx->blk_max / 2;
+	     quota > 0 &&
+		     (i = smdb_bc_next_run(bctx, blknos, n, i,
+					   MIN(quota, SMDB_BC_PREFETCH_RUN),
+					   &count)) < n;
+	     i += count, quota -= count)
+		SMDBXI_FL_READAHEAD(bctx->bfile,
+				    (smdb_offset_t) blknos[i] * bctx->blk_size,
+				    (smdb_offset_t) count * bctx->blk_size);
+	for (i = 0, quota = bctx->blk_max / 2;
+	     quota > 0 &&
+		     (i = smdb_bc_next_run(bctx, blknos, n, i,
+					   MIN(quota, SMDB_BC_PREFETCH_RUN),
+					   &count)) < n;
+	     i += count, quota -= count) {
+		if ((nloaded = smdb_bc_load_run(bctx, blknos[i], count,
+						buf)) < 0) {
+			SMDBXI_MM_FREE(bctx->mem, buf);
+			return -1;
+		}
+		if ((smdb_u32) nloaded < count)
+			break;
+	}
+	SMDBXI_MM_FREE(bctx->mem, buf);
+
+	return 0;
+}
+
+struct smdb_bc_node *smdb_bc_peek_block(struct smdb_bc_ctx *bctx,
+					smdb_u32 blkno)
+{
+	/*
+	 * Only looks the block up, leaving the LRU order and the use count
+	 * alone. The node is valid until the next call which can load or
+	 * drop blocks.
+	 */
+	return smdb_bc_find_node(bctx, blkno);
+}
+
+void smdb_bc_prefetch_node(struct smdb_bc_ctx *bctx, smdb_u32 blkno,
+			   int step)
+{
+	struct smdb_listhead *head;
+
+	/*
+	 * Asks the CPU for the memory a lookup of the block is going to
+	 * touch: the hash list head first, then the first node on the list,
+	 * which is the lookup one most of the time.
+	 */
+	head = smdb_bc_hash_head(bctx, blkno);
+	if (step == 0)
+		PREFETCH(head);
+	else
+		PREFETCH(head->_next);
+}
+
 void smdb_bc_release_block(struct smdb_bc_ctx *bctx,
 			   struct smdb_bc_node *bcn)
 {
 	bcn->usecnt--;
 }
 
+static void smdb_bc_mark_dirty(struct smdb_bc_ctx *bctx,
+			       struct smdb_bc_node *bcn)
+{
+	if (!(bcn->flags & SMDB_BCF_DIRTY)) {
+		bcn->flags |= SMDB_BCF_DIRTY;
+		bctx->ndirty++;
+	}
+	if (bctx->intx)
+		bcn->dgen = bctx->tgen;
+}
+
 void smdb_bc_set_block_dirty(struct smdb_bc_ctx *bctx,
 			     struct smdb_bc_node *bcn)
 {
-	bcn->flags |= SMDB_BCF_DIRTY;
+	smdb_bc_mark_dirty(bctx, bcn);
+	bcn->dstart = 0;
+	bcn->dend = bctx->blk_size;
+}
+
+void smdb_bc_set_range_dirty(struct smdb_bc_ctx *bctx,
+			     struct smdb_bc_node *bcn, smdb_u32 offset,
+			     smdb_u32 size)
+{
+	/*
+	 * A single byte range is tracked per block, and grown to cover
+	 * all the ranges marked dirty since the block was last stored.
+	 */
+	if (!(bcn->flags & SMDB_BCF_DIRTY) || bcn->dstart >= bcn->dend) {
+		bcn->dstart = offset;
+		bcn->dend = offset + size;
+	} else {
+		if (offset < bcn->dstart)
+			bcn->dstart = offset;
+		if (offset + size > bcn->dend)
+			bcn->dend = offset + size;
+	}
+	smdb_bc_mark_dirty(bctx, bcn);
+}
+
+int smdb_bc_zero_blocks(struct smdb_bc_ctx *bctx, smdb_u32 blkno,
+			smdb_u32 count)
+{
+	smdb_offset_t offset, size;
+	struct smdb_listhead *pos, *next;
+	struct smdb_bc_node *bcn;
+
+	/*
+	 * Zeroed blocks are not kept inside the cache, their zeroing is handed
+	 * to the file, and they get loaded back on their next access. Cached
+	 * copies are dropped, dirty or not, unless in use by the upper layers,
+	 * in which case they are cleared to match the file content.
+	 */
+	SMDB_LIST_FOR_EACH_SAFE(pos, next, &bctx->lru) {
+		bcn = SMDB_LIST_ENTRY(pos, struct smdb_bc_node, lrulnk);
+		if (bcn->blkno < blkno || bcn->blkno - blkno >= count)
+			continue;
+		if (bcn->flags & SMDB_BCF_DIRTY)
+			bctx->ndirty--;
+		if (bcn->usecnt > 0) {
+			smdb_memset(bcn->data, 0, bctx->blk_size);
+			bcn->flags &= ~SMDB_BCF_DIRTY;
+			bcn->dstart = bcn->dend = 0;
+			if (bctx->intx)
+				bcn->dgen = bctx->tgen;
+		} else {
+			SMDB_LIST_DEL(&bcn->lrulnk);
+			SMDB_LIST_DEL(&bcn->lnk);
+			smdb_bc_free_node(bctx->mem, bcn);
+			bctx->blk_count--;
+		}
+	}
+
+	offset = (smdb_offset_t) blkno * bctx->blk_size;
+	size = (smdb_offset_t) count * bctx->blk_size;
+	/*
+	 * A range past the end of file is extended down to it, so that the
+	 * file does not grow with holes.
+	 */
+	if (offset > bctx->fsize) {
+		size += offset - bctx->fsize;
+		offset = bctx->fsize;
+	}
+	if (smdb_off_zero(bctx->bfile, offset, size, bctx->mem,
+			  bctx->blk_size) < 0)
+		return -1;
+	if (offset + size > bctx->fsize)
+		bctx->fsize = offset + size;
+
+	return 0;
+}
+
+void smdb_bc_pin_dirty(struct smdb_bc_ctx *bctx, int pin)
+{
+	struct smdb_bc_node *bcn;
+
+	if (bctx->pin_max == 0)
+		return;
+	bctx->pinning = pin;
+	/*
+	 * Give back the blocks which went over the cache size while the
+	 * dirty blocks were pinned.
+	 */
+	while (!pin && bctx->blk_count > bctx->blk_max &&
+	       (bcn = smdb_bc_lru_node(bctx, 1)) != NULL) {
+		SMDB_LIST_DEL(&bcn->lrulnk);
+		SMDB_LIST_DEL(&bcn->lnk);
+		smdb_bc_free_node(bctx->mem, bcn);
+		bctx->blk_count--;
+	}
 }
 
 smdb_u32 smdb_bc_block_size(struct smdb_bc_ctx *bctx)
@@ -129,7 +129,8 @@ int smdb_cf_write(struct smdb_cfile_ctx *cfctx, smdb_offset_t offset,
 		smdb_memcpy((char *) smdb_bc_get_block_data(bcn) + blkoff, data,
 			    count);
 
-		smdb_bc_set_block_dirty(cfctx->bctx, bcn);
+		smdb_bc_set_range_dirty(cfctx->bctx, bcn, blkoff,
+					(smdb_u32) count);
 		smdb_bc_release_block(cfctx->bctx, bcn);
 		csize += count;
 		data = (char const *) data + count;
@@ -144,6 +145,24 @@ struct smdb_bc_node *smdb_cf_get_block(struct smdb_cfile_ctx *cfctx,
 	return smdb_bc_get_block(cfctx->bctx, blkno, excl);
 }
 
+int smdb_cf_prefetch(struct smdb_cfile_ctx *cfctx, smdb_u32 const *blknos,
+		     unsigned long n)
+{
+	return smdb_bc_prefetch(cfctx->bctx, blknos, n);
+}
+
+struct smdb_bc_node *smdb_cf_peek_block(struct smdb_cfile_ctx *cfctx,
+					smdb_u32 blkno)
+{
+	return smdb_bc_peek_block(cfctx->bctx, blkno);
+}
+
+void smdb_cf_prefetch_node(struct smdb_cfile_ctx *cfctx, smdb_u32 blkno,
+			   int step)
+{
+	smdb_bc_prefetch_node(cfctx->bctx, blkno, step);
+}
+
 void smdb_cf_release_block(struct smdb_cfile_ctx *cfctx,
 			   struct smdb_bc_node *bcn)
 {
@@ -156,6 +175,37 @@ void smdb_cf_set_block_dirty(struct smdb_cfile_ctx *cfctx,
 	smdb_bc_set_block_dirty(cfctx->bctx, bcn);
 }
 
+void smdb_cf_set_range_dirty(struct smdb_cfile_ctx *cfctx,
+			     struct smdb_bc_node *bcn, void const *data,
+			     unsigned long size)
+{
+	smdb_bc_set_range_dirty(cfctx->bctx, bcn,
+				(smdb_u32) ((char const *) data -
+					    (char const *) smdb_bc_get_block_data(bcn)),
+				(smdb_u32) size);
+}
+
+void smdb_cf_pin_dirty(struct smdb_cfile_ctx *cfctx, int pin)
+{
+	smdb_bc_pin_dirty(cfctx->bctx, pin);
+}
+
+int smdb_cf_begin(struct smdb_cfile_ctx *cfctx)
+{
+	return smdb_bc_begin(cfctx->bctx);
+}
+
+void smdb_cf_end(struct smdb_cfile_ctx *cfctx)
+{
+	smdb_bc_end(cfctx->bctx);
+}
+
+int smdb_cf_rollback(struct smdb_cfile_ctx *cfctx,
+		     int (*txn_block)(void *, smdb_u32), void *priv)
+{
+	return smdb_bc_rollback(cfctx->bctx, txn_block, priv);
+}
+
 int smdb_cf_copy(struct smdb_cfile_ctx *cfctx, smdb_u32 bdest, smdb_u32 bsrc,
 		 smdb_u32 nblocks)
 {
@@ -185,20 +235,5 @@ int smdb_cf_copy(struct smdb_cfile_ctx *cfctx, smdb_u32 bdest, smdb_u32 bsrc,
 
 int smdb_cf_zero(struct smdb_cfile_ctx *cfctx, smdb_u32 blkno, smdb_u32 nblocks)
 {
-	smdb_u32 i, blk_size;
-	struct smdb_bc_node *bcn;
-
-	blk_size = smdb_bc_block_size(cfctx->bctx);
-	for (i = 0; i < nblocks; i++) {
-		if ((bcn = smdb_cf_get_block(cfctx, blkno + i, 1)) == NULL)
-			return -1;
-
-		smdb_memset(smdb_bc_get_block_data(bcn), 0, blk_size);
-
-		smdb_cf_set_block_dirty(cfctx, bcn);
-		smdb_cf_release_block(cfctx, bcn);
-	}
-
-	return 0;
+	return smdb_bc_zero_blocks(cfctx->bctx, blkno, nblocks);
 }
-
@@ -17,16 +17,42 @@
 
 #include "smdb-incl.h"
 
-#define SMDB_DBF_MAGIC "SMSIDB01"
-#define SMDB_MAX_ORDER 32
+#define SMDB_DBF_MAGIC "SMSIDB02"
+#define SMDB_DBF_MAGIC_BASE "SMSIDB"
 #define SMDB_HASHV_INIT 9587
 #define SMDB_MIN_BLKSIZE 256
+#define SMDB_DBF_APPEND_BLOCKS 64
+#define SMDB_DBF_SMALL 0x80000000
+#define SMDB_DBF_SMALL_RATIO 4
+#define SMDB_DBF_SMALL_ALIGN sizeof(smdb_u32)
+#define SMDB_DBF_LH_SEGMENTS 33
+#define SMDB_DBF_MGET_WINDOW 16
+#define SMDB_DBF_MGET_MIN 4
+
+#define SMDB_DBF_MG_START 0
+#define SMDB_DBF_MG_HLIST 1
+#define SMDB_DBF_MG_HOME 2
+#define SMDB_DBF_MG_SLOT 3
+#define SMDB_DBF_MG_RLIST 4
+#define SMDB_DBF_MG_REC 5
+#define SMDB_DBF_MG_SPAGE 6
+#define SMDB_DBF_MG_LOOKUP 7
+#define SMDB_DBF_MG_DONE 8
 
 struct smdb_db_file {
 	smdb_u32 blkno;
 	smdb_u32 size;
 };
 
+/*
+ * A hash slot carries the hash value of the record key next to the record
+ * location, so that probes and rehashes do not need to load the record.
+ */
+struct smdb_db_slot {
+	struct smdb_db_file file;
+	smdb_u32 hashv;
+};
+
 struct smdb_db_rstorage {
 	smdb_u32 hashv;
 	smdb_u32 ksize;
@@ -36,6 +62,44 @@ struct smdb_db_rstorage {
 struct smdb_db_table {
 	struct smdb_db_file hash;
 	smdb_u32 num_recs;
+	smdb_u32 num_dels;
+	smdb_u32 spage;
+	smdb_u32 mode;
+	smdb_u32 nbase;
+	smdb_u32 level;
+	smdb_u32 split;
+	smdb_u32 hashfn;
+};
+
+/*
+ * Linear hashing tables are made of buckets, each one being a block holding
+ * this header followed by the hash slots, and chaining overflow blocks when
+ * full. The table hash file is a single block listing the bucket segments,
+ * the first one holding nbase buckets, and the n-th one (n > 0) holding
+ * nbase << (n - 1) buckets. The table grows by splitting one bucket at a
+ * time, at the split position, into the bucket split + (nbase << level).
+ */
+struct smdb_db_bucket {
+	smdb_u32 next;
+};
+
+/*
+ * Records not larger than a fraction of the block size are packed inside
+ * slotted pages. A page starts with this header, followed by the slot
+ * directory, while the records are stored from the end of the block
+ * backward. The hash slot of a small record stores the page block, and
+ * the directory index OR-ed with SMDB_DBF_SMALL as size.
+ */
+struct smdb_db_spage {
+	smdb_u32 nslots;
+	smdb_u32 nused;
+	smdb_u32 dstart;
+	smdb_u32 nfree;
+};
+
+struct smdb_db_sslot {
+	smdb_u32 offset;
+	smdb_u32 size;
 };
 
 struct smdb_db_header {
@@ -43,11 +107,16 @@ struct smdb_db_header {
 	smdb_u32 blk_size;
 	smdb_u32 blk_count;
 	smdb_u32 blk_alloc;
-	smdb_u32 first_free[SMDB_MAX_ORDER];
 	struct smdb_db_file bitmap;
 	smdb_u32 num_tables;
 	struct smdb_db_file tables;
 	smdb_u32 num_recs;
+	/*
+	 * The 64 bit hash seed is split, so that the header has no padding
+	 * and no 64 bit field at a 32 bit aligned offset.
+	 */
+	smdb_u32 hash_seed_lo;
+	smdb_u32 hash_seed_hi;
 };
 
 struct smdb_db_env {
@@ -55,8 +124,27 @@ struct smdb_db_env {
 	struct smdb_bc_node *tbcn;
 	struct smdb_db_header *hdr;
 	struct smdb_db_table *tbl;
+	struct smdb_db_view *view;
+};
+
+struct smdb_dbf_mget {
+	struct smdb_db_kenum ken;
+	int state;
+	int found;
+	smdb_u32 blkno;
+	struct smdb_db_file rfile;
 };
 
+struct smdb_dbf_bop {
+	struct smdb_dbf_bop *next;
+	smdb_u32 tblid;
+	smdb_u32 hashv;
+	int erase;
+	int match;
+	smdb_u64 order;
+	struct smdb_db_ckey key;
+	struct smdb_db_cdata data;
+};
 
 static int smdb_dbf_expand(struct smdb_cfile_ctx *cfctx,
 			   struct smdb_db_header *hdr, smdb_u32 nblocks,
@@ -81,11 +169,211 @@ static int smdb_dbf_expand(struct smdb_cfile_ctx *cfctx,
 	return 0;
 }
 
-static int smdb_dbf_setbmbits(struct smdb_cfile_ctx *cfctx,
+static void smdb_dbf_fs_merge(struct smdb_dbf_fsnode *fsn,
+			      struct smdb_dbf_fsnode const *left,
+			      struct smdb_dbf_fsnode const *right)
+{
+	fsn->size = left->size + right->size;
+	fsn->head = left->head == left->size ? left->size + right->head:
+		left->head;
+	fsn->tail = right->tail == right->size ? right->size + left->tail:
+		right->tail;
+	fsn->run = left->tail + right->head;
+	if (fsn->run < left->run)
+		fsn->run = left->run;
+	if (fsn->run < right->run)
+		fsn->run = right->run;
+}
+
+static void smdb_dbf_fs_leaf(struct smdb_dbf_fsnode *fsn, smdb_u32 const *bmp,
+			     smdb_u32 blkbits)
+{
+	struct smdb_bits_runs runs;
+
+	smdb_bits_get_runs(bmp, blkbits, &runs);
+	fsn->size = blkbits;
+	fsn->head = (smdb_u32) runs.head;
+	fsn->tail = (smdb_u32) runs.tail;
+	fsn->run = (smdb_u32) runs.run;
+}
+
+static void smdb_dbf_fs_update(struct smdb_dbfile_ctx *dfctx, smdb_u32 leaf,
+			       smdb_u32 const *bmp, smdb_u32 blkbits)
+{
+	smdb_u32 i;
+	struct smdb_dbf_fsnode *fsum = dfctx->fsum;
+
+	i = dfctx->fs_leaves + leaf;
+	smdb_dbf_fs_leaf(&fsum[i], bmp, blkbits);
+	for (i /= 2; i > 0; i /= 2)
+		smdb_dbf_fs_merge(&fsum[i], &fsum[2 * i], &fsum[2 * i + 1]);
+}
+
+static void smdb_dbf_fs_drop(struct smdb_dbfile_ctx *dfctx)
+{
+	if (dfctx->fsum != NULL) {
+		SMDBXI_MM_FREE(dfctx->mem, dfctx->fsum);
+		dfctx->fsum = NULL;
+	}
+	/*
+	 * A summary rebuilt within the transaction cannot be patched back
+	 * to the committed bitmap on rollback.
+	 */
+	dfctx->nfsdirty = SMDB_DBF_MAX_FSDIRTY + 1;
+}
+
+static void smdb_dbf_fs_touch(struct smdb_dbfile_ctx *dfctx, smdb_u32 leaf)
+{
+	unsigned int i;
+
+	if (!dfctx->intx || dfctx->nfsdirty > SMDB_DBF_MAX_FSDIRTY)
+		return;
+	for (i = 0; i < dfctx->nfsdirty; i++)
+		if (dfctx->fsdirty[i] == leaf)
+			return;
+	if (dfctx->nfsdirty < SMDB_DBF_MAX_FSDIRTY)
+		dfctx->fsdirty[dfctx->nfsdirty] = leaf;
+	dfctx->nfsdirty++;
+}
+
+static int smdb_dbf_fs_build(struct smdb_dbfile_ctx *dfctx,
+			     struct smdb_db_header const *hdr)
+{
+	smdb_u32 i, nleaves;
+	struct smdb_bc_node *bcn;
+
+	/*
+	 * The free space summary is a tree over the bitmap blocks, where
+	 * every node holds the clear runs at the edges of the range it
+	 * covers, and the longest one within it. It lives in memory only,
+	 * and gets built from the bitmap the first time it is needed.
+	 */
+	for (nleaves = 1; nleaves < hdr->bitmap.size; nleaves <<= 1);
+	if ((dfctx->fsum = (struct smdb_dbf_fsnode *)
+	     smdb_zalloc(dfctx->mem, 2 * nleaves *
+			 sizeof(struct smdb_dbf_fsnode))) == NULL)
+		return -1;
+	dfctx->fs_leaves = nleaves;
+	for (i = 0; i < hdr->bitmap.size; i++) {
+		if ((bcn = smdb_cf_get_block(dfctx->cfctx,
+					     hdr->bitmap.blkno + i, 0)) == NULL) {
+			smdb_dbf_fs_drop(dfctx);
+			return -1;
+		}
+		smdb_dbf_fs_leaf(&dfctx->fsum[nleaves + i],
+				 (smdb_u32 *) smdb_bc_get_block_data(bcn),
+				 hdr->blk_size * 8);
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+	}
+	for (i = nleaves - 1; i > 0; i--)
+		smdb_dbf_fs_merge(&dfctx->fsum[i], &dfctx->fsum[2 * i],
+				  &dfctx->fsum[2 * i + 1]);
+
+	return 0;
+}
+
+static int smdb_dbf_fs_find(struct smdb_dbfile_ctx *dfctx,
+			    struct smdb_db_header const *hdr, smdb_u32 nbits,
+			    smdb_u32 *pfblkno)
+{
+	int found, retry;
+	smdb_u32 i, base;
+	unsigned long bitno;
+	struct smdb_dbf_fsnode const *left, *right;
+	struct smdb_bc_node *bcn;
+	struct smdb_bits_find_ctx fctx;
+
+	DBGPRINT("Looking for %lu blocks\n", (unsigned long) nbits);
+
+	for (retry = 1;; retry--) {
+		if (dfctx->fsum == NULL && smdb_dbf_fs_build(dfctx, hdr) < 0)
+			return -1;
+		if (dfctx->fsum[1].run < nbits)
+			return 0;
+
+		/*
+		 * Walk down towards the first bitmap block holding a clear
+		 * run long enough, unless one is found crossing the two
+		 * halves of a subtree.
+		 */
+		for (i = 1, base = 0; i < dfctx->fs_leaves;) {
+			left = &dfctx->fsum[2 * i];
+			right = left + 1;
+			if (left->run >= nbits)
+				i = 2 * i;
+			else if (left->tail + right->head >= nbits) {
+				*pfblkno = base + left->size - left->tail;
+				return 1;
+			} else {
+				base += left->size;
+				i = 2 * i + 1;
+			}
+		}
+		if ((bcn = smdb_cf_get_block(dfctx->cfctx, hdr->bitmap.blkno +
+					     i - dfctx->fs_leaves, 0)) == NULL)
+			return -1;
+		MZERO(fctx);
+		fctx.base = base;
+		found = smdb_bits_find_clear((smdb_u32 *)
+					     smdb_bc_get_block_data(bcn), 0,
+					     hdr->blk_size * 8, nbits, &fctx,
+					     &bitno);
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+		if (found)
+			break;
+		/*
+		 * The summary disagrees with the bitmap, so it gets rebuilt
+		 * from it, and the search runs once more.
+		 */
+		smdb_dbf_fs_drop(dfctx);
+		if (retry == 0)
+			return -1;
+	}
+	*pfblkno = (smdb_u32) bitno;
+
+	DBGPRINT("Found start in block %lu\n", bitno);
+
+	return 1;
+}
+
+static void smdb_dbf_fs_rollback(struct smdb_dbfile_ctx *dfctx)
+{
+	unsigned int i;
+	struct smdb_bc_node *mbcn, *bcn;
+	struct smdb_db_header *hdr;
+
+	/*
+	 * Bring the summary of the bitmap blocks the transaction changed
+	 * back in sync with their committed content.
+	 */
+	if (dfctx->fsum == NULL)
+		return;
+	if (dfctx->nfsdirty > SMDB_DBF_MAX_FSDIRTY ||
+	    (mbcn = smdb_cf_get_block(dfctx->cfctx, 0, 0)) == NULL) {
+		smdb_dbf_fs_drop(dfctx);
+		return;
+	}
+	hdr = (struct smdb_db_header *) smdb_bc_get_block_data(mbcn);
+	for (i = 0; i < dfctx->nfsdirty; i++) {
+		if ((bcn = smdb_cf_get_block(dfctx->cfctx, hdr->bitmap.blkno +
+					     dfctx->fsdirty[i], 0)) == NULL) {
+			smdb_dbf_fs_drop(dfctx);
+			break;
+		}
+		smdb_dbf_fs_update(dfctx, dfctx->fsdirty[i],
+				   (smdb_u32 *) smdb_bc_get_block_data(bcn),
+				   hdr->blk_size * 8);
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+	}
+	smdb_cf_release_block(dfctx->cfctx, mbcn);
+}
+
+static int smdb_dbf_setbmbits(struct smdb_dbfile_ctx *dfctx,
 			      struct smdb_db_header *hdr, unsigned long start_bit,
 			      unsigned long nbits, int set)
 {
 	unsigned long blkbits, blkno, bitno, bcount, bsize;
+	struct smdb_cfile_ctx *cfctx = dfctx->cfctx;
 	struct smdb_bc_node *bcn;
 	smdb_u32 *bmp;
 
@@ -105,7 +393,13 @@ static int smdb_dbf_setbmbits(struct smdb_cfile_ctx *cfctx,
 			smdb_bits_set(bmp, bitno, bsize);
 		else
 			smdb_bits_clear(bmp, bitno, bsize);
-		smdb_cf_set_block_dirty(cfctx, bcn);
+		smdb_cf_set_range_dirty(cfctx, bcn, bmp + bitno / 32,
+					((bitno + bsize + 31) / 32 - bitno / 32) *
+					sizeof(smdb_u32));
+		smdb_dbf_fs_touch(dfctx, (smdb_u32) blkno);
+		if (dfctx->fsum != NULL)
+			smdb_dbf_fs_update(dfctx, (smdb_u32) blkno, bmp,
+					   (smdb_u32) blkbits);
 		smdb_cf_release_block(cfctx, bcn);
 		bcount += bsize;
 	}
@@ -113,59 +407,23 @@ static int smdb_dbf_setbmbits(struct smdb_cfile_ctx *cfctx,
 	return 0;
 }
 
-static int smdb_dbf_get_free_blocks(struct smdb_cfile_ctx *cfctx,
-				    struct smdb_db_header *hdr, smdb_u32 start_block,
-				    smdb_u32 nbits, smdb_u32 *pfblkno)
-{
-	smdb_u32 blkno;
-	unsigned long bitno, blkbits;
-	struct smdb_bc_node *bcn;
-	smdb_u32 *bmp;
-	struct smdb_bits_find_ctx fctx;
-
-	DBGPRINT("Looking for %lu blocks, from block %lu\n", nbits,
-		 (unsigned long) start_block);
-
-	blkbits = hdr->blk_size * 8;
-	blkno = start_block / blkbits;
-
-	MZERO(fctx);
-	fctx.base = blkno * blkbits;
-
-	for (blkno = start_block / blkbits; blkno < hdr->bitmap.size; blkno++) {
-		if ((bcn = smdb_cf_get_block(cfctx, hdr->bitmap.blkno + blkno,
-					     0)) == NULL)
-			return -1;
-		bmp = (smdb_u32 *) smdb_bc_get_block_data(bcn);
-
-		if (smdb_bits_find_clear(bmp, 0, blkbits, nbits, &fctx, &bitno)) {
-			smdb_cf_release_block(cfctx, bcn);
-			*pfblkno = (smdb_u32) bitno;
-
-			DBGPRINT("Found start in block %lu\n", bitno);
-
-			return 1;
-		}
-		fctx.base += blkbits;
-		smdb_cf_release_block(cfctx, bcn);
-	}
-
-	DBGPRINT("Looking for %lu blocks, from block %lu - FAILED!\n", nbits,
-		 (unsigned long) start_block);
-
-	return 0;
-}
-
-static int smdb_dbf_grow(struct smdb_cfile_ctx *cfctx,
+static int smdb_dbf_grow(struct smdb_dbfile_ctx *dfctx,
 			 struct smdb_db_header *hdr, smdb_u32 nblocks)
 {
 	smdb_u32 blk_count, bmpsize, bmp_blkno;
+	struct smdb_cfile_ctx *cfctx = dfctx->cfctx;
 	struct smdb_db_file obitmap;
 
 	obitmap = hdr->bitmap;
 
 	DBGPRINT("Current bitmap at block %lu\n", (unsigned long) obitmap.blkno);
 
+	/*
+	 * The bitmap moves and changes size, so the free space summary is
+	 * rebuilt from scratch by the next allocation.
+	 */
+	smdb_dbf_fs_drop(dfctx);
+
 	/*
 	 * Calculate new bitmap size.
 	 */
@@ -198,75 +456,64 @@ static int smdb_dbf_grow(struct smdb_cfile_ctx *cfctx,
 	 * Clear the bits freed from the old bitmap, and set the ones allocated
 	 * for the new one.
 	 */
-	if (smdb_dbf_setbmbits(cfctx, hdr, obitmap.blkno, obitmap.size, 0) < 0 ||
-	    smdb_dbf_setbmbits(cfctx, hdr, bmp_blkno, bmpsize, 1) < 0)
+	if (smdb_dbf_setbmbits(dfctx, hdr, obitmap.blkno, obitmap.size, 0) < 0 ||
+	    smdb_dbf_setbmbits(dfctx, hdr, bmp_blkno, bmpsize, 1) < 0)
 		return -1;
 
 	return 0;
 }
 
-static int smdb_dbf_balloc(struct smdb_cfile_ctx *cfctx, smdb_u32 blkcnt,
+static int smdb_dbf_balloc(struct smdb_dbfile_ctx *dfctx, smdb_u32 blkcnt,
 			   smdb_u32 *pblkno)
 {
-	smdb_u32 fblkno, order, grow_blkcnt;
+	int found;
+	smdb_u32 fblkno, grow_blkcnt;
+	struct smdb_cfile_ctx *cfctx = dfctx->cfctx;
 	struct smdb_bc_node *mbcn;
 	struct smdb_db_header *hdr;
 
-	order = smdb_get_order(blkcnt);
-	if (order >= SMDB_MAX_ORDER ||
-	    (mbcn = smdb_cf_get_block(cfctx, 0, 1)) == NULL)
+	if ((mbcn = smdb_cf_get_block(cfctx, 0, 1)) == NULL)
 		return -1;
 	hdr = (struct smdb_db_header *) smdb_bc_get_block_data(mbcn);
 
-	DBGPRINT("Allocating %lu blocks (order = %lu)\n", (unsigned long) blkcnt,
-		 (unsigned long) order);
+	DBGPRINT("Allocating %lu blocks\n", (unsigned long) blkcnt);
 
 	/*
-	 * Try to alloc from the last known free index before.
+	 * The free space summary leads straight to the first free range
+	 * able to hold the requested blocks.
 	 */
-	if (!smdb_dbf_get_free_blocks(cfctx, hdr, hdr->first_free[order],
-				      blkcnt, &fblkno)) {
+	if ((found = smdb_dbf_fs_find(dfctx, hdr, blkcnt, &fblkno)) == 0) {
 		/*
-		 * Then try again from the beginning, and grow the DB file
-		 * if no more space is available to allocated this block.
+		 * Calculate the grow size, grow the database accordingly,
+		 * and try the allocation for the requested number of blocks.
 		 */
-		if (hdr->first_free[order] == 0 ||
-		    !smdb_dbf_get_free_blocks(cfctx, hdr, 0,
-					      blkcnt, &fblkno)) {
-			/*
-			 * Calculate the grow size, grow the database
-			 * accordingly, and try the allocation for the requested
-			 * number of blocks.
-			 */
-			if ((grow_blkcnt = hdr->blk_count) < blkcnt)
-				grow_blkcnt = 2 * blkcnt;
-			if (smdb_dbf_grow(cfctx, hdr, grow_blkcnt) < 0) {
-				smdb_cf_release_block(cfctx, mbcn);
-				return -1;
-			}
-			smdb_cf_set_block_dirty(cfctx, mbcn);
-			/*
-			 * Now we should be able to allocated the requested block.
-			 */
-			if (!smdb_dbf_get_free_blocks(cfctx, hdr, 0,
-						      blkcnt, &fblkno)) {
-				smdb_cf_release_block(cfctx, mbcn);
-				return -1;
-			}
+		if ((grow_blkcnt = hdr->blk_count) < blkcnt)
+			grow_blkcnt = 2 * blkcnt;
+		if (smdb_dbf_grow(dfctx, hdr, grow_blkcnt) < 0) {
+			smdb_cf_release_block(cfctx, mbcn);
+			return -1;
 		}
+		smdb_cf_set_block_dirty(cfctx, mbcn);
+		/*
+		 * Now we should be able to allocated the requested block.
+		 */
+		found = smdb_dbf_fs_find(dfctx, hdr, blkcnt, &fblkno);
+	}
+	if (found <= 0) {
+		smdb_cf_release_block(cfctx, mbcn);
+		return -1;
 	}
 	/*
 	 * Set the allocation bitmap area for the allocated range.
 	 */
-	if (smdb_dbf_setbmbits(cfctx, hdr, fblkno, blkcnt, 1) < 0) {
+	if (smdb_dbf_setbmbits(dfctx, hdr, fblkno, blkcnt, 1) < 0) {
 		smdb_cf_release_block(cfctx, mbcn);
 		return -1;
 	}
 
-	hdr->first_free[order] = fblkno + blkcnt;
 	hdr->blk_alloc += blkcnt;
 
-	smdb_cf_set_block_dirty(cfctx, mbcn);
+	smdb_cf_set_range_dirty(cfctx, mbcn, hdr, sizeof(*hdr));
 	smdb_cf_release_block(cfctx, mbcn);
 
 	*pblkno = fblkno;
@@ -274,12 +521,12 @@ static int smdb_dbf_balloc(struct smdb_cfile_ctx *cfctx, smdb_u32 blkcnt,
 	return 0;
 }
 
-static int smdb_dbf_alloc_file(struct smdb_cfile_ctx *cfctx, smdb_u32 blkcnt,
+static int smdb_dbf_alloc_file(struct smdb_dbfile_ctx *dfctx, smdb_u32 blkcnt,
 			       struct smdb_db_file *dbf)
 {
 	smdb_u32 blkno;
 
-	if (smdb_dbf_balloc(cfctx, blkcnt, &blkno) < 0)
+	if (smdb_dbf_balloc(dfctx, blkcnt, &blkno) < 0)
 		return -1;
 
 	MZERO(*dbf);
@@ -289,38 +536,72 @@ static int smdb_dbf_alloc_file(struct smdb_cfile_ctx *cfctx, smdb_u32 blkcnt,
 	return 0;
 }
 
-static int smdb_dbf_bfree(struct smdb_cfile_ctx *cfctx, smdb_u32 blkno,
+static int smdb_dbf_bfree(struct smdb_dbfile_ctx *dfctx, smdb_u32 blkno,
 			  smdb_u32 blkcnt)
 {
-	smdb_u32 order;
+	struct smdb_cfile_ctx *cfctx = dfctx->cfctx;
 	struct smdb_bc_node *mbcn;
 	struct smdb_db_header *hdr;
 
-	order = smdb_get_order(blkcnt);
-	if (order >= SMDB_MAX_ORDER ||
-	    (mbcn = smdb_cf_get_block(cfctx, 0, 1)) == NULL)
+	if ((mbcn = smdb_cf_get_block(cfctx, 0, 1)) == NULL)
 		return -1;
 	hdr = (struct smdb_db_header *) smdb_bc_get_block_data(mbcn);
 
-	if (smdb_dbf_setbmbits(cfctx, hdr, blkno, blkcnt, 0) < 0) {
-		smdb_cf_set_block_dirty(cfctx, mbcn);
+	if (smdb_dbf_setbmbits(dfctx, hdr, blkno, blkcnt, 0) < 0) {
+		smdb_cf_set_range_dirty(cfctx, mbcn, hdr, sizeof(*hdr));
 		smdb_cf_release_block(cfctx, mbcn);
 		return -1;
 	}
-	if (blkno < hdr->first_free[order])
-		hdr->first_free[order] = blkno;
 	hdr->blk_alloc -= blkcnt;
 
-	smdb_cf_set_block_dirty(cfctx, mbcn);
+	smdb_cf_set_range_dirty(cfctx, mbcn, hdr, sizeof(*hdr));
 	smdb_cf_release_block(cfctx, mbcn);
 
 	return 0;
 }
 
-static int smdb_dbf_initdb(struct smdb_cfile_ctx *cfctx,
+static int smdb_dbf_release_file(struct smdb_dbfile_ctx *dfctx, smdb_u32 blkno,
+				 smdb_u32 blkcnt)
+{
+	/*
+	 * Blocks released within a transaction still hold committed data,
+	 * so a later allocation of the same transaction must not take them
+	 * as fresh ones. Stop tracking when there are too many of them.
+	 */
+	if (dfctx->intx && dfctx->nfreed <= SMDB_DBF_MAX_FREED) {
+		if (dfctx->nfreed < SMDB_DBF_MAX_FREED) {
+			dfctx->freed[dfctx->nfreed].blkno = blkno;
+			dfctx->freed[dfctx->nfreed].count = blkcnt;
+		}
+		dfctx->nfreed++;
+	}
+
+	return smdb_dbf_bfree(dfctx, blkno, blkcnt);
+}
+
+static int smdb_dbf_fresh_file(struct smdb_dbfile_ctx *dfctx,
+			       struct smdb_db_file const *dbf)
+{
+	unsigned int i;
+
+	if (!dfctx->intx || dfctx->nfreed > SMDB_DBF_MAX_FREED)
+		return 0;
+	for (i = 0; i < dfctx->nfreed; i++)
+		if (dfctx->freed[i].blkno < dbf->blkno + dbf->size &&
+		    dbf->blkno < dfctx->freed[i].blkno + dfctx->freed[i].count)
+			return 0;
+	/*
+	 * The blocks were free when the transaction started, so they can
+	 * be written straight into the DB file.
+	 */
+	return smdb_jf_fresh_blocks(dfctx->jfctx, dbf->blkno, dbf->size);
+}
+
+static int smdb_dbf_initdb(struct smdb_dbfile_ctx *dfctx,
 			   struct smdb_db_config const *dbcfg)
 {
 	smdb_u32 i, tbl_nblocks;
+	struct smdb_cfile_ctx *cfctx = dfctx->cfctx;
 	struct smdb_bc_node *mbcn, *bcn;
 	struct smdb_db_header *hdr;
 
@@ -336,6 +617,8 @@ static int smdb_dbf_initdb(struct smdb_cfile_ctx *cfctx,
 		hdr->bitmap.size = 1;
 	hdr->blk_count = hdr->bitmap.size * dbcfg->blk_size * 8;
 	hdr->num_tables = dbcfg->num_tables;
+	hdr->hash_seed_lo = (smdb_u32) dbcfg->hash_seed;
+	hdr->hash_seed_hi = (smdb_u32) (dbcfg->hash_seed >> 32);
 
 	/*
 	 * Initial space for the bitmap. From block 1 ahead ...
@@ -357,9 +640,9 @@ static int smdb_dbf_initdb(struct smdb_cfile_ctx *cfctx,
 	 */
 	tbl_nblocks = (dbcfg->num_tables * sizeof(struct smdb_db_table)) /
 		dbcfg->blk_size + 1;
-	if (smdb_dbf_setbmbits(cfctx, hdr, 0, 1 + hdr->bitmap.size,
+	if (smdb_dbf_setbmbits(dfctx, hdr, 0, 1 + hdr->bitmap.size,
 			       1) < 0 ||
-	    smdb_dbf_alloc_file(cfctx, tbl_nblocks, &hdr->tables) < 0) {
+	    smdb_dbf_alloc_file(dfctx, tbl_nblocks, &hdr->tables) < 0) {
 		smdb_cf_set_block_dirty(cfctx, mbcn);
 		smdb_cf_release_block(cfctx, mbcn);
 		return -1;
@@ -372,14 +655,30 @@ static int smdb_dbf_initdb(struct smdb_cfile_ctx *cfctx,
 
 static struct smdb_dbfile_ctx *smdb_dbf_alloc_ctx(struct smdbxi_factory *fac,
 						  struct smdbxi_file *bfile,
-						  unsigned int blk_size)
+						  unsigned int blk_size,
+						  struct smdb_db_config const *dbcfg)
 {
 	struct smdbxi_mem *mem;
 	struct smdbxi_fs *fs;
 	struct smdb_jfile_ctx *jfctx;
 	struct smdb_dbfile_ctx *dfctx;
-
-	if (smdb_jf_create(fac, bfile, blk_size, &jfctx) < 0)
+	struct smdb_jf_config jcfg;
+
+	MZERO(jcfg);
+	jcfg.blk_size = blk_size;
+	jcfg.group_max = dbcfg->group_max;
+	jcfg.group_blocks = dbcfg->group_blocks;
+	jcfg.ckpt_blocks = dbcfg->ckpt_blocks;
+	jcfg.prealloc_blocks = dbcfg->prealloc_blocks;
+	if (dbcfg->pin_size > 0)
+		jcfg.append_blocks = SMDB_DBF_APPEND_BLOCKS;
+	jcfg.play_cb = dbcfg->play_cb;
+	jcfg.play_priv = dbcfg->play_priv;
+	jcfg.durable_cb = dbcfg->durable_cb;
+	jcfg.durable_priv = dbcfg->durable_priv;
+	jcfg.durability = (int) dbcfg->durability;
+	jcfg.sync_ms = dbcfg->sync_ms;
+	if (smdb_jf_create(fac, bfile, &jcfg, &jfctx) < 0)
 		return NULL;
 
 	mem = SMDBXI_FC_MEM(fac);
@@ -411,15 +710,17 @@ int smdb_dbf_create(struct smdbxi_factory *fac, struct smdbxi_file *bfile,
 	if (dbcfg->blk_size < SMDB_MIN_BLKSIZE)
 		return -1;
 
-	if ((dfctx = smdb_dbf_alloc_ctx(fac, bfile, dbcfg->blk_size)) == NULL)
+	if ((dfctx = smdb_dbf_alloc_ctx(fac, bfile, dbcfg->blk_size,
+					 dbcfg)) == NULL)
 		return -1;
 
 	MZERO(bcfg);
 	bcfg.blk_size = dbcfg->blk_size;
 	bcfg.blk_max = dbcfg->cache_size / bcfg.blk_size + 1;
+	bcfg.pin_max = dbcfg->pin_size / bcfg.blk_size;
 	if (SMDBXI_FL_TRUNCATE(dfctx->bfile, 0) < 0 ||
 	    smdb_cf_create(fac, dfctx->bfile, &bcfg, &dfctx->cfctx) < 0 ||
-	    smdb_dbf_initdb(dfctx->cfctx, dbcfg) < 0 ||
+	    smdb_dbf_initdb(dfctx, dbcfg) < 0 ||
 	    smdb_dbf_sync(dfctx) < 0) {
 		smdb_dbf_free(dfctx);
 		return -1;
@@ -433,9 +734,17 @@ int smdb_dbf_create(struct smdbxi_factory *fac, struct smdbxi_file *bfile,
 static int smdb_dbf_get_header(struct smdbxi_file *bfile,
 			       struct smdb_db_header *hdr)
 {
-	if (smdb_off_read(bfile, 0, hdr, sizeof(*hdr)) != sizeof(*hdr) ||
-	    smdb_memcmp(hdr->magic, SMDB_DBF_MAGIC, sizeof(hdr->magic)) != 0)
+	/*
+	 * Databases written by a different version of the format are told
+	 * apart from files which are not databases at all. There is no
+	 * upgrade path, so they are refused before the journal is touched.
+	 */
+	if (smdb_off_read(bfile, 0, hdr, sizeof(*hdr)) != sizeof(*hdr))
 		return -1;
+	if (smdb_memcmp(hdr->magic, SMDB_DBF_MAGIC, sizeof(hdr->magic)) != 0)
+		return smdb_memcmp(hdr->magic, SMDB_DBF_MAGIC_BASE,
+				   sizeof(SMDB_DBF_MAGIC_BASE) - 1) == 0 ?
+			SMDB_DBF_ERR_FORMAT: -1;
 
 	return 0;
 }
@@ -444,17 +753,21 @@ int smdb_dbf_open(struct smdbxi_factory *fac, struct smdbxi_file *bfile,
 		  struct smdb_db_config const *dbcfg,
 		  struct smdb_dbfile_ctx **pdfctx)
 {
+	int error;
 	struct smdb_dbfile_ctx *dfctx;
 	struct smdb_db_header hdr;
 	struct smdb_bc_config bcfg;
 
-	if (smdb_dbf_get_header(bfile, &hdr) < 0 ||
-	    (dfctx = smdb_dbf_alloc_ctx(fac, bfile, hdr.blk_size)) == NULL)
+	if ((error = smdb_dbf_get_header(bfile, &hdr)) < 0)
+		return error;
+	if ((dfctx = smdb_dbf_alloc_ctx(fac, bfile, hdr.blk_size,
+					dbcfg)) == NULL)
 		return -1;
 
 	MZERO(bcfg);
 	bcfg.blk_size = hdr.blk_size;
 	bcfg.blk_max = dbcfg->cache_size / hdr.blk_size + 1;
+	bcfg.pin_max = dbcfg->pin_size / hdr.blk_size;
 	if (smdb_cf_create(fac, dfctx->bfile, &bcfg, &dfctx->cfctx) < 0) {
 		smdb_dbf_free(dfctx);
 		return -1;
@@ -476,6 +789,8 @@ void smdb_dbf_free(struct smdb_dbfile_ctx *dfctx)
 		SMDBXI_RELEASE(dfctx->bfile);
 		smdb_jf_free(dfctx->jfctx);
 		SMDBXI_RELEASE(dfctx->fs);
+		if (dfctx->fsum != NULL)
+			SMDBXI_MM_FREE(mem, dfctx->fsum);
 		SMDBXI_MM_FREE(mem, dfctx);
 		SMDBXI_RELEASE(mem);
 	}
@@ -539,791 +854,2985 @@ static int smdb_dbf_grab_env(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
 	return 0;
 }
 
-static int smdb_dbf_rec_alloc(struct smdb_dbfile_ctx *dfctx,
-			      struct smdb_db_header *hdr,
-			      struct smdb_db_file const *dbf,
-			      struct smdb_db_rstorage *stg,
-			      struct smdb_db_record *rec)
+static int smdb_dbf_file_small(struct smdb_db_file const *dbf)
 {
-	smdb_u32 i;
-	struct smdb_bc_node *bcn;
-
-	MZERO(*rec);
-	if ((rec->record = SMDBXI_MM_ALLOC(dfctx->mem,
-					   dbf->size * hdr->blk_size)) == NULL)
-		return -1;
-	rec->key.data = (char *) rec->record + sizeof(struct smdb_db_rstorage);
-	rec->key.size = stg->ksize;
-	rec->data.data = (char *) rec->record + sizeof(struct smdb_db_rstorage) +
-		stg->ksize;
-	rec->data.size = stg->dsize;
-
-	smdb_memcpy(rec->record, stg, hdr->blk_size);
-
-	for (i = 1; i < dbf->size; i++) {
-		if ((bcn = smdb_cf_get_block(dfctx->cfctx, dbf->blkno + i,
-					     0)) == NULL) {
-			smdb_dbf_free_record(dfctx, rec);
-			return -1;
-		}
-
-		smdb_memcpy((char *) rec->record + i * hdr->blk_size,
-			    smdb_bc_get_block_data(bcn), hdr->blk_size);
-
-		smdb_cf_release_block(dfctx->cfctx, bcn);
-	}
-
-	return 0;
+	return (dbf->size & SMDB_DBF_SMALL) != 0;
 }
 
-static int smdb_dbf_match_key(struct smdb_dbfile_ctx *dfctx,
-			      struct smdb_db_header *hdr, struct smdb_db_file const *dbf,
-			      struct smdb_db_ckey const *key,
-			      struct smdb_db_cdata const *data,
-			      struct smdb_db_record *rec)
+static struct smdb_db_rstorage *smdb_dbf_map_rec(struct smdb_cfile_ctx *cfctx,
+						 struct smdb_db_file const *dbf,
+						 int writep,
+						 struct smdb_bc_node **pbcn)
 {
-	smdb_u32 csize;
+	smdb_u32 idx;
 	struct smdb_bc_node *bcn;
-	struct smdb_db_rstorage *stg;
-
-	if ((bcn = smdb_cf_get_block(dfctx->cfctx, dbf->blkno, 0)) == NULL)
-		return -1;
-	stg = (struct smdb_db_rstorage *) smdb_bc_get_block_data(bcn);
+	struct smdb_db_spage *spg;
+	struct smdb_db_sslot *sslt;
 
 	/*
-	 * A few fast checks before loading the record.
-	 * If the keys length does not match, we are not at home.
-	 */
-	if (stg->ksize != key->size ||
-	    (data != NULL && stg->dsize != data->size)) {
-		smdb_cf_release_block(dfctx->cfctx, bcn);
-		return 0;
-	}
-	/*
-	 * Compare the initial key area fitting the first block, and give
-	 * up if not matching.
-	 */
-	csize = hdr->blk_size - sizeof(struct smdb_db_rstorage);
-	if (csize > (smdb_u32) key->size)
-		csize = (smdb_u32) key->size;
-	if (smdb_memcmp(key->data,
-			(char *) stg + sizeof(struct smdb_db_rstorage),
-			csize) != 0) {
-		smdb_cf_release_block(dfctx->cfctx, bcn);
-		return 0;
-	}
-	/*
-	 * Alloc and load the whole record at this point.
+	 * Returns the record storage header, either at the beginning of the
+	 * record extent, or within the slotted page holding the record.
 	 */
-	if (smdb_dbf_rec_alloc(dfctx, hdr, dbf, stg, rec) < 0) {
-		smdb_cf_release_block(dfctx->cfctx, bcn);
-		return -1;
+	if ((bcn = smdb_cf_get_block(cfctx, dbf->blkno, writep)) == NULL)
+		return NULL;
+	if (!smdb_dbf_file_small(dbf)) {
+		*pbcn = bcn;
+		return (struct smdb_db_rstorage *) smdb_bc_get_block_data(bcn);
 	}
-	smdb_cf_release_block(dfctx->cfctx, bcn);
-
-	/*
-	 * If the whole keys do not match, free the newly allocated record
-	 * and return a no-match.
-	 */
-	if (smdb_memcmp(key->data, rec->key.data, key->size) != 0 ||
-	    (data != NULL && smdb_memcmp(data->data, rec->data.data,
-					 data->size) != 0)) {
-		smdb_dbf_free_record(dfctx, rec);
-		return 0;
+	spg = (struct smdb_db_spage *) smdb_bc_get_block_data(bcn);
+	sslt = (struct smdb_db_sslot *) (spg + 1);
+	idx = dbf->size & ~SMDB_DBF_SMALL;
+	if (idx >= spg->nslots || sslt[idx].size == 0) {
+		smdb_cf_release_block(cfctx, bcn);
+		return NULL;
 	}
+	*pbcn = bcn;
 
-	return 1;
+	return (struct smdb_db_rstorage *) ((char *) spg + sslt[idx].offset);
 }
 
-static int smdb_dbf_file_available(struct smdb_db_file const *dbf)
+static smdb_u32 smdb_dbf_spage_align(smdb_u32 size)
 {
-	return dbf->size == 0 || dbf->blkno == 0;
+	/*
+	 * Records inside slotted pages start at offsets aligned for the
+	 * smdb_db_rstorage header in front of them.
+	 */
+	return (size + SMDB_DBF_SMALL_ALIGN - 1) &
+		~(smdb_u32) (SMDB_DBF_SMALL_ALIGN - 1);
 }
 
-static int smdb_dbf_file_empty(struct smdb_db_file const *dbf)
+static smdb_u32 smdb_dbf_spage_end(struct smdb_db_header const *hdr)
 {
-	return dbf->size == 0;
+	return hdr->blk_size & ~(smdb_u32) (SMDB_DBF_SMALL_ALIGN - 1);
 }
 
-static int smdb_dbf_file_deleted(struct smdb_db_file const *dbf)
+static smdb_u32 smdb_dbf_spage_room(struct smdb_db_spage const *spg)
 {
-	return dbf->size != 0 && dbf->blkno == 0;
+	return spg->dstart - sizeof(struct smdb_db_spage) -
+		spg->nslots * sizeof(struct smdb_db_sslot);
 }
 
-static void smdb_dbf_file_set_deleted(struct smdb_db_file *dbf)
+static int smdb_dbf_spage_compact(struct smdb_dbfile_ctx *dfctx,
+				  struct smdb_db_header *hdr,
+				  struct smdb_db_spage *spg)
 {
-	dbf->blkno = 0;
-}
+	smdb_u32 i, dstart;
+	char *buf;
+	struct smdb_db_sslot *sslt;
 
-static int smdb_dbf_delete_file(struct smdb_cfile_ctx *cfctx,
+	/*
+	 * Move all the live records at the end of the page, so that the
+	 * space left by the deleted ones becomes contiguous.
+	 */
+	if ((buf = (char *) SMDBXI_MM_ALLOC(dfctx->mem, hdr->blk_size)) == NULL)
+		return -1;
+	sslt = (struct smdb_db_sslot *) (spg + 1);
+	for (i = 0, dstart = smdb_dbf_spage_end(hdr); i < spg->nslots; i++) {
+		if (sslt[i].size == 0)
+			continue;
+		dstart -= sslt[i].size;
+		smdb_memcpy(buf + dstart, (char *) spg + sslt[i].offset,
+			    sslt[i].size);
+		sslt[i].offset = dstart;
+	}
+	smdb_memcpy((char *) spg + dstart, buf + dstart,
+		    smdb_dbf_spage_end(hdr) - dstart);
+	SMDBXI_MM_FREE(dfctx->mem, buf);
+	spg->dstart = dstart;
+	spg->nfree = 0;
+
+	return 0;
+}
+
+static int smdb_dbf_spage_insert(struct smdb_dbfile_ctx *dfctx,
+				 struct smdb_db_header *hdr,
+				 struct smdb_bc_node *bcn, smdb_u32 rsize,
+				 smdb_u32 *pidx)
+{
+	smdb_u32 idx, need;
+	struct smdb_db_spage *spg;
+	struct smdb_db_sslot *sslt;
+
+	spg = (struct smdb_db_spage *) smdb_bc_get_block_data(bcn);
+	sslt = (struct smdb_db_sslot *) (spg + 1);
+	rsize = smdb_dbf_spage_align(rsize);
+	/*
+	 * Re-use a directory entry left by a deleted record, if any.
+	 */
+	for (idx = 0; idx < spg->nslots && sslt[idx].size != 0; idx++);
+	need = rsize;
+	if (idx == spg->nslots)
+		need += sizeof(struct smdb_db_sslot);
+	if (smdb_dbf_spage_room(spg) < need) {
+		if (smdb_dbf_spage_room(spg) + spg->nfree < need)
+			return 0;
+		if (smdb_dbf_spage_compact(dfctx, hdr, spg) < 0)
+			return -1;
+		smdb_cf_set_block_dirty(dfctx->cfctx, bcn);
+	}
+	if (idx == spg->nslots)
+		spg->nslots++;
+	spg->dstart -= rsize;
+	spg->nused++;
+	sslt[idx].offset = spg->dstart;
+	sslt[idx].size = rsize;
+	smdb_cf_set_range_dirty(dfctx->cfctx, bcn, spg, sizeof(*spg));
+	smdb_cf_set_range_dirty(dfctx->cfctx, bcn, &sslt[idx], sizeof(sslt[idx]));
+	*pidx = idx;
+
+	return 1;
+}
+
+static int smdb_dbf_spage_alloc(struct smdb_dbfile_ctx *dfctx,
+				struct smdb_db_header *hdr,
+				struct smdb_bc_node **pbcn)
+{
+	struct smdb_db_file pgf;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_spage *spg;
+
+	if (smdb_dbf_alloc_file(dfctx, 1, &pgf) < 0)
+		return -1;
+	if (smdb_dbf_fresh_file(dfctx, &pgf) < 0 ||
+	    (bcn = smdb_cf_get_block(dfctx->cfctx, pgf.blkno, 1)) == NULL) {
+		smdb_dbf_release_file(dfctx, pgf.blkno, pgf.size);
+		return -1;
+	}
+	spg = (struct smdb_db_spage *) smdb_bc_get_block_data(bcn);
+	MZERO(*spg);
+	spg->dstart = smdb_dbf_spage_end(hdr);
+	smdb_cf_set_range_dirty(dfctx->cfctx, bcn, spg, sizeof(*spg));
+	*pbcn = bcn;
+
+	return 0;
+}
+
+static void smdb_dbf_set_spage(struct smdb_dbfile_ctx *dfctx,
+			       struct smdb_db_env *env, smdb_u32 blkno)
+{
+	env->tbl->spage = blkno;
+	smdb_cf_set_range_dirty(dfctx->cfctx, env->tbcn, env->tbl,
+				sizeof(*env->tbl));
+}
+
+static int smdb_dbf_small_put(struct smdb_dbfile_ctx *dfctx,
+			      struct smdb_db_env *env,
+			      struct smdb_db_ckey const *key,
+			      struct smdb_db_cdata *data, smdb_u32 rsize,
+			      smdb_u32 hashv, struct smdb_db_file *dbf)
+{
+	int error;
+	smdb_u32 idx;
+	struct smdb_bc_node *bcn = NULL;
+	struct smdb_db_spage *spg;
+	struct smdb_db_rstorage *stg;
+
+	/*
+	 * Records go inside the current page of the table, and a new page
+	 * is started once that gets full.
+	 */
+	if (env->tbl->spage != 0) {
+		if ((bcn = smdb_cf_get_block(dfctx->cfctx, env->tbl->spage,
+					     1)) == NULL)
+			return -1;
+		if ((error = smdb_dbf_spage_insert(dfctx, env->hdr, bcn, rsize,
+						   &idx)) < 0) {
+			smdb_cf_release_block(dfctx->cfctx, bcn);
+			return -1;
+		}
+		if (error == 0) {
+			smdb_cf_release_block(dfctx->cfctx, bcn);
+			bcn = NULL;
+		}
+	}
+	if (bcn == NULL) {
+		if (smdb_dbf_spage_alloc(dfctx, env->hdr, &bcn) < 0)
+			return -1;
+		if (smdb_dbf_spage_insert(dfctx, env->hdr, bcn, rsize,
+					  &idx) <= 0) {
+			smdb_cf_release_block(dfctx->cfctx, bcn);
+			return -1;
+		}
+		smdb_dbf_set_spage(dfctx, env, bcn->blkno);
+	}
+	spg = (struct smdb_db_spage *) smdb_bc_get_block_data(bcn);
+	stg = (struct smdb_db_rstorage *) ((char *) spg + spg->dstart);
+	stg->hashv = hashv;
+	stg->ksize = key->size;
+	stg->dsize = data->size;
+	smdb_memcpy((char *) (stg + 1), key->data, key->size);
+	smdb_memcpy((char *) (stg + 1) + key->size, data->data, data->size);
+	smdb_cf_set_range_dirty(dfctx->cfctx, bcn, stg, rsize);
+
+	dbf->blkno = bcn->blkno;
+	dbf->size = SMDB_DBF_SMALL | idx;
+	smdb_cf_release_block(dfctx->cfctx, bcn);
+
+	return 0;
+}
+
+static int smdb_dbf_small_delete(struct smdb_dbfile_ctx *dfctx,
+				 struct smdb_db_env *env,
+				 struct smdb_db_file const *dbf)
+{
+	smdb_u32 idx, blkno;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_spage *spg;
+	struct smdb_db_sslot *sslt;
+
+	blkno = dbf->blkno;
+	if ((bcn = smdb_cf_get_block(dfctx->cfctx, blkno, 1)) == NULL)
+		return -1;
+	spg = (struct smdb_db_spage *) smdb_bc_get_block_data(bcn);
+	sslt = (struct smdb_db_sslot *) (spg + 1);
+	idx = dbf->size & ~SMDB_DBF_SMALL;
+	if (idx >= spg->nslots || sslt[idx].size == 0) {
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+		return -1;
+	}
+	if (sslt[idx].offset == spg->dstart)
+		spg->dstart += sslt[idx].size;
+	else
+		spg->nfree += sslt[idx].size;
+	sslt[idx].offset = 0;
+	sslt[idx].size = 0;
+	smdb_cf_set_range_dirty(dfctx->cfctx, bcn, &sslt[idx], sizeof(sslt[idx]));
+	for (; spg->nslots > 0 && sslt[spg->nslots - 1].size == 0; spg->nslots--);
+	spg->nused--;
+	smdb_cf_set_range_dirty(dfctx->cfctx, bcn, spg, sizeof(*spg));
+	/*
+	 * Empty pages go back to the free space, while the ones getting
+	 * at least half empty become the current page of the table, so
+	 * that the space left by the deleted records gets re-used.
+	 */
+	if (spg->nused == 0) {
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+		if (env->tbl->spage == blkno)
+			smdb_dbf_set_spage(dfctx, env, 0);
+		return smdb_dbf_release_file(dfctx, blkno, 1);
+	}
+	if (env->tbl->spage != blkno &&
+	    smdb_dbf_spage_room(spg) + spg->nfree >= env->hdr->blk_size / 2)
+		smdb_dbf_set_spage(dfctx, env, blkno);
+	smdb_cf_release_block(dfctx->cfctx, bcn);
+
+	return 0;
+}
+
+static int smdb_dbf_rec_alloc(struct smdb_dbfile_ctx *dfctx,
+			      struct smdb_db_header *hdr,
+			      struct smdb_db_file const *dbf,
+			      struct smdb_db_rstorage *stg,
+			      struct smdb_db_record *rec)
+{
+	smdb_u32 i, rsize;
+	struct smdb_bc_node *bcn;
+
+	MZERO(*rec);
+	rsize = smdb_dbf_file_small(dbf) ?
+		sizeof(struct smdb_db_rstorage) + stg->ksize + stg->dsize:
+		dbf->size * hdr->blk_size;
+	if ((rec->record = SMDBXI_MM_ALLOC(dfctx->mem, rsize)) == NULL)
+		return -1;
+	rec->key.data = (char *) rec->record + sizeof(struct smdb_db_rstorage);
+	rec->key.size = stg->ksize;
+	rec->data.data = (char *) rec->record + sizeof(struct smdb_db_rstorage) +
+		stg->ksize;
+	rec->data.size = stg->dsize;
+
+	if (smdb_dbf_file_small(dbf)) {
+		smdb_memcpy(rec->record, stg, rsize);
+		return 0;
+	}
+	smdb_memcpy(rec->record, stg, hdr->blk_size);
+
+	for (i = 1; i < dbf->size; i++) {
+		if ((bcn = smdb_cf_get_block(dfctx->cfctx, dbf->blkno + i,
+					     0)) == NULL) {
+			smdb_dbf_free_record(dfctx, rec);
+			return -1;
+		}
+
+		smdb_memcpy((char *) rec->record + i * hdr->blk_size,
+			    smdb_bc_get_block_data(bcn), hdr->blk_size);
+
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+	}
+
+	return 0;
+}
+
+void smdb_dbf_release_view(struct smdb_dbfile_ctx *dfctx,
+			   struct smdb_db_view *view)
+{
+	unsigned long i;
+
+	/*
+	 * Like smdb_dbf_free_record(), this may be called multiple times
+	 * over the same view, or over one which was never filled.
+	 */
+	for (i = 0; i < view->nblks; i++)
+		smdb_cf_release_block(dfctx->cfctx, view->bcns != NULL ?
+				      view->bcns[i]: view->bcn);
+	SMDBXI_MM_FREE(dfctx->mem, view->iovs);
+	SMDBXI_MM_FREE(dfctx->mem, view->copy);
+	view->niov = 0;
+	view->iovs = NULL;
+	view->nblks = 0;
+	view->bcns = NULL;
+	view->bcn = NULL;
+	view->copy = NULL;
+}
+
+static void const *smdb_dbf_view_span(struct smdb_db_view const *view,
+				      unsigned long off, unsigned long size)
+{
+	unsigned long i;
+	struct smdb_db_iovec const *iov = SMDB_DBF_VIEW_IOV(view);
+
+	/*
+	 * Returns a pointer to the record bytes at offset "off" of the
+	 * key and data area, provided that they do not cross a block.
+	 */
+	for (i = 0; i + 1 < view->niov && off >= iov[i].size; i++)
+		off -= iov[i].size;
+	if (off + size > iov[i].size)
+		return NULL;
+
+	return (char const *) iov[i].data + off;
+}
+
+static int smdb_dbf_view_cmp(struct smdb_db_view const *view,
+			     unsigned long off, void const *data,
+			     unsigned long size)
+{
+	unsigned long i, csize;
+	char const *cdata = (char const *) data;
+	struct smdb_db_iovec const *iov = SMDB_DBF_VIEW_IOV(view);
+
+	for (i = 0; i < view->niov && size > 0; i++) {
+		if (off >= iov[i].size) {
+			off -= iov[i].size;
+			continue;
+		}
+		csize = MIN(iov[i].size - off, size);
+		if (smdb_memcmp((char const *) iov[i].data + off,
+				cdata, csize) != 0)
+			return 1;
+		cdata += csize;
+		size -= csize;
+		off = 0;
+	}
+
+	return size != 0;
+}
+
+static int smdb_dbf_view_copy(struct smdb_dbfile_ctx *dfctx,
+			      struct smdb_db_header *hdr,
+			      struct smdb_db_file const *dbf,
+			      struct smdb_db_rstorage *stg,
+			      struct smdb_db_view *view)
+{
+	int error;
+	unsigned long i;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_record rec;
+
+	/*
+	 * The cache could not pin the whole record, so the view falls back
+	 * to a copy of it, loaded one block at a time like smdb_dbf_get()
+	 * does. Only the first block, which "stg" points to, is kept until
+	 * the copy is done.
+	 */
+	bcn = view->bcns[0];
+	for (i = 1; i < view->nblks; i++)
+		smdb_cf_release_block(dfctx->cfctx, view->bcns[i]);
+	SMDBXI_MM_FREE(dfctx->mem, view->iovs);
+	view->iovs = NULL;
+	view->bcns = NULL;
+	view->nblks = 0;
+	error = smdb_dbf_rec_alloc(dfctx, hdr, dbf, stg, &rec);
+	smdb_cf_release_block(dfctx->cfctx, bcn);
+	if (error < 0)
+		return -1;
+	view->copy = rec.record;
+	view->iov1.data = rec.key.data;
+	view->iov1.size = rec.key.size + rec.data.size;
+	view->niov = 1;
+
+	return 0;
+}
+
+static int smdb_dbf_view_map(struct smdb_dbfile_ctx *dfctx,
+			     struct smdb_db_header *hdr,
+			     struct smdb_db_file const *dbf,
+			     struct smdb_bc_node *bcn,
+			     struct smdb_db_rstorage *stg,
+			     struct smdb_db_view *view)
+{
+	smdb_u32 i, n;
+	unsigned long rsize, size;
+	struct smdb_db_iovec *iov;
+
+	/*
+	 * The view takes over the reference to the first record block.
+	 * Records fitting a single block need nothing more, while larger
+	 * ones get all their blocks pinned, with an iovec entry each.
+	 */
+	MZERO(*view);
+	view->key.size = stg->ksize;
+	view->data.size = stg->dsize;
+	rsize = (unsigned long) stg->ksize + stg->dsize;
+	n = smdb_dbf_file_small(dbf) ? 1:
+		(smdb_u32) ((sizeof(*stg) + rsize + hdr->blk_size - 1) /
+			    hdr->blk_size);
+	if (n <= 1) {
+		view->bcn = bcn;
+		view->nblks = 1;
+		view->iov1.data = stg + 1;
+		view->iov1.size = rsize;
+		view->niov = 1;
+	} else {
+		size = n * (sizeof(*iov) + sizeof(struct smdb_bc_node *));
+		if ((iov = (struct smdb_db_iovec *)
+		     SMDBXI_MM_ALLOC(dfctx->mem, size)) == NULL) {
+			smdb_cf_release_block(dfctx->cfctx, bcn);
+			return -1;
+		}
+		view->iovs = iov;
+		view->bcns = (struct smdb_bc_node **) (iov + n);
+		view->bcns[0] = bcn;
+		view->nblks = 1;
+		size = hdr->blk_size - sizeof(*stg);
+		iov[0].data = stg + 1;
+		iov[0].size = size;
+		for (i = 1, rsize -= size; i < n; i++, rsize -= size) {
+			bcn = smdb_cf_get_block(dfctx->cfctx, dbf->blkno + i, 0);
+			if (bcn == NULL) {
+				if (smdb_dbf_view_copy(dfctx, hdr, dbf, stg,
+						       view) < 0)
+					return -1;
+				break;
+			}
+			size = MIN(rsize, hdr->blk_size);
+			view->bcns[i] = bcn;
+			view->nblks = i + 1;
+			iov[i].data = smdb_bc_get_block_data(bcn);
+			iov[i].size = size;
+		}
+		if (view->copy == NULL)
+			view->niov = n;
+	}
+	view->key.data = smdb_dbf_view_span(view, 0, view->key.size);
+	view->data.data = smdb_dbf_view_span(view, view->key.size,
+					     view->data.size);
+
+	return 0;
+}
+
+static int smdb_dbf_match_key(struct smdb_dbfile_ctx *dfctx,
+			      struct smdb_db_header *hdr, struct smdb_db_file const *dbf,
+			      struct smdb_db_ckey const *key,
+			      struct smdb_db_cdata const *data,
+			      struct smdb_db_record *rec,
+			      struct smdb_db_view *view)
+{
+	smdb_u32 csize;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_rstorage *stg;
+
+	if ((stg = smdb_dbf_map_rec(dfctx->cfctx, dbf, 0, &bcn)) == NULL)
+		return -1;
+
+	/*
+	 * A few fast checks before loading the record.
+	 * If the keys length does not match, we are not at home.
+	 */
+	if (stg->ksize != key->size ||
+	    (data != NULL && stg->dsize != data->size)) {
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+		return 0;
+	}
+	/*
+	 * Compare the initial key area fitting the first block, and give
+	 * up if not matching.
+	 */
+	csize = smdb_dbf_file_small(dbf) ? (smdb_u32) key->size:
+		hdr->blk_size - sizeof(struct smdb_db_rstorage);
+	if (csize > (smdb_u32) key->size)
+		csize = (smdb_u32) key->size;
+	if (smdb_memcmp(key->data,
+			(char *) stg + sizeof(struct smdb_db_rstorage),
+			csize) != 0) {
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+		return 0;
+	}
+	/*
+	 * A view pins the record blocks in place of loading a copy of them,
+	 * and it is dropped again if the whole keys do not match.
+	 */
+	if (view != NULL) {
+		if (smdb_dbf_view_map(dfctx, hdr, dbf, bcn, stg, view) < 0)
+			return -1;
+		if (smdb_dbf_view_cmp(view, 0, key->data, key->size) != 0 ||
+		    (data != NULL &&
+		     smdb_dbf_view_cmp(view, key->size, data->data,
+				       data->size) != 0)) {
+			smdb_dbf_release_view(dfctx, view);
+			return 0;
+		}
+
+		return 1;
+	}
+	/*
+	 * Alloc and load the whole record at this point.
+	 */
+	if (smdb_dbf_rec_alloc(dfctx, hdr, dbf, stg, rec) < 0) {
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+		return -1;
+	}
+	smdb_cf_release_block(dfctx->cfctx, bcn);
+
+	/*
+	 * If the whole keys do not match, free the newly allocated record
+	 * and return a no-match.
+	 */
+	if (smdb_memcmp(key->data, rec->key.data, key->size) != 0 ||
+	    (data != NULL && smdb_memcmp(data->data, rec->data.data,
+					 data->size) != 0)) {
+		smdb_dbf_free_record(dfctx, rec);
+		return 0;
+	}
+
+	return 1;
+}
+
+static smdb_u32 smdb_dbf_hash_slots(struct smdb_db_header const *hdr,
+				    smdb_u32 hblocks)
+{
+	/*
+	 * Slots do not straddle blocks, so the tail of every hash block
+	 * might be left unused.
+	 */
+	return hblocks * (hdr->blk_size / sizeof(struct smdb_db_slot));
+}
+
+static int smdb_dbf_file_available(struct smdb_db_file const *dbf)
+{
+	return dbf->size == 0 || dbf->blkno == 0;
+}
+
+static int smdb_dbf_file_empty(struct smdb_db_file const *dbf)
+{
+	return dbf->size == 0;
+}
+
+static int smdb_dbf_file_deleted(struct smdb_db_file const *dbf)
+{
+	return dbf->size != 0 && dbf->blkno == 0;
+}
+
+static void smdb_dbf_file_set_deleted(struct smdb_db_file *dbf)
+{
+	dbf->blkno = 0;
+}
+
+static int smdb_dbf_delete_file(struct smdb_dbfile_ctx *dfctx,
+				struct smdb_db_env *env,
 				struct smdb_db_file *dbf)
 {
-	if (smdb_dbf_bfree(cfctx, dbf->blkno, dbf->size) < 0)
+	if (smdb_dbf_file_small(dbf)) {
+		if (smdb_dbf_small_delete(dfctx, env, dbf) < 0)
+			return -1;
+	} else if (smdb_dbf_release_file(dfctx, dbf->blkno, dbf->size) < 0)
+		return -1;
+	smdb_dbf_file_set_deleted(dbf);
+
+	return 0;
+}
+
+static smdb_u32 smdb_dbf_lh_slots(struct smdb_db_header const *hdr)
+{
+	return (hdr->blk_size - sizeof(struct smdb_db_bucket)) /
+		sizeof(struct smdb_db_slot);
+}
+
+static smdb_u32 smdb_dbf_lh_buckets(struct smdb_db_table const *tbl)
+{
+	return (tbl->nbase << tbl->level) + tbl->split;
+}
+
+static smdb_u32 smdb_dbf_lh_bucket(struct smdb_db_table const *tbl,
+				   smdb_u32 hashv)
+{
+	smdb_u32 bucket;
+
+	/*
+	 * Buckets before the split position have already been split, so
+	 * they use the next level addressing.
+	 */
+	bucket = hashv % (tbl->nbase << tbl->level);
+	if (bucket < tbl->split)
+		bucket = hashv % (tbl->nbase << (tbl->level + 1));
+
+	return bucket;
+}
+
+static smdb_u32 smdb_dbf_lh_segsize(smdb_u32 nbase, smdb_u32 seg)
+{
+	return seg == 0 ? nbase: nbase << (seg - 1);
+}
+
+static smdb_u32 smdb_dbf_lh_segment(smdb_u32 nbase, smdb_u32 bucket,
+				    smdb_u32 *poffset)
+{
+	smdb_u32 seg;
+
+	for (seg = 0; bucket >= smdb_dbf_lh_segsize(nbase, seg); seg++)
+		bucket -= smdb_dbf_lh_segsize(nbase, seg);
+	*poffset = bucket;
+
+	return seg;
+}
+
+static int smdb_dbf_lh_block(struct smdb_cfile_ctx *cfctx,
+			     struct smdb_db_table const *tbl, smdb_u32 bucket,
+			     smdb_u32 *pblkno)
+{
+	smdb_u32 seg, offset;
+	smdb_u32 *segs;
+	struct smdb_bc_node *bcn;
+
+	seg = smdb_dbf_lh_segment(tbl->nbase, bucket, &offset);
+	if ((bcn = smdb_cf_get_block(cfctx, tbl->hash.blkno, 0)) == NULL)
+		return -1;
+	segs = (smdb_u32 *) smdb_bc_get_block_data(bcn);
+	*pblkno = segs[seg] + offset;
+	smdb_cf_release_block(cfctx, bcn);
+
+	return 0;
+}
+
+static int smdb_dbf_lh_create(struct smdb_dbfile_ctx *dfctx,
+			      struct smdb_db_env *env, smdb_u32 tblsize)
+{
+	smdb_u32 nbase;
+	smdb_u32 *segs;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_file dir, seg;
+
+	nbase = tblsize / smdb_dbf_lh_slots(env->hdr) + 1;
+	if (smdb_dbf_alloc_file(dfctx, 1, &dir) < 0)
+		return -1;
+	if (smdb_cf_zero(dfctx->cfctx, dir.blkno, dir.size) < 0 ||
+	    smdb_dbf_alloc_file(dfctx, nbase, &seg) < 0) {
+		smdb_dbf_release_file(dfctx, dir.blkno, dir.size);
+		return -1;
+	}
+	if (smdb_cf_zero(dfctx->cfctx, seg.blkno, seg.size) < 0 ||
+	    (bcn = smdb_cf_get_block(dfctx->cfctx, dir.blkno, 1)) == NULL) {
+		smdb_dbf_release_file(dfctx, seg.blkno, seg.size);
+		smdb_dbf_release_file(dfctx, dir.blkno, dir.size);
+		return -1;
+	}
+	segs = (smdb_u32 *) smdb_bc_get_block_data(bcn);
+	segs[0] = seg.blkno;
+	smdb_cf_set_range_dirty(dfctx->cfctx, bcn, segs, sizeof(*segs));
+	smdb_cf_release_block(dfctx->cfctx, bcn);
+
+	MZERO(*env->tbl);
+	env->tbl->hash = dir;
+	env->tbl->mode = SMDB_DBF_TBL_LINEAR;
+	env->tbl->nbase = nbase;
+
+	return 0;
+}
+
+static int smdb_dbf_lh_free(struct smdb_dbfile_ctx *dfctx,
+			    struct smdb_db_env *env)
+{
+	smdb_u32 i, nslots, bucket, hblkno, blkno, next, seg;
+	smdb_u32 *segs;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_bucket *bkt;
+	struct smdb_db_slot *slt;
+
+	/*
+	 * Release the storage of every record, and the overflow blocks of
+	 * every bucket.
+	 */
+	nslots = smdb_dbf_lh_slots(env->hdr);
+	for (bucket = 0; bucket < smdb_dbf_lh_buckets(env->tbl); bucket++) {
+		if (smdb_dbf_lh_block(dfctx->cfctx, env->tbl, bucket,
+				      &hblkno) < 0)
+			return -1;
+		for (blkno = hblkno; blkno != 0; blkno = next) {
+			if ((bcn = smdb_cf_get_block(dfctx->cfctx, blkno,
+						     1)) == NULL)
+				return -1;
+			bkt = (struct smdb_db_bucket *) smdb_bc_get_block_data(bcn);
+			slt = (struct smdb_db_slot *) (bkt + 1);
+			for (i = 0; i < nslots; i++, slt++) {
+				if (smdb_dbf_file_available(&slt->file))
+					continue;
+				if (smdb_dbf_delete_file(dfctx, env,
+							 &slt->file) < 0) {
+					smdb_cf_release_block(dfctx->cfctx, bcn);
+					return -1;
+				}
+			}
+			next = bkt->next;
+			smdb_cf_set_block_dirty(dfctx->cfctx, bcn);
+			smdb_cf_release_block(dfctx->cfctx, bcn);
+			if (blkno != hblkno &&
+			    smdb_dbf_release_file(dfctx, blkno, 1) < 0)
+				return -1;
+		}
+	}
+
+	/*
+	 * Release the bucket segments, and the segments block itself.
+	 */
+	if ((bcn = smdb_cf_get_block(dfctx->cfctx, env->tbl->hash.blkno,
+				     0)) == NULL)
+		return -1;
+	segs = (smdb_u32 *) smdb_bc_get_block_data(bcn);
+	for (seg = 0; seg < SMDB_DBF_LH_SEGMENTS && segs[seg] != 0; seg++) {
+		if (smdb_dbf_release_file(dfctx, segs[seg],
+					  smdb_dbf_lh_segsize(env->tbl->nbase,
+							      seg)) < 0) {
+			smdb_cf_release_block(dfctx->cfctx, bcn);
+			return -1;
+		}
+	}
+	smdb_cf_release_block(dfctx->cfctx, bcn);
+
+	return smdb_dbf_release_file(dfctx, env->tbl->hash.blkno,
+				     env->tbl->hash.size);
+}
+
+static int smdb_dbf_lh_find_key(struct smdb_dbfile_ctx *dfctx,
+				struct smdb_db_env *env,
+				struct smdb_db_ckey const *key,
+				struct smdb_db_cdata const *data,
+				struct smdb_db_record *rec,
+				struct smdb_db_kenum *ken, int erase)
+{
+	int match_res;
+	smdb_u32 i, nslots, ord, blkno;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_bucket *bkt;
+	struct smdb_db_slot *slt;
+
+	if (smdb_dbf_lh_block(dfctx->cfctx, env->tbl,
+			      smdb_dbf_lh_bucket(env->tbl, ken->hashv),
+			      &blkno) < 0)
+		return -1;
+	/*
+	 * The whole bucket chain is scanned, skipping the slots the caller
+	 * already went through. The enumeration index is the position
+	 * of the slot within the chain.
+	 */
+	nslots = smdb_dbf_lh_slots(env->hdr);
+	for (ord = 0; blkno != 0;) {
+		if ((bcn = smdb_cf_get_block(dfctx->cfctx, blkno,
+					     erase != 0)) == NULL)
+			return -1;
+		bkt = (struct smdb_db_bucket *) smdb_bc_get_block_data(bcn);
+		slt = (struct smdb_db_slot *) (bkt + 1);
+
+		for (i = 0; i < nslots; i++, slt++, ord++) {
+			if (ord < ken->idx ||
+			    smdb_dbf_file_available(&slt->file) ||
+			    slt->hashv != ken->hashv)
+				continue;
+			if ((match_res = smdb_dbf_match_key(dfctx, env->hdr,
+							    &slt->file, key,
+							    data, rec,
+							    env->view)) < 0) {
+				smdb_cf_release_block(dfctx->cfctx, bcn);
+				return match_res;
+			}
+			if (match_res == 0)
+				continue;
+
+			/*
+			 * Bucket chains are always scanned entirely, so there
+			 * is no need to leave a deleted slot behind.
+			 */
+			if (erase) {
+				if (smdb_dbf_delete_file(dfctx, env, &slt->file) < 0)
+					match_res = -1;
+				else {
+					MZERO(*slt);
+					smdb_cf_set_range_dirty(dfctx->cfctx, bcn,
+								slt, sizeof(*slt));
+				}
+			}
+			smdb_cf_release_block(dfctx->cfctx, bcn);
+			ken->idx = ord;
+			return match_res;
+		}
+
+		blkno = bkt->next;
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+	}
+
+	return 0;
+}
+
+static int smdb_dbf_hash_create(struct smdb_dbfile_ctx *dfctx,
+				struct smdb_db_env *env, smdb_u32 tblsize)
+{
+	smdb_u32 tbl_x_blk, tbl_nblocks;
+	struct smdb_db_file hash;
+
+	tbl_x_blk = env->hdr->blk_size / sizeof(struct smdb_db_table);
+	tbl_nblocks = tblsize / tbl_x_blk + 1;
+
+	if (smdb_dbf_alloc_file(dfctx, tbl_nblocks, &hash) < 0)
+		return -1;
+	/*
+	 * Properly init/zero the newly allocated hash.
+	 */
+	if (smdb_cf_zero(dfctx->cfctx, hash.blkno, hash.size) < 0) {
+		smdb_dbf_release_file(dfctx, hash.blkno, hash.size);
+		return -1;
+	}
+
+	MZERO(*env->tbl);
+	env->tbl->hash = hash;
+
+	return 0;
+}
+
+int smdb_dbf_create_table(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
+			  unsigned int tblsize)
+{
+	return smdb_dbf_create_table_mode(dfctx, tblid, tblsize,
+					  SMDB_DBF_TBL_HASH);
+}
+
+int smdb_dbf_create_table_mode(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
+			       unsigned int tblsize, int mode)
+{
+	return smdb_dbf_create_table_hash(dfctx, tblid, tblsize, mode,
+					  SMDB_DBF_HASH_OAT);
+}
+
+int smdb_dbf_create_table_hash(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
+			       unsigned int tblsize, int mode, int hashfn)
+{
+	int error;
+	struct smdb_db_env env;
+
+	if ((mode != SMDB_DBF_TBL_HASH && mode != SMDB_DBF_TBL_LINEAR &&
+	     mode != SMDB_DBF_TBL_ROBIN) ||
+	    (hashfn != SMDB_DBF_HASH_OAT && hashfn != SMDB_DBF_HASH_XXH64))
+		return -1;
+	if (smdb_dbf_get_env(dfctx, tblid, 1, &env) < 0)
+		return -1;
+	/*
+	 * Fail if exists!
+	 */
+	if (env.tbl->hash.size != 0) {
+		smdb_dbf_release_env(dfctx, &env);
+		return -1;
+	}
+
+	if (mode == SMDB_DBF_TBL_LINEAR)
+		error = smdb_dbf_lh_create(dfctx, &env, (smdb_u32) tblsize);
+	else
+		error = smdb_dbf_hash_create(dfctx, &env, (smdb_u32) tblsize);
+	if (error < 0) {
+		smdb_dbf_release_env(dfctx, &env);
+		return -1;
+	}
+	env.tbl->mode = (smdb_u32) mode;
+	env.tbl->hashfn = (smdb_u32) hashfn;
+
+	smdb_cf_set_range_dirty(dfctx->cfctx, env.tbcn, env.tbl,
+				sizeof(*env.tbl));
+	smdb_cf_set_range_dirty(dfctx->cfctx, env.mbcn, env.hdr,
+				sizeof(*env.hdr));
+
+	smdb_dbf_release_env(dfctx, &env);
+
+	return 0;
+}
+
+static int smdb_dbf_hash_free(struct smdb_dbfile_ctx *dfctx,
+			      struct smdb_db_env *env)
+{
+	smdb_u32 i, blkno, slt_x_blk;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_slot *slt;
+
+	/*
+	 * Loop through every hash entry and release the allocated storage.
+	 */
+	slt_x_blk = env->hdr->blk_size / sizeof(struct smdb_db_slot);
+	for (blkno = 0; blkno < env->tbl->hash.size; blkno++) {
+		if ((bcn = smdb_cf_get_block(dfctx->cfctx, env->tbl->hash.blkno +
+					     blkno, 1)) == NULL)
+			return -1;
+		slt = (struct smdb_db_slot *) smdb_bc_get_block_data(bcn);
+
+		for (i = 0; i < slt_x_blk; i++, slt++) {
+			/*
+			 * If this is an empty slot, or we find a deleted item,
+			 * we need to continue to scan the chain since we want
+			 * to free them all.
+			 */
+			if (smdb_dbf_file_empty(&slt->file) ||
+			    smdb_dbf_file_deleted(&slt->file))
+				continue;
+
+			if (smdb_dbf_delete_file(dfctx, env, &slt->file) < 0) {
+				smdb_cf_release_block(dfctx->cfctx, bcn);
+				return -1;
+			}
+		}
+
+		smdb_cf_set_block_dirty(dfctx->cfctx, bcn);
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+	}
+
+	/*
+	 * Release the space allocated for the hash table itself.
+	 */
+	return smdb_dbf_release_file(dfctx, env->tbl->hash.blkno,
+				     env->tbl->hash.size);
+}
+
+int smdb_dbf_free_table(struct smdb_dbfile_ctx *dfctx, unsigned int tblid)
+{
+	int error;
+	struct smdb_db_env env;
+
+	if (smdb_dbf_get_env(dfctx, tblid, 1, &env) < 0)
+		return -1;
+	/*
+	 * Fail if does not exists!
+	 */
+	if (env.tbl->hash.size == 0) {
+		smdb_dbf_release_env(dfctx, &env);
+		return -1;
+	}
+
+	if (env.tbl->mode == SMDB_DBF_TBL_LINEAR)
+		error = smdb_dbf_lh_free(dfctx, &env);
+	else
+		error = smdb_dbf_hash_free(dfctx, &env);
+	if (error < 0) {
+		smdb_dbf_release_env(dfctx, &env);
+		return -1;
+	}
+
+	MZERO(*env.tbl);
+
+	smdb_cf_set_range_dirty(dfctx->cfctx, env.tbcn, env.tbl,
+				sizeof(*env.tbl));
+	smdb_cf_set_range_dirty(dfctx->cfctx, env.mbcn, env.hdr,
+				sizeof(*env.hdr));
+
+	smdb_dbf_release_env(dfctx, &env);
+
+	return 0;
+}
+
+static smdb_u32 smdb_dbf_purge_slots(struct smdb_db_slot *slt, smdb_u32 i,
+				     smdb_u32 nslots)
+{
+	smdb_u32 count = 0;
+
+	/*
+	 * A deleted slot followed by an empty one does not link any chain
+	 * anymore, so it can be turned into an empty slot, and so can be the
+	 * deleted slots preceding it. Only the slots of the current block
+	 * are considered.
+	 */
+	if (i + 1 >= nslots || !smdb_dbf_file_empty(&slt[i + 1].file))
+		return 0;
+	for (i++; i > 0 && smdb_dbf_file_deleted(&slt[i - 1].file); i--) {
+		MZERO(slt[i - 1]);
+		count++;
+	}
+
+	return count;
+}
+
+static smdb_u32 smdb_dbf_rh_home(smdb_u32 hsize, smdb_u32 hashv)
+{
+	/*
+	 * Robin Hood tables compute probe distances for most of the slots
+	 * they walk, so they map hash values to positions with a multiply
+	 * instead of a division.
+	 */
+	return (smdb_u32) (((smdb_u64) hashv * hsize) >> 32);
+}
+
+static smdb_u32 smdb_dbf_rh_dist(smdb_u32 hsize, smdb_u32 idx, smdb_u32 hashv)
+{
+	smdb_u32 home = smdb_dbf_rh_home(hsize, hashv);
+
+	return idx >= home ? idx - home: idx + hsize - home;
+}
+
+static struct smdb_db_slot *smdb_dbf_get_slot(struct smdb_cfile_ctx *cfctx,
+					      struct smdb_db_env *env,
+					      smdb_u32 idx,
+					      struct smdb_bc_node **pbcn)
+{
+	smdb_u32 slt_x_blk;
+	struct smdb_bc_node *bcn;
+
+	slt_x_blk = env->hdr->blk_size / sizeof(struct smdb_db_slot);
+	if ((bcn = smdb_cf_get_block(cfctx, env->tbl->hash.blkno +
+				     idx / slt_x_blk, 1)) == NULL)
+		return NULL;
+	*pbcn = bcn;
+
+	return (struct smdb_db_slot *) smdb_bc_get_block_data(bcn) +
+		idx % slt_x_blk;
+}
+
+static int smdb_dbf_rh_insert(struct smdb_cfile_ctx *cfctx,
+			      struct smdb_db_env *env, smdb_u32 hsize,
+			      struct smdb_db_slot const *rslt)
+{
+	smdb_u32 idx, dist, sdist;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_slot *slt;
+	struct smdb_db_slot cur, tmp;
+
+	/*
+	 * The entry being placed takes the slot of the first entry which
+	 * is closer to its home position, and the latter is carried over
+	 * to the following slots in turn.
+	 */
+	cur = *rslt;
+	idx = smdb_dbf_rh_home(hsize, cur.hashv);
+	for (dist = 0;; dist++) {
+		if ((slt = smdb_dbf_get_slot(cfctx, env, idx, &bcn)) == NULL)
+			return -1;
+		if (smdb_dbf_file_empty(&slt->file)) {
+			*slt = cur;
+			smdb_cf_set_range_dirty(cfctx, bcn, slt, sizeof(*slt));
+			smdb_cf_release_block(cfctx, bcn);
+
+			return 1;
+		}
+		sdist = smdb_dbf_rh_dist(hsize, idx, slt->hashv);
+		if (sdist < dist) {
+			tmp = *slt;
+			*slt = cur;
+			cur = tmp;
+			dist = sdist;
+			smdb_cf_set_range_dirty(cfctx, bcn, slt, sizeof(*slt));
+		}
+		smdb_cf_release_block(cfctx, bcn);
+		if (++idx == hsize)
+			idx = 0;
+	}
+
+	return 0;
+}
+
+static int smdb_dbf_rh_remove(struct smdb_cfile_ctx *cfctx,
+			      struct smdb_db_env *env, smdb_u32 hsize,
+			      smdb_u32 idx)
+{
+	struct smdb_bc_node *bcn, *nbcn;
+	struct smdb_db_slot *slt, *nslt;
+
+	/*
+	 * Shift back by one slot the entries following the removed one, up
+	 * to an empty slot or an entry sitting at its home position, so that
+	 * no deleted slot is left behind.
+	 */
+	if ((slt = smdb_dbf_get_slot(cfctx, env, idx, &bcn)) == NULL)
+		return -1;
+	for (;;) {
+		if (++idx == hsize)
+			idx = 0;
+		if ((nslt = smdb_dbf_get_slot(cfctx, env, idx, &nbcn)) == NULL) {
+			smdb_cf_release_block(cfctx, bcn);
+			return -1;
+		}
+		if (smdb_dbf_file_empty(&nslt->file) ||
+		    smdb_dbf_rh_dist(hsize, idx, nslt->hashv) == 0) {
+			smdb_cf_release_block(cfctx, nbcn);
+			break;
+		}
+		*slt = *nslt;
+		smdb_cf_set_range_dirty(cfctx, bcn, slt, sizeof(*slt));
+		smdb_cf_release_block(cfctx, bcn);
+		bcn = nbcn;
+		slt = nslt;
+	}
+	MZERO(*slt);
+	smdb_cf_set_range_dirty(cfctx, bcn, slt, sizeof(*slt));
+	smdb_cf_release_block(cfctx, bcn);
+
+	return 0;
+}
+
+static int smdb_dbf_find_key(struct smdb_dbfile_ctx *dfctx,
+			     struct smdb_db_env *env,
+			     struct smdb_db_ckey const *key,
+			     struct smdb_db_cdata const *data,
+			     struct smdb_db_record *rec, struct smdb_db_kenum *ken,
+			     int erase)
+{
+	int match_res, robin;
+	smdb_u32 i, idx, slt_x_blk, istart, blkno, count, npurged, kdist;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_slot *slt;
+
+	if (env->tbl->mode == SMDB_DBF_TBL_LINEAR)
+		return smdb_dbf_lh_find_key(dfctx, env, key, data, rec, ken,
+					    erase);
+
+	/*
+	 * Resuming the scan right after a match on the last slot of the hash
+	 * wraps around to its first one.
+	 */
+	if (ken->idx >= ken->hsize)
+		ken->idx = 0;
+	robin = env->tbl->mode == SMDB_DBF_TBL_ROBIN;
+	kdist = robin ? smdb_dbf_rh_dist(ken->hsize, ken->idx, ken->hashv): 0;
+
+	slt_x_blk = env->hdr->blk_size / sizeof(struct smdb_db_slot);
+	for (idx = ken->idx, count = 0; count < ken->hsize;) {
+		blkno = idx / slt_x_blk;
+		istart = idx % slt_x_blk;
+		if ((bcn = smdb_cf_get_block(dfctx->cfctx, env->tbl->hash.blkno +
+					     blkno, erase != 0)) == NULL)
+			return -1;
+		slt = (struct smdb_db_slot *) smdb_bc_get_block_data(bcn);
+
+		for (i = istart, slt += istart; i < slt_x_blk;
+		     i++, slt++, kdist++) {
+			/*
+			 * If this is an empty slot, the chain ends here and
+			 * the key was not found.
+			 */
+			if (smdb_dbf_file_empty(&slt->file)) {
+				smdb_cf_release_block(dfctx->cfctx, bcn);
+				return 0;
+			}
+			/*
+			 * When we find a deleted item, or one whose key hashes
+			 * to a different value, we need to continue to scan
+			 * the chain. With Robin Hood tables, the chain ends
+			 * at the first entry closer to its home position than
+			 * the key would be.
+			 */
+			if (smdb_dbf_file_deleted(&slt->file))
+				continue;
+			if (slt->hashv != ken->hashv) {
+				if (robin &&
+				    smdb_dbf_rh_dist(ken->hsize, idx + i - istart,
+						     slt->hashv) < kdist) {
+					smdb_cf_release_block(dfctx->cfctx, bcn);
+					return 0;
+				}
+				continue;
+			}
+			/*
+			 * Try to match the current item.
+			 */
+			if ((match_res = smdb_dbf_match_key(dfctx, env->hdr,
+							    &slt->file, key,
+							    data, rec,
+							    env->view)) < 0) {
+				smdb_cf_release_block(dfctx->cfctx, bcn);
+				return match_res;
+			}
+			/*
+			 * No luck, try the next one ...
+			 */
+			if (match_res == 0)
+				continue;
+
+			/*
+			 * At this point we found it.
+			 */
+			if (erase) {
+				if (smdb_dbf_delete_file(dfctx, env, &slt->file) < 0)
+					match_res = -1;
+				else if (robin) {
+					smdb_cf_release_block(dfctx->cfctx, bcn);
+					ken->idx = idx + i - istart;
+					if (smdb_dbf_rh_remove(dfctx->cfctx, env,
+							       ken->hsize,
+							       ken->idx) < 0)
+						return -1;
+					return match_res;
+				} else {
+					npurged = smdb_dbf_purge_slots(slt - i, i,
+								       slt_x_blk);
+					env->tbl->num_dels += 1;
+					env->tbl->num_dels -= npurged;
+					if (npurged == 0)
+						npurged = 1;
+					smdb_cf_set_range_dirty(dfctx->cfctx, bcn,
+								slt - (npurged - 1),
+								npurged * sizeof(*slt));
+				}
+			}
+			smdb_cf_release_block(dfctx->cfctx, bcn);
+			ken->idx = idx + i - istart;
+			return match_res;
+		}
+
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+		count += slt_x_blk - istart;
+		idx += slt_x_blk - istart;
+		if (idx == ken->hsize)
+			idx = 0;
+	}
+
+	return 0;
+}
+
+static int smdb_dbf_load_rec(struct smdb_dbfile_ctx *dfctx,
+			     struct smdb_db_header *hdr,
+			     struct smdb_db_file const *dbf,
+			     struct smdb_db_record *rec)
+{
+	int error;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_rstorage *stg;
+
+	if ((stg = smdb_dbf_map_rec(dfctx->cfctx, dbf, 0, &bcn)) == NULL)
+		return -1;
+
+	error = smdb_dbf_rec_alloc(dfctx, hdr, dbf, stg, rec);
+
+	smdb_cf_release_block(dfctx->cfctx, bcn);
+
+	return error;
+}
+
+static int smdb_dbf_lh_enum(struct smdb_dbfile_ctx *dfctx,
+			    struct smdb_db_env *env, struct smdb_db_record *rec,
+			    struct smdb_db_kenum *ken)
+{
+	smdb_u32 i, nslots, ord, blkno;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_bucket *bkt;
+	struct smdb_db_slot *slt;
+
+	/*
+	 * Walk the bucket chains in bucket order. The enumeration index is
+	 * the position of the slot within the current bucket chain.
+	 */
+	nslots = smdb_dbf_lh_slots(env->hdr);
+	for (; ken->bucket < smdb_dbf_lh_buckets(env->tbl);
+	     ken->bucket++, ken->idx = 0) {
+		if (smdb_dbf_lh_block(dfctx->cfctx, env->tbl, ken->bucket,
+				      &blkno) < 0)
+			return -1;
+		for (ord = 0; blkno != 0;) {
+			if ((bcn = smdb_cf_get_block(dfctx->cfctx, blkno,
+						     0)) == NULL)
+				return -1;
+			bkt = (struct smdb_db_bucket *) smdb_bc_get_block_data(bcn);
+			slt = (struct smdb_db_slot *) (bkt + 1);
+
+			for (i = 0; i < nslots; i++, slt++, ord++) {
+				if (ord < ken->idx ||
+				    smdb_dbf_file_available(&slt->file))
+					continue;
+				if (smdb_dbf_load_rec(dfctx, env->hdr,
+						      &slt->file, rec) < 0) {
+					smdb_cf_release_block(dfctx->cfctx, bcn);
+					return -1;
+				}
+				smdb_cf_release_block(dfctx->cfctx, bcn);
+				ken->idx = ord;
+				return 1;
+			}
+
+			blkno = bkt->next;
+			smdb_cf_release_block(dfctx->cfctx, bcn);
+		}
+	}
+
+	return 0;
+}
+
+static int smdb_dbf_enum(struct smdb_dbfile_ctx *dfctx, struct smdb_db_env *env,
+			 struct smdb_db_record *rec, struct smdb_db_kenum *ken)
+{
+	smdb_u32 i, idx, slt_x_blk, istart, blkno;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_slot *slt;
+
+	if (env->tbl->mode == SMDB_DBF_TBL_LINEAR)
+		return smdb_dbf_lh_enum(dfctx, env, rec, ken);
+
+	slt_x_blk = env->hdr->blk_size / sizeof(struct smdb_db_slot);
+	for (idx = ken->idx; idx < ken->hsize;) {
+		blkno = idx / slt_x_blk;
+		istart = idx % slt_x_blk;
+		if ((bcn = smdb_cf_get_block(dfctx->cfctx, env->tbl->hash.blkno +
+					     blkno, 0)) == NULL)
+			return -1;
+		slt = (struct smdb_db_slot *) smdb_bc_get_block_data(bcn);
+
+		for (i = istart, slt += istart; i < slt_x_blk; i++, slt++) {
+			/*
+			 * If this is an empty slot, or we find a deleted item,
+			 * we need to continue to scan the chain since we want
+			 * to find them all.
+			 */
+			if (smdb_dbf_file_empty(&slt->file) ||
+			    smdb_dbf_file_deleted(&slt->file))
+				continue;
+
+			/*
+			 * We got a valid record, load this up.
+			 */
+			if (smdb_dbf_load_rec(dfctx, env->hdr, &slt->file,
+					      rec) < 0) {
+				smdb_cf_release_block(dfctx->cfctx, bcn);
+				return -1;
+			}
+			smdb_cf_release_block(dfctx->cfctx, bcn);
+			ken->idx = idx + i - istart;
+			return 1;
+		}
+
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+		idx += slt_x_blk - istart;
+	}
+	ken->idx = idx;
+
+	return 0;
+}
+
+static int smdb_dbf_txn_block(void *priv, smdb_u32 blkno)
+{
+	struct smdb_dbfile_ctx *dfctx = (struct smdb_dbfile_ctx *) priv;
+
+	return smdb_jf_txn_block(dfctx->jfctx, blkno);
+}
+
+int smdb_dbf_begin(struct smdb_dbfile_ctx *dfctx)
+{
+	return smdb_dbf_begin_level(dfctx, SMDB_DUR_DEFAULT);
+}
+
+int smdb_dbf_begin_level(struct smdb_dbfile_ctx *dfctx, int level)
+{
+	if (smdb_cf_begin(dfctx->cfctx) < 0)
+		return -1;
+	if (smdb_jf_begin_level(dfctx->jfctx, level) < 0) {
+		smdb_cf_end(dfctx->cfctx);
+		return -1;
+	}
+	/*
+	 * Keep the blocks dirtied by the transaction inside the cache, so
+	 * that they are written to the journal only once, all together, when
+	 * the transaction ends.
+	 */
+	smdb_cf_pin_dirty(dfctx->cfctx, 1);
+	dfctx->intx = 1;
+	dfctx->nfreed = 0;
+	dfctx->nfsdirty = 0;
+
+	return 0;
+}
+
+static int smdb_dbf_seal(struct smdb_dbfile_ctx *dfctx)
+{
+	if (smdb_cf_sync(dfctx->cfctx) < 0)
+		return -1;
+	smdb_cf_end(dfctx->cfctx);
+	smdb_cf_pin_dirty(dfctx->cfctx, 0);
+	dfctx->intx = 0;
+
+	return 0;
+}
+
+int smdb_dbf_end(struct smdb_dbfile_ctx *dfctx)
+{
+	if (smdb_dbf_seal(dfctx) < 0 ||
+	    smdb_jf_end(dfctx->jfctx) < 0)
+		return -1;
+
+	return 0;
+}
+
+int smdb_dbf_end_async(struct smdb_dbfile_ctx *dfctx, smdb_u64 *pseq)
+{
+	if (smdb_dbf_seal(dfctx) < 0 ||
+	    smdb_jf_end_async(dfctx->jfctx, pseq) < 0)
+		return -1;
+
+	return 0;
+}
+
+int smdb_dbf_flush(struct smdb_dbfile_ctx *dfctx)
+{
+	/*
+	 * Makes all the transactions sealed so far durable. This is the work
+	 * a flusher runs, outside of any transaction, for the transactions
+	 * ended with smdb_dbf_end_async().
+	 */
+	if (dfctx->intx || smdb_jf_flush(dfctx->jfctx) < 0)
+		return -1;
+
+	return 0;
+}
+
+smdb_u64 smdb_dbf_durable_seq(struct smdb_dbfile_ctx *dfctx)
+{
+	return smdb_jf_durable_seq(dfctx->jfctx);
+}
+
+int smdb_dbf_wait_durable(struct smdb_dbfile_ctx *dfctx, smdb_u64 seq)
+{
+	if (dfctx->intx || smdb_jf_wait_durable(dfctx->jfctx, seq) < 0)
+		return -1;
+
+	return 0;
+}
+
+int smdb_dbf_rollback(struct smdb_dbfile_ctx *dfctx)
+{
+	int error;
+
+	/*
+	 * The cache drops exactly the blocks the transaction changed, which
+	 * the journal still knows about until its own rollback. The cache
+	 * refuses if views still hold some of them, and then the journal
+	 * is failed, since the cache keeps content which must never reach
+	 * the DB file. The transaction is over in either case.
+	 */
+	error = smdb_cf_rollback(dfctx->cfctx, smdb_dbf_txn_block, dfctx);
+	if (error < 0)
+		smdb_cf_end(dfctx->cfctx);
+	smdb_cf_pin_dirty(dfctx->cfctx, 0);
+	dfctx->intx = 0;
+	if (smdb_jf_rollback(dfctx->jfctx) < 0)
+		error = -1;
+	if (error < 0) {
+		smdb_jf_fail(dfctx->jfctx);
+		smdb_dbf_fs_drop(dfctx);
+		return -1;
+	}
+	smdb_dbf_fs_rollback(dfctx);
+
+	return 0;
+}
+
+int smdb_dbf_checkpoint(struct smdb_dbfile_ctx *dfctx)
+{
+	if (smdb_jf_checkpoint(dfctx->jfctx) < 0)
+		return -1;
+
+	return 0;
+}
+
+static smdb_u32 smdb_dbf_key_hash(struct smdb_db_env const *env,
+				  struct smdb_db_ckey const *key)
+{
+	smdb_u64 hashv, seed;
+
+	if (env->tbl->hashfn == SMDB_DBF_HASH_OAT)
+		return (smdb_u32) smdb_get_hash(key->data, key->size,
+						SMDB_HASHV_INIT);
+	/*
+	 * Slots keep 32 bits of hash value, so fold the whole 64 bits into
+	 * them.
+	 */
+	seed = ((smdb_u64) env->hdr->hash_seed_hi << 32) | env->hdr->hash_seed_lo;
+	hashv = smdb_get_hash64(key->data, key->size, seed);
+
+	return (smdb_u32) (hashv ^ (hashv >> 32));
+}
+
+static void smdb_dbf_key_start(struct smdb_db_env const *env,
+			       struct smdb_db_kenum *ken)
+{
+	/*
+	 * Linear hashing tables locate the bucket from the hash value on
+	 * every lookup, and only track the position within its chain.
+	 */
+	if (env->tbl->mode == SMDB_DBF_TBL_LINEAR)
+		return;
+	ken->hsize = smdb_dbf_hash_slots(env->hdr, env->tbl->hash.size);
+	if (env->tbl->mode == SMDB_DBF_TBL_ROBIN)
+		ken->idx = smdb_dbf_rh_home(ken->hsize, ken->hashv);
+	else
+		ken->idx = ken->hashv % ken->hsize;
+}
+
+static int smdb_dbf_lookup(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
+			   struct smdb_db_ckey const *key,
+			   struct smdb_db_record *rec,
+			   struct smdb_db_view *view,
+			   struct smdb_db_kenum *ken)
+{
+	int match_res;
+	struct smdb_db_env env;
+
+	if (smdb_dbf_grab_env(dfctx, tblid, 0, &env) < 0)
+		return -1;
+	env.view = view;
+
+	MZERO(*ken);
+	ken->tblid = (smdb_u32) tblid;
+	ken->hashv = smdb_dbf_key_hash(&env, key);
+	smdb_dbf_key_start(&env, ken);
+
+	if ((match_res = smdb_dbf_find_key(dfctx, &env, key, NULL,
+					   rec, ken, 0)) > 0)
+		ken->idx++;
+
+	smdb_dbf_release_env(dfctx, &env);
+
+	return match_res;
+}
+
+int smdb_dbf_get(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
+		 struct smdb_db_ckey const *key, struct smdb_db_record *rec,
+		 struct smdb_db_kenum *ken)
+{
+	return smdb_dbf_lookup(dfctx, tblid, key, rec, NULL, ken);
+}
+
+int smdb_dbf_get_view(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
+		      struct smdb_db_ckey const *key, struct smdb_db_view *view,
+		      struct smdb_db_kenum *ken)
+{
+	struct smdb_db_record rec;
+
+	/*
+	 * The view is left empty when no record is found, so releasing it
+	 * is always safe.
+	 */
+	MZERO(*view);
+
+	return smdb_dbf_lookup(dfctx, tblid, key, &rec, view, ken);
+}
+
+int smdb_dbf_get_next(struct smdb_dbfile_ctx *dfctx, struct smdb_db_ckey const *key,
+		      struct smdb_db_record *rec, struct smdb_db_kenum *ken)
+{
+	int match_res;
+	struct smdb_db_env env;
+
+	if (smdb_dbf_grab_env(dfctx, ken->tblid, 0, &env) < 0)
 		return -1;
-	smdb_dbf_file_set_deleted(dbf);
+
+	if ((match_res = smdb_dbf_find_key(dfctx, &env, key, NULL,
+					   rec, ken, 0)) > 0)
+		ken->idx++;
+
+	smdb_dbf_release_env(dfctx, &env);
+
+	return match_res;
+}
+
+static void smdb_dbf_blk_sift_down(smdb_u32 *blks, unsigned long i,
+				   unsigned long n)
+{
+	unsigned long c;
+	smdb_u32 tmp;
+
+	for (; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && blks[c + 1] > blks[c])
+			c++;
+		if (blks[i] >= blks[c])
+			break;
+		tmp = blks[i];
+		blks[i] = blks[c];
+		blks[c] = tmp;
+	}
+}
+
+static int smdb_dbf_prefetch(struct smdb_dbfile_ctx *dfctx, smdb_u32 *blks,
+			     unsigned long n)
+{
+	unsigned long i, j;
+	smdb_u32 tmp;
+
+	/*
+	 * Sort and dedupe the block numbers, so that the cache can merge
+	 * the contiguous ones into single reads.
+	 */
+	for (i = n / 2; i > 0; i--)
+		smdb_dbf_blk_sift_down(blks, i - 1, n);
+	for (i = n; i > 1; i--) {
+		tmp = blks[0];
+		blks[0] = blks[i - 1];
+		blks[i - 1] = tmp;
+		smdb_dbf_blk_sift_down(blks, 0, i - 1);
+	}
+	for (i = j = 0; i < n; i++)
+		if (j == 0 || blks[i] != blks[j - 1])
+			blks[j++] = blks[i];
+
+	return smdb_cf_prefetch(dfctx->cfctx, blks, j);
+}
+
+static void smdb_dbf_home_rec(struct smdb_db_env *env,
+			      struct smdb_dbf_mget *mg, void const *data)
+{
+	smdb_u32 i, istart, nslots;
+	struct smdb_db_slot const *slt;
+
+	/*
+	 * Looks for the first slot with the key hash value within the home
+	 * block of the key, whose record is the one the lookup will most
+	 * likely load. Slots further down the chain are not worth the walk.
+	 */
+	MZERO(mg->rfile);
+	if (env->tbl->mode == SMDB_DBF_TBL_LINEAR) {
+		slt = (struct smdb_db_slot const *)
+			((struct smdb_db_bucket const *) data + 1);
+		nslots = smdb_dbf_lh_slots(env->hdr);
+		istart = 0;
+	} else {
+		slt = (struct smdb_db_slot const *) data;
+		nslots = env->hdr->blk_size / sizeof(struct smdb_db_slot);
+		istart = mg->ken.idx % nslots;
+	}
+	for (i = istart, slt += istart; i < nslots; i++, slt++) {
+		if (env->tbl->mode != SMDB_DBF_TBL_LINEAR &&
+		    smdb_dbf_file_empty(&slt->file))
+			break;
+		if (!smdb_dbf_file_available(&slt->file) &&
+		    slt->hashv == mg->ken.hashv) {
+			mg->rfile = slt->file;
+			break;
+		}
+	}
+}
+
+static void smdb_dbf_mget_miss(struct smdb_dbf_mget *mg, smdb_u32 blkno,
+			       smdb_u32 count, struct smdb_dbf_extent *need,
+			       unsigned long *pnneed)
+{
+	need[*pnneed].blkno = blkno;
+	need[*pnneed].count = count;
+	(*pnneed)++;
+	mg->state = SMDB_DBF_MG_START;
+}
+
+static int smdb_dbf_mget_step(struct smdb_dbfile_ctx *dfctx,
+			      struct smdb_db_env *env,
+			      struct smdb_db_ckey const *key,
+			      struct smdb_db_record *rec,
+			      struct smdb_dbf_mget *mg,
+			      struct smdb_dbf_extent *need,
+			      unsigned long *pnneed)
+{
+	int match_res;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_spage const *spg;
+	struct smdb_db_sslot const *sslt;
+
+	/*
+	 * Moves a lookup one step forward, and returns 0 once it is over.
+	 * Every step ends by asking the CPU for the memory the next one is
+	 * going to touch. Blocks found missing from the cache are added to
+	 * the need list, and the lookup is started over once they have been
+	 * loaded. Blocks are looked up again at every step, since the ones
+	 * of the lookups reaching smdb_dbf_find_key() may load blocks, and
+	 * drop others. The record location found inside the home block is
+	 * only a guess, the lookup itself going through smdb_dbf_find_key().
+	 */
+	switch (mg->state) {
+	case SMDB_DBF_MG_START:
+		MZERO(mg->ken);
+		mg->ken.hashv = smdb_dbf_key_hash(env, key);
+		smdb_dbf_key_start(env, &mg->ken);
+		if (env->tbl->mode != SMDB_DBF_TBL_LINEAR)
+			mg->blkno = env->tbl->hash.blkno + mg->ken.idx /
+				(env->hdr->blk_size / sizeof(struct smdb_db_slot));
+		else if (smdb_dbf_lh_block(dfctx->cfctx, env->tbl,
+					   smdb_dbf_lh_bucket(env->tbl,
+							      mg->ken.hashv),
+					   &mg->blkno) < 0)
+			return -1;
+		smdb_cf_prefetch_node(dfctx->cfctx, mg->blkno, 0);
+		mg->state = SMDB_DBF_MG_HLIST;
+		return 1;
+
+	case SMDB_DBF_MG_HLIST:
+		smdb_cf_prefetch_node(dfctx->cfctx, mg->blkno, 1);
+		mg->state = SMDB_DBF_MG_HOME;
+		return 1;
+
+	case SMDB_DBF_MG_HOME:
+		if ((bcn = smdb_cf_peek_block(dfctx->cfctx, mg->blkno)) == NULL) {
+			smdb_dbf_mget_miss(mg, mg->blkno, 1, need, pnneed);
+			return 0;
+		}
+		if (env->tbl->mode != SMDB_DBF_TBL_LINEAR)
+			PREFETCH((struct smdb_db_slot const *)
+				 smdb_bc_get_block_data(bcn) +
+				 mg->ken.idx % (env->hdr->blk_size /
+						sizeof(struct smdb_db_slot)));
+		else
+			PREFETCH(smdb_bc_get_block_data(bcn));
+		mg->state = SMDB_DBF_MG_SLOT;
+		return 1;
+
+	case SMDB_DBF_MG_SLOT:
+		if ((bcn = smdb_cf_peek_block(dfctx->cfctx, mg->blkno)) == NULL) {
+			smdb_dbf_mget_miss(mg, mg->blkno, 1, need, pnneed);
+			return 0;
+		}
+		smdb_dbf_home_rec(env, mg, smdb_bc_get_block_data(bcn));
+		if (smdb_dbf_file_empty(&mg->rfile)) {
+			mg->state = SMDB_DBF_MG_LOOKUP;
+			return 1;
+		}
+		smdb_cf_prefetch_node(dfctx->cfctx, mg->rfile.blkno, 0);
+		mg->state = SMDB_DBF_MG_RLIST;
+		return 1;
+
+	case SMDB_DBF_MG_RLIST:
+		smdb_cf_prefetch_node(dfctx->cfctx, mg->rfile.blkno, 1);
+		mg->state = SMDB_DBF_MG_REC;
+		return 1;
+
+	case SMDB_DBF_MG_REC:
+		if ((bcn = smdb_cf_peek_block(dfctx->cfctx,
+					      mg->rfile.blkno)) == NULL) {
+			smdb_dbf_mget_miss(mg, mg->rfile.blkno,
+					   smdb_dbf_file_small(&mg->rfile) ? 1:
+					   mg->rfile.size, need, pnneed);
+			return 0;
+		}
+		PREFETCH(smdb_bc_get_block_data(bcn));
+		mg->state = smdb_dbf_file_small(&mg->rfile) ?
+			SMDB_DBF_MG_SPAGE: SMDB_DBF_MG_LOOKUP;
+		return 1;
+
+	case SMDB_DBF_MG_SPAGE:
+		if ((bcn = smdb_cf_peek_block(dfctx->cfctx,
+					      mg->rfile.blkno)) == NULL) {
+			smdb_dbf_mget_miss(mg, mg->rfile.blkno, 1, need, pnneed);
+			return 0;
+		}
+		spg = (struct smdb_db_spage const *) smdb_bc_get_block_data(bcn);
+		sslt = (struct smdb_db_sslot const *) (spg + 1) +
+			(mg->rfile.size & ~SMDB_DBF_SMALL);
+		if ((mg->rfile.size & ~SMDB_DBF_SMALL) < spg->nslots)
+			PREFETCH((char const *) spg + sslt->offset);
+		mg->state = SMDB_DBF_MG_LOOKUP;
+		return 1;
+
+	case SMDB_DBF_MG_LOOKUP:
+		if ((match_res = smdb_dbf_find_key(dfctx, env, key, NULL, rec,
+						   &mg->ken, 0)) < 0)
+			return -1;
+		mg->found = match_res > 0;
+		mg->state = SMDB_DBF_MG_DONE;
+		return 0;
+	}
 
 	return 0;
 }
 
-int smdb_dbf_create_table(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
-			  unsigned int tblsize)
+static int smdb_dbf_mget_probe(struct smdb_dbfile_ctx *dfctx,
+			       struct smdb_db_env *env,
+			       struct smdb_db_ckey const *keys,
+			       struct smdb_db_record *recs,
+			       struct smdb_dbf_mget *mgs, unsigned long n,
+			       struct smdb_dbf_extent *need,
+			       unsigned long *pnneed)
 {
-	smdb_u32 tbl_x_blk, tbl_nblocks;
-	struct smdb_db_file hash;
+	int step_res;
+	unsigned long i, next, nact, act[SMDB_DBF_MGET_WINDOW];
+
+	/*
+	 * Keeps up to SMDB_DBF_MGET_WINDOW lookups in flight, moving them
+	 * forward in turn, so that their CPU cache misses overlap instead
+	 * of being paid one after the other. The lookups already done in a
+	 * previous round are skipped.
+	 */
+	for (next = nact = 0; next < n && nact < SMDB_DBF_MGET_WINDOW; next++)
+		if (mgs[next].state != SMDB_DBF_MG_DONE)
+			act[nact++] = next;
+	for (i = 0; nact > 0;) {
+		if ((step_res = smdb_dbf_mget_step(dfctx, env, &keys[act[i]],
+						   &recs[act[i]], &mgs[act[i]],
+						   need, pnneed)) < 0)
+			return -1;
+		if (step_res == 0) {
+			for (; next < n && mgs[next].state == SMDB_DBF_MG_DONE;
+			     next++)
+				;
+			if (next < n)
+				act[i] = next++;
+			else
+				act[i] = act[--nact];
+		}
+		if (++i >= nact)
+			i = 0;
+	}
+
+	return 0;
+}
+
+static int smdb_dbf_mget_load(struct smdb_dbfile_ctx *dfctx,
+			      struct smdb_dbf_extent const *need,
+			      unsigned long nneed)
+{
+	int error;
+	unsigned long i, nblks;
+	smdb_u32 j, *blks;
+
+	for (i = 0, nblks = 0; i < nneed; i++)
+		nblks += need[i].count;
+	if ((blks = (smdb_u32 *)
+	     SMDBXI_MM_ALLOC(dfctx->mem, nblks * sizeof(smdb_u32))) == NULL)
+		return -1;
+	for (i = 0, nblks = 0; i < nneed; i++)
+		for (j = 0; j < need[i].count; j++)
+			blks[nblks++] = need[i].blkno + j;
+	error = smdb_dbf_prefetch(dfctx, blks, nblks);
+	SMDBXI_MM_FREE(dfctx->mem, blks);
+
+	return error;
+}
+
+static int smdb_dbf_mget_plain(struct smdb_dbfile_ctx *dfctx,
+			       struct smdb_db_env *env,
+			       struct smdb_db_ckey const *keys, unsigned long n,
+			       struct smdb_db_record *recs)
+{
+	int error, nfound = 0;
+	unsigned long i;
+	struct smdb_db_kenum ken;
+
+	for (i = 0; i < n; i++)
+		MZERO(recs[i]);
+	for (i = 0; i < n; i++) {
+		MZERO(ken);
+		ken.hashv = smdb_dbf_key_hash(env, &keys[i]);
+		smdb_dbf_key_start(env, &ken);
+		if ((error = smdb_dbf_find_key(dfctx, env, &keys[i], NULL,
+					       &recs[i], &ken, 0)) < 0) {
+			for (; i > 0; i--)
+				smdb_dbf_free_record(dfctx, &recs[i - 1]);
+			return -1;
+		}
+		if (error > 0)
+			nfound++;
+	}
+
+	return nfound;
+}
+
+int smdb_dbf_multi_get(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
+		       struct smdb_db_ckey const *keys, unsigned long n,
+		       struct smdb_db_record *recs)
+{
+	int error = 0, round, nfound = 0;
+	unsigned long i, nneed;
 	struct smdb_db_env env;
+	struct smdb_dbf_mget *mgs;
+	struct smdb_dbf_extent *need;
 
-	if (smdb_dbf_get_env(dfctx, tblid, 1, &env) < 0)
+	if (n == 0)
+		return 0;
+	if (smdb_dbf_grab_env(dfctx, tblid, 0, &env) < 0)
 		return -1;
 	/*
-	 * Fail if exists!
+	 * Interleaving does not pay off for a handful of keys, nor for
+	 * linear hashing tables, whose lookups need a dependent step to
+	 * resolve the bucket, so those go one key at a time.
 	 */
-	if (env.tbl->hash.size != 0) {
+	if (n < SMDB_DBF_MGET_MIN || env.tbl->mode == SMDB_DBF_TBL_LINEAR) {
+		nfound = smdb_dbf_mget_plain(dfctx, &env, keys, n, recs);
 		smdb_dbf_release_env(dfctx, &env);
+		return nfound;
+	}
+	if ((mgs = (struct smdb_dbf_mget *)
+	     SMDBXI_MM_ALLOC(dfctx->mem, n * (sizeof(*mgs) +
+					      sizeof(*need)))) == NULL) {
+		smdb_dbf_release_env(dfctx, &env);
+		return -1;
+	}
+	need = (struct smdb_dbf_extent *) (mgs + n);
+	for (i = 0; i < n; i++) {
+		mgs[i].state = SMDB_DBF_MG_START;
+		mgs[i].found = 0;
+		MZERO(recs[i]);
+	}
+
+	/*
+	 * Lookups whose blocks are all cached complete within the first
+	 * round. The blocks the others miss are loaded all together, and
+	 * they are run again. The home hash blocks are only known to be
+	 * missing during the first round, and the record blocks they point
+	 * to during the second one, after which whatever is still missing
+	 * is read by the lookups themselves.
+	 */
+	for (round = 0; round < 3 && error == 0; round++) {
+		nneed = 0;
+		if (round == 2) {
+			for (i = 0; i < n; i++)
+				if (mgs[i].state == SMDB_DBF_MG_START)
+					mgs[i].state = SMDB_DBF_MG_LOOKUP;
+			error = smdb_dbf_mget_probe(dfctx, &env, keys, recs,
+						    mgs, n, need, &nneed);
+			break;
+		}
+		if ((error = smdb_dbf_mget_probe(dfctx, &env, keys, recs, mgs,
+						 n, need, &nneed)) == 0 &&
+		    nneed == 0)
+			break;
+		if (error == 0)
+			error = smdb_dbf_mget_load(dfctx, need, nneed);
+	}
+	for (i = 0; i < n; i++) {
+		if (error < 0)
+			smdb_dbf_free_record(dfctx, &recs[i]);
+		else if (mgs[i].found)
+			nfound++;
+	}
+	SMDBXI_MM_FREE(dfctx->mem, mgs);
+	smdb_dbf_release_env(dfctx, &env);
+
+	return error < 0 ? -1: nfound;
+}
+
+int smdb_dbf_first(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
+		   struct smdb_db_record *rec, struct smdb_db_kenum *ken)
+{
+	int match_res;
+	struct smdb_db_env env;
+
+	if (smdb_dbf_grab_env(dfctx, tblid, 0, &env) < 0)
+		return -1;
+
+	MZERO(*ken);
+	ken->tblid = (smdb_u32) tblid;
+	ken->hsize = smdb_dbf_hash_slots(env.hdr, env.tbl->hash.size);
+
+	if ((match_res = smdb_dbf_enum(dfctx, &env, rec, ken)) > 0)
+		ken->idx++;
+
+	smdb_dbf_release_env(dfctx, &env);
+
+	return match_res;
+}
+
+int smdb_dbf_next(struct smdb_dbfile_ctx *dfctx, struct smdb_db_record *rec,
+		  struct smdb_db_kenum *ken)
+{
+	int match_res;
+	struct smdb_db_env env;
+
+	if (smdb_dbf_grab_env(dfctx, ken->tblid, 0, &env) < 0)
+		return -1;
+
+	if ((match_res = smdb_dbf_enum(dfctx, &env, rec, ken)) > 0)
+		ken->idx++;
+
+	smdb_dbf_release_env(dfctx, &env);
+
+	return match_res;
+}
+
+void smdb_dbf_free_record(struct smdb_dbfile_ctx *dfctx,
+			  struct smdb_db_record *rec)
+{
+	if (rec != NULL) {
+		/*
+		 * This may be called multiple times over the same record,
+		 * so nullify the record data pointer afterward.
+		 * The memory interface is supposed to be handling the
+		 * NULL pointer frees just fine.
+		 */
+		SMDBXI_MM_FREE(dfctx->mem, rec->record);
+		rec->record = NULL;
+	}
+}
+
+static int smdb_dbf_falloc_rec(struct smdb_dbfile_ctx *dfctx,
+			       struct smdb_db_env *env,
+			       struct smdb_db_ckey const *key,
+			       struct smdb_db_cdata *data,
+			       smdb_u32 hashv, struct smdb_db_file *dbf)
+{
+	smdb_u32 rec_blocks;
+	smdb_u64 rsize;
+	smdb_offset_t offset;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_rstorage *stg;
+
+	/*
+	 * Calculate the space for the new record, and allocate the necessary
+	 * number of blocks on file. Small records are packed inside slotted
+	 * pages instead.
+	 */
+	rsize = (smdb_u64) sizeof(struct smdb_db_rstorage) + key->size + data->size;
+	if (rsize <= env->hdr->blk_size / SMDB_DBF_SMALL_RATIO)
+		return smdb_dbf_small_put(dfctx, env, key, data, (smdb_u32) rsize,
+					  hashv, dbf);
+	rec_blocks = (smdb_u32) (rsize / env->hdr->blk_size);
+	if ((rsize % env->hdr->blk_size) != 0)
+		rec_blocks++;
+	if (smdb_dbf_alloc_file(dfctx, rec_blocks, dbf) < 0)
+		return -1;
+	if (smdb_dbf_fresh_file(dfctx, dbf) < 0) {
+		smdb_dbf_release_file(dfctx, dbf->blkno, dbf->size);
+		return -1;
+	}
+
+	/*
+	 * Setup the record storage header.
+	 */
+	if ((bcn = smdb_cf_get_block(dfctx->cfctx, dbf->blkno,
+				     1)) == NULL) {
+		smdb_dbf_release_file(dfctx, dbf->blkno, dbf->size);
+		return -1;
+	}
+	stg = (struct smdb_db_rstorage *) smdb_bc_get_block_data(bcn);
+	stg->hashv = hashv;
+	stg->ksize = key->size;
+	stg->dsize = data->size;
+
+	smdb_cf_set_range_dirty(dfctx->cfctx, bcn, stg, sizeof(*stg));
+	smdb_cf_release_block(dfctx->cfctx, bcn);
+	/*
+	 * Write key and data into the new space. Key and data follow the record
+	 * storage header.
+	 */
+	offset = (smdb_offset_t) dbf->blkno * env->hdr->blk_size +
+		sizeof(struct smdb_db_rstorage);
+	if (smdb_cf_write(dfctx->cfctx, offset, key->data,
+			  key->size) != (int) key->size ||
+	    smdb_cf_write(dfctx->cfctx, offset + key->size, data->data,
+			  data->size) != (int) data->size) {
+		smdb_dbf_release_file(dfctx, dbf->blkno, dbf->size);
 		return -1;
 	}
 
-	tbl_x_blk = env.hdr->blk_size / sizeof(struct smdb_db_table);
-	tbl_nblocks = (smdb_u32) tblsize / tbl_x_blk + 1;
+	return 0;
+}
+
+static int smdb_dbf_put_key(struct smdb_dbfile_ctx *dfctx,
+			    struct smdb_db_env *env, smdb_u32 hashv,
+			    smdb_u32 hsize, struct smdb_db_ckey const *key,
+			    struct smdb_db_cdata *data)
+{
+	smdb_u32 i, idx, slt_x_blk, istart, blkno;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_slot *slt;
+	struct smdb_db_slot rslt;
+
+	/*
+	 * Robin Hood tables might move other entries around, so the record
+	 * is stored first, and its slot inserted after.
+	 */
+	if (env->tbl->mode == SMDB_DBF_TBL_ROBIN) {
+		MZERO(rslt);
+		if (smdb_dbf_falloc_rec(dfctx, env, key, data, hashv,
+					&rslt.file) < 0)
+			return -1;
+		rslt.hashv = hashv;
+		if (smdb_dbf_rh_insert(dfctx->cfctx, env, hsize, &rslt) < 0) {
+			smdb_dbf_delete_file(dfctx, env, &rslt.file);
+			return -1;
+		}
+
+		return 1;
+	}
+
+	idx = hashv % hsize;
+	slt_x_blk = env->hdr->blk_size / sizeof(struct smdb_db_slot);
+	for (;;) {
+		blkno = idx / slt_x_blk;
+		istart = idx % slt_x_blk;
+		if ((bcn = smdb_cf_get_block(dfctx->cfctx, env->tbl->hash.blkno +
+					     blkno, 1)) == NULL)
+			return -1;
+		slt = (struct smdb_db_slot *) smdb_bc_get_block_data(bcn);
+
+		for (i = istart, slt += istart; i < slt_x_blk; i++, slt++) {
+			if (smdb_dbf_file_available(&slt->file)) {
+				if (smdb_dbf_file_deleted(&slt->file))
+					env->tbl->num_dels--;
+				if (smdb_dbf_falloc_rec(dfctx, env, key, data,
+							hashv, &slt->file) < 0) {
+					smdb_cf_release_block(dfctx->cfctx, bcn);
+					return -1;
+				}
+				slt->hashv = hashv;
+				smdb_cf_set_range_dirty(dfctx->cfctx, bcn, slt,
+							sizeof(*slt));
+				smdb_cf_release_block(dfctx->cfctx, bcn);
+
+				return 1;
+			}
+		}
+
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+		idx += slt_x_blk - istart;
+		if (idx == hsize)
+			idx = 0;
+	}
+
+	return 0;
+}
+
+static int smdb_dbf_set_hash_ent(struct smdb_cfile_ctx *cfctx,
+				 struct smdb_db_env *env, smdb_u32 hsize,
+				 struct smdb_db_slot const *rslt)
+{
+	smdb_u32 i, idx, slt_x_blk, istart, blkno;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_slot *slt;
+
+	if (env->tbl->mode == SMDB_DBF_TBL_ROBIN)
+		return smdb_dbf_rh_insert(cfctx, env, hsize, rslt);
+
+	idx = rslt->hashv % hsize;
+	slt_x_blk = env->hdr->blk_size / sizeof(struct smdb_db_slot);
+	for (;;) {
+		blkno = idx / slt_x_blk;
+		istart = idx % slt_x_blk;
+		if ((bcn = smdb_cf_get_block(cfctx, env->tbl->hash.blkno +
+					     blkno, 1)) == NULL)
+			return -1;
+		slt = (struct smdb_db_slot *) smdb_bc_get_block_data(bcn);
 
-	if (smdb_dbf_alloc_file(dfctx->cfctx, tbl_nblocks, &hash) < 0) {
-		smdb_dbf_release_env(dfctx, &env);
-		return -1;
-	}
-	/*
-	 * Properly init/zero the newly allocated hash.
-	 */
-	if (smdb_cf_zero(dfctx->cfctx, hash.blkno, hash.size) < 0) {
-		smdb_dbf_bfree(dfctx->cfctx, hash.blkno, hash.size);
-		smdb_dbf_release_env(dfctx, &env);
-		return -1;
-	}
+		for (i = istart, slt += istart; i < slt_x_blk; i++, slt++) {
+			if (smdb_dbf_file_available(&slt->file)) {
+				*slt = *rslt;
 
-	MZERO(*env.tbl);
-	env.tbl->hash = hash;
+				smdb_cf_set_range_dirty(cfctx, bcn, slt,
+							sizeof(*slt));
+				smdb_cf_release_block(cfctx, bcn);
 
-	smdb_cf_set_block_dirty(dfctx->cfctx, env.tbcn);
-	smdb_cf_set_block_dirty(dfctx->cfctx, env.mbcn);
+				return 1;
+			}
+		}
 
-	smdb_dbf_release_env(dfctx, &env);
+		smdb_cf_release_block(cfctx, bcn);
+		idx += slt_x_blk - istart;
+		if (idx == hsize)
+			idx = 0;
+	}
 
 	return 0;
 }
 
-int smdb_dbf_free_table(struct smdb_dbfile_ctx *dfctx, unsigned int tblid)
+static int smdb_dbf_hash_resize(struct smdb_dbfile_ctx *dfctx,
+				struct smdb_db_env *env, smdb_u32 hash_blocks)
 {
-	smdb_u32 i, blkno, dbf_x_blk;
+	smdb_u32 i, blkno, slt_x_blk, hsize;
+	struct smdb_cfile_ctx *cfctx = dfctx->cfctx;
 	struct smdb_bc_node *bcn;
-	struct smdb_db_file *dbf;
-	struct smdb_db_env env;
+	struct smdb_db_slot *slt;
+	struct smdb_db_file hash, ohash;
 
-	if (smdb_dbf_get_env(dfctx, tblid, 1, &env) < 0)
+	/*
+	 * Alloc a new space for the hash, with the requested size.
+	 */
+	if (smdb_dbf_alloc_file(dfctx, hash_blocks, &hash) < 0)
 		return -1;
 	/*
-	 * Fail if does not exists!
+	 * Properly init/zero the newly allocated hash.
 	 */
-	if (env.tbl->hash.size == 0) {
-		smdb_dbf_release_env(dfctx, &env);
+	if (smdb_dbf_fresh_file(dfctx, &hash) < 0 ||
+	    smdb_cf_zero(cfctx, hash.blkno, hash.size) < 0) {
+		smdb_dbf_release_file(dfctx, hash.blkno, hash.size);
 		return -1;
 	}
 
+	ohash = env->tbl->hash;
+	env->tbl->hash = hash;
+
 	/*
-	 * Loop through every hash entry and release the allocated storage.
+	 * Loop through every old hash entry, and re-insert then into
+	 * the new hash position.  We cannot just copy over here, since
+	 * the new hash size generates different indexes for the same
+	 * hash values. The slots carry the hash values, so the records
+	 * themselves are never touched. Deleted slots are not carried over.
 	 */
-	dbf_x_blk = env.hdr->blk_size / sizeof(struct smdb_db_file);
-	for (blkno = 0; blkno < env.tbl->hash.size; blkno++) {
-		if ((bcn = smdb_cf_get_block(dfctx->cfctx, env.tbl->hash.blkno +
-					     blkno, 1)) == NULL) {
-			smdb_dbf_release_env(dfctx, &env);
+	hsize = smdb_dbf_hash_slots(env->hdr, hash_blocks);
+	slt_x_blk = env->hdr->blk_size / sizeof(struct smdb_db_slot);
+	for (blkno = 0; blkno < ohash.size; blkno++) {
+		if ((bcn = smdb_cf_get_block(cfctx, ohash.blkno +
+					     blkno, 0)) == NULL) {
+			smdb_dbf_release_file(dfctx, ohash.blkno, ohash.size);
 			return -1;
 		}
-		dbf = (struct smdb_db_file *) smdb_bc_get_block_data(bcn);
+		slt = (struct smdb_db_slot *) smdb_bc_get_block_data(bcn);
 
-		for (i = 0; i < dbf_x_blk; i++, dbf++) {
-			/*
-			 * If this is an empty slot, or we find a deleted item,
-			 * we need to continue to scan the chain since we want
-			 * to free them all.
-			 */
-			if (smdb_dbf_file_empty(dbf) || smdb_dbf_file_deleted(dbf))
+		for (i = 0; i < slt_x_blk; i++, slt++) {
+			if (smdb_dbf_file_available(&slt->file))
 				continue;
 
-			if (smdb_dbf_bfree(dfctx->cfctx, dbf->blkno,
-					   dbf->size) < 0) {
-				smdb_dbf_release_env(dfctx, &env);
+			if (smdb_dbf_set_hash_ent(cfctx, env, hsize, slt) < 0) {
+				smdb_cf_release_block(cfctx, bcn);
+				smdb_dbf_release_file(dfctx, ohash.blkno,
+						      ohash.size);
 				return -1;
 			}
-			smdb_dbf_file_set_deleted(dbf);
 		}
 
-		smdb_cf_set_block_dirty(dfctx->cfctx, bcn);
-		smdb_cf_release_block(dfctx->cfctx, bcn);
+		smdb_cf_release_block(cfctx, bcn);
 	}
 
-	/*
-	 * Release the space allocated for the hash table itself.
-	 */
-	if (smdb_dbf_bfree(dfctx->cfctx, env.tbl->hash.blkno,
-			   env.tbl->hash.size) < 0) {
-		smdb_dbf_release_env(dfctx, &env);
-		return -1;
-	}
+	smdb_dbf_release_file(dfctx, ohash.blkno, ohash.size);
+	env->tbl->num_dels = 0;
 
-	MZERO(*env.tbl);
+	return 0;
+}
 
-	smdb_cf_set_block_dirty(dfctx->cfctx, env.tbcn);
-	smdb_cf_set_block_dirty(dfctx->cfctx, env.mbcn);
+static int smdb_dbf_lh_init(struct smdb_dbfile_ctx *dfctx,
+			    struct smdb_db_header const *hdr, smdb_u32 blkno)
+{
+	struct smdb_bc_node *bcn;
 
-	smdb_dbf_release_env(dfctx, &env);
+	/*
+	 * Single bucket blocks are cleared through the cache, since zeroing
+	 * blocks at the file level has to scan the whole cache.
+	 */
+	if ((bcn = smdb_cf_get_block(dfctx->cfctx, blkno, 1)) == NULL)
+		return -1;
+	smdb_memset(smdb_bc_get_block_data(bcn), 0, hdr->blk_size);
+	smdb_cf_set_block_dirty(dfctx->cfctx, bcn);
+	smdb_cf_release_block(dfctx->cfctx, bcn);
 
 	return 0;
 }
 
-static int smdb_dbf_find_key(struct smdb_dbfile_ctx *dfctx,
-			     struct smdb_db_env *env,
-			     struct smdb_db_ckey const *key,
-			     struct smdb_db_cdata const *data,
-			     struct smdb_db_record *rec, struct smdb_db_kenum *ken,
-			     int erase)
+static int smdb_dbf_lh_slot(struct smdb_dbfile_ctx *dfctx,
+			    struct smdb_db_env *env, smdb_u32 blkno,
+			    struct smdb_bc_node **pbcn,
+			    struct smdb_db_slot **pslt)
 {
-	int match_res;
-	smdb_u32 i, idx, dbf_x_blk, istart, blkno;
+	smdb_u32 i, nslots;
 	struct smdb_bc_node *bcn;
-	struct smdb_db_file *dbf;
+	struct smdb_db_bucket *bkt;
+	struct smdb_db_slot *slt;
+	struct smdb_db_file ovf;
 
-	dbf_x_blk = env->hdr->blk_size / sizeof(struct smdb_db_file);
-	for (idx = ken->idx;;) {
-		blkno = idx / dbf_x_blk;
-		istart = idx % dbf_x_blk;
-		if ((bcn = smdb_cf_get_block(dfctx->cfctx, env->tbl->hash.blkno +
-					     blkno, erase != 0)) == NULL)
+	/*
+	 * Look for an available slot within the bucket chain starting at
+	 * blkno, and append a new overflow block when they are all taken.
+	 */
+	nslots = smdb_dbf_lh_slots(env->hdr);
+	for (;;) {
+		if ((bcn = smdb_cf_get_block(dfctx->cfctx, blkno, 1)) == NULL)
 			return -1;
-		dbf = (struct smdb_db_file *) smdb_bc_get_block_data(bcn);
-
-		for (i = istart, dbf += istart; i < dbf_x_blk; i++, dbf++) {
-			/*
-			 * If this is an empty slot, the chain ends here and
-			 * the key was not found.
-			 */
-			if (smdb_dbf_file_empty(dbf)) {
-				smdb_cf_release_block(dfctx->cfctx, bcn);
+		bkt = (struct smdb_db_bucket *) smdb_bc_get_block_data(bcn);
+		slt = (struct smdb_db_slot *) (bkt + 1);
+		for (i = 0; i < nslots; i++, slt++) {
+			if (smdb_dbf_file_available(&slt->file)) {
+				*pbcn = bcn;
+				*pslt = slt;
 				return 0;
 			}
-			/*
-			 * When we find a deleted item, we need to continue to
-			 * scan the chain.
-			 */
-			if (smdb_dbf_file_deleted(dbf))
-				continue;
-			/*
-			 * Try to match the current item.
-			 */
-			if ((match_res = smdb_dbf_match_key(dfctx, env->hdr, dbf,
-							    key, data, rec)) < 0) {
-				smdb_cf_release_block(dfctx->cfctx, bcn);
-				return match_res;
-			}
-			/*
-			 * No luck, try the next one ...
-			 */
-			if (match_res == 0)
-				continue;
-
-			/*
-			 * At this point we found it.
-			 */
-			if (erase) {
-				if (smdb_dbf_delete_file(dfctx->cfctx, dbf) < 0)
-					match_res = -1;
-				else
-					smdb_cf_set_block_dirty(dfctx->cfctx, bcn);
-			}
-			smdb_cf_release_block(dfctx->cfctx, bcn);
-			ken->idx = idx + i - istart;
-			return match_res;
 		}
-
+		if (bkt->next == 0)
+			break;
+		blkno = bkt->next;
 		smdb_cf_release_block(dfctx->cfctx, bcn);
-		idx += dbf_x_blk - istart;
-		if (idx == ken->hsize)
-			idx = 0;
 	}
+	if (smdb_dbf_alloc_file(dfctx, 1, &ovf) < 0) {
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+		return -1;
+	}
+	if (smdb_dbf_fresh_file(dfctx, &ovf) < 0 ||
+	    smdb_dbf_lh_init(dfctx, env->hdr, ovf.blkno) < 0) {
+		smdb_dbf_release_file(dfctx, ovf.blkno, ovf.size);
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+		return -1;
+	}
+	bkt->next = ovf.blkno;
+	smdb_cf_set_range_dirty(dfctx->cfctx, bcn, bkt, sizeof(*bkt));
+	smdb_cf_release_block(dfctx->cfctx, bcn);
+
+	if ((bcn = smdb_cf_get_block(dfctx->cfctx, ovf.blkno, 1)) == NULL)
+		return -1;
+	bkt = (struct smdb_db_bucket *) smdb_bc_get_block_data(bcn);
+	*pbcn = bcn;
+	*pslt = (struct smdb_db_slot *) (bkt + 1);
 
 	return 0;
 }
 
-static int smdb_dbf_load_rec(struct smdb_dbfile_ctx *dfctx,
-			     struct smdb_db_header *hdr,
-			     struct smdb_db_file const *dbf,
-			     struct smdb_db_record *rec)
+static int smdb_dbf_lh_trim(struct smdb_dbfile_ctx *dfctx,
+			    struct smdb_db_env *env, smdb_u32 hblkno)
 {
-	int error;
-	struct smdb_bc_node *bcn;
-	struct smdb_db_rstorage *stg;
+	smdb_u32 i, nslots, blkno;
+	struct smdb_bc_node *pbcn, *bcn;
+	struct smdb_db_bucket *pbkt, *bkt;
+	struct smdb_db_slot *slt;
 
-	if ((bcn = smdb_cf_get_block(dfctx->cfctx, dbf->blkno, 0)) == NULL)
+	/*
+	 * Unlink and release the overflow blocks left with no records.
+	 */
+	nslots = smdb_dbf_lh_slots(env->hdr);
+	if ((pbcn = smdb_cf_get_block(dfctx->cfctx, hblkno, 1)) == NULL)
 		return -1;
-	stg = (struct smdb_db_rstorage *) smdb_bc_get_block_data(bcn);
-
-	error = smdb_dbf_rec_alloc(dfctx, hdr, dbf, stg, rec);
-
-	smdb_cf_release_block(dfctx->cfctx, bcn);
+	pbkt = (struct smdb_db_bucket *) smdb_bc_get_block_data(pbcn);
+	while ((blkno = pbkt->next) != 0) {
+		if ((bcn = smdb_cf_get_block(dfctx->cfctx, blkno, 1)) == NULL) {
+			smdb_cf_release_block(dfctx->cfctx, pbcn);
+			return -1;
+		}
+		bkt = (struct smdb_db_bucket *) smdb_bc_get_block_data(bcn);
+		slt = (struct smdb_db_slot *) (bkt + 1);
+		for (i = 0; i < nslots && smdb_dbf_file_available(&slt[i].file);
+		     i++);
+		if (i < nslots) {
+			smdb_cf_release_block(dfctx->cfctx, pbcn);
+			pbcn = bcn;
+			pbkt = bkt;
+			continue;
+		}
+		pbkt->next = bkt->next;
+		smdb_cf_set_range_dirty(dfctx->cfctx, pbcn, pbkt, sizeof(*pbkt));
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+		if (smdb_dbf_release_file(dfctx, blkno, 1) < 0) {
+			smdb_cf_release_block(dfctx->cfctx, pbcn);
+			return -1;
+		}
+	}
+	smdb_cf_release_block(dfctx->cfctx, pbcn);
 
-	return error;
+	return 0;
 }
 
-static int smdb_dbf_enum(struct smdb_dbfile_ctx *dfctx, struct smdb_db_env *env,
-			 struct smdb_db_record *rec, struct smdb_db_kenum *ken)
+static int smdb_dbf_lh_split(struct smdb_dbfile_ctx *dfctx,
+			     struct smdb_db_env *env)
 {
-	smdb_u32 i, idx, dbf_x_blk, istart, blkno;
-	struct smdb_bc_node *bcn;
-	struct smdb_db_file *dbf;
+	smdb_u32 i, nslots, count, seg, offset, sblkno, dblkno, blkno;
+	smdb_u32 *segs;
+	struct smdb_bc_node *bcn, *dbcn;
+	struct smdb_db_bucket *bkt;
+	struct smdb_db_slot *slt, *dslt;
+	struct smdb_db_file sgf;
 
-	dbf_x_blk = env->hdr->blk_size / sizeof(struct smdb_db_file);
-	for (idx = ken->idx; idx < ken->hsize;) {
-		blkno = idx / dbf_x_blk;
-		istart = idx % dbf_x_blk;
-		if ((bcn = smdb_cf_get_block(dfctx->cfctx, env->tbl->hash.blkno +
-					     blkno, 0)) == NULL)
+	/*
+	 * Once the bucket count cannot double anymore, the table keeps
+	 * growing the bucket chains instead.
+	 */
+	count = env->tbl->nbase << env->tbl->level;
+	if (((count << 1) >> 1) != count)
+		return 0;
+	/*
+	 * The first bucket of a segment brings in the whole segment.
+	 */
+	seg = smdb_dbf_lh_segment(env->tbl->nbase, env->tbl->split + count,
+				  &offset);
+	if (offset == 0) {
+		if (seg >= SMDB_DBF_LH_SEGMENTS ||
+		    smdb_dbf_alloc_file(dfctx,
+					smdb_dbf_lh_segsize(env->tbl->nbase, seg),
+					&sgf) < 0)
+			return -1;
+		if (smdb_dbf_fresh_file(dfctx, &sgf) < 0 ||
+		    (bcn = smdb_cf_get_block(dfctx->cfctx, env->tbl->hash.blkno,
+					     1)) == NULL) {
+			smdb_dbf_release_file(dfctx, sgf.blkno, sgf.size);
+			return -1;
+		}
+		segs = (smdb_u32 *) smdb_bc_get_block_data(bcn);
+		segs[seg] = sgf.blkno;
+		smdb_cf_set_range_dirty(dfctx->cfctx, bcn, &segs[seg],
+					sizeof(segs[seg]));
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+	}
+	if (smdb_dbf_lh_block(dfctx->cfctx, env->tbl, env->tbl->split,
+			      &sblkno) < 0 ||
+	    smdb_dbf_lh_block(dfctx->cfctx, env->tbl, env->tbl->split + count,
+			      &dblkno) < 0 ||
+	    smdb_dbf_lh_init(dfctx, env->hdr, dblkno) < 0)
+		return -1;
+
+	/*
+	 * Move the entries of the split bucket whose hash value lands in
+	 * the new bucket at the next level. Only slots are moved, records
+	 * are not touched.
+	 */
+	nslots = smdb_dbf_lh_slots(env->hdr);
+	for (blkno = sblkno; blkno != 0;) {
+		if ((bcn = smdb_cf_get_block(dfctx->cfctx, blkno, 1)) == NULL)
 			return -1;
-		dbf = (struct smdb_db_file *) smdb_bc_get_block_data(bcn);
+		bkt = (struct smdb_db_bucket *) smdb_bc_get_block_data(bcn);
+		slt = (struct smdb_db_slot *) (bkt + 1);
 
-		for (i = istart, dbf += istart; i < dbf_x_blk; i++, dbf++) {
-			/*
-			 * If this is an empty slot, or we find a deleted item,
-			 * we need to continue to scan the chain since we want
-			 * to find them all.
-			 */
-			if (smdb_dbf_file_empty(dbf) || smdb_dbf_file_deleted(dbf))
+		for (i = 0; i < nslots; i++, slt++) {
+			if (smdb_dbf_file_available(&slt->file) ||
+			    slt->hashv % (count << 1) == env->tbl->split)
 				continue;
-
-			/*
-			 * We got a valid record, load this up.
-			 */
-			if (smdb_dbf_load_rec(dfctx, env->hdr, dbf, rec) < 0) {
+			if (smdb_dbf_lh_slot(dfctx, env, dblkno, &dbcn,
+					     &dslt) < 0) {
 				smdb_cf_release_block(dfctx->cfctx, bcn);
 				return -1;
 			}
-			smdb_cf_release_block(dfctx->cfctx, bcn);
-			ken->idx = idx + i - istart;
-			return 1;
+			*dslt = *slt;
+			smdb_cf_set_range_dirty(dfctx->cfctx, dbcn, dslt,
+						sizeof(*dslt));
+			smdb_cf_release_block(dfctx->cfctx, dbcn);
+
+			MZERO(*slt);
+			smdb_cf_set_range_dirty(dfctx->cfctx, bcn, slt,
+						sizeof(*slt));
 		}
 
+		blkno = bkt->next;
 		smdb_cf_release_block(dfctx->cfctx, bcn);
-		idx += dbf_x_blk - istart;
 	}
-	ken->idx = idx;
+	if (smdb_dbf_lh_trim(dfctx, env, sblkno) < 0)
+		return -1;
+
+	if (++env->tbl->split == count) {
+		env->tbl->level++;
+		env->tbl->split = 0;
+	}
+	smdb_cf_set_range_dirty(dfctx->cfctx, env->tbcn, env->tbl,
+				sizeof(*env->tbl));
 
 	return 0;
 }
 
-int smdb_dbf_begin(struct smdb_dbfile_ctx *dfctx)
+static int smdb_dbf_lh_merge(struct smdb_dbfile_ctx *dfctx,
+			     struct smdb_db_env *env)
 {
-	if (smdb_jf_begin(dfctx->jfctx) < 0)
+	smdb_u32 i, nslots, level, split, count, seg, offset, sblkno, dblkno,
+		blkno, next;
+	smdb_u32 *segs;
+	struct smdb_bc_node *bcn, *dbcn;
+	struct smdb_db_bucket *bkt;
+	struct smdb_db_slot *slt, *dslt;
+
+	/*
+	 * Undo the last split, by moving back the entries of the last bucket
+	 * into the bucket it was split from.
+	 */
+	if (env->tbl->split > 0) {
+		level = env->tbl->level;
+		split = env->tbl->split - 1;
+	} else if (env->tbl->level > 0) {
+		level = env->tbl->level - 1;
+		split = (env->tbl->nbase << level) - 1;
+	} else
+		return 0;
+	count = env->tbl->nbase << level;
+	if (smdb_dbf_lh_block(dfctx->cfctx, env->tbl, split + count,
+			      &sblkno) < 0 ||
+	    smdb_dbf_lh_block(dfctx->cfctx, env->tbl, split, &dblkno) < 0)
 		return -1;
 
-	return 0;
-}
+	nslots = smdb_dbf_lh_slots(env->hdr);
+	for (blkno = sblkno; blkno != 0;) {
+		if ((bcn = smdb_cf_get_block(dfctx->cfctx, blkno, 0)) == NULL)
+			return -1;
+		bkt = (struct smdb_db_bucket *) smdb_bc_get_block_data(bcn);
+		slt = (struct smdb_db_slot *) (bkt + 1);
 
-int smdb_dbf_end(struct smdb_dbfile_ctx *dfctx)
-{
-	if (smdb_cf_sync(dfctx->cfctx) < 0 ||
-	    smdb_jf_end(dfctx->jfctx) < 0)
+		for (i = 0; i < nslots; i++, slt++) {
+			if (smdb_dbf_file_available(&slt->file))
+				continue;
+			if (smdb_dbf_lh_slot(dfctx, env, dblkno, &dbcn,
+					     &dslt) < 0) {
+				smdb_cf_release_block(dfctx->cfctx, bcn);
+				return -1;
+			}
+			*dslt = *slt;
+			smdb_cf_set_range_dirty(dfctx->cfctx, dbcn, dslt,
+						sizeof(*dslt));
+			smdb_cf_release_block(dfctx->cfctx, dbcn);
+		}
+
+		next = bkt->next;
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+		if (blkno != sblkno &&
+		    smdb_dbf_release_file(dfctx, blkno, 1) < 0)
+			return -1;
+		blkno = next;
+	}
+	if (smdb_dbf_lh_trim(dfctx, env, dblkno) < 0)
 		return -1;
+	/*
+	 * The last bucket of a segment takes the whole segment with it.
+	 */
+	seg = smdb_dbf_lh_segment(env->tbl->nbase, split + count, &offset);
+	if (offset == 0) {
+		if ((bcn = smdb_cf_get_block(dfctx->cfctx, env->tbl->hash.blkno,
+					     1)) == NULL)
+			return -1;
+		segs = (smdb_u32 *) smdb_bc_get_block_data(bcn);
+		if (smdb_dbf_release_file(dfctx, segs[seg],
+					  smdb_dbf_lh_segsize(env->tbl->nbase,
+							      seg)) < 0) {
+			smdb_cf_release_block(dfctx->cfctx, bcn);
+			return -1;
+		}
+		segs[seg] = 0;
+		smdb_cf_set_range_dirty(dfctx->cfctx, bcn, &segs[seg],
+					sizeof(segs[seg]));
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+	}
+
+	env->tbl->level = level;
+	env->tbl->split = split;
+	smdb_cf_set_range_dirty(dfctx->cfctx, env->tbcn, env->tbl,
+				sizeof(*env->tbl));
 
 	return 0;
 }
 
-int smdb_dbf_rollback(struct smdb_dbfile_ctx *dfctx)
+static int smdb_dbf_lh_put(struct smdb_dbfile_ctx *dfctx,
+			   struct smdb_db_env *env, smdb_u32 hashv,
+			   struct smdb_db_ckey const *key,
+			   struct smdb_db_cdata *data)
 {
-	if (smdb_jf_rollback(dfctx->jfctx) < 0)
+	smdb_u32 blkno;
+	struct smdb_bc_node *bcn;
+	struct smdb_db_slot *slt;
+
+	/*
+	 * Split one bucket when the table gets above 80% of the slots
+	 * of the main bucket blocks, so that the cost of growing the table
+	 * is spread over the puts.
+	 */
+	if (5 * (smdb_u64) env->tbl->num_recs >=
+	    4 * (smdb_u64) smdb_dbf_lh_buckets(env->tbl) *
+	    smdb_dbf_lh_slots(env->hdr) &&
+	    smdb_dbf_lh_split(dfctx, env) < 0)
 		return -1;
 
-	return 0;
+	if (smdb_dbf_lh_block(dfctx->cfctx, env->tbl,
+			      smdb_dbf_lh_bucket(env->tbl, hashv), &blkno) < 0 ||
+	    smdb_dbf_lh_slot(dfctx, env, blkno, &bcn, &slt) < 0)
+		return -1;
+	if (smdb_dbf_falloc_rec(dfctx, env, key, data, hashv, &slt->file) < 0) {
+		smdb_cf_release_block(dfctx->cfctx, bcn);
+		return -1;
+	}
+	slt->hashv = hashv;
+	smdb_cf_set_range_dirty(dfctx->cfctx, bcn, slt, sizeof(*slt));
+	smdb_cf_release_block(dfctx->cfctx, bcn);
+
+	return 1;
 }
 
-int smdb_dbf_get(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
-		 struct smdb_db_ckey const *key, struct smdb_db_record *rec,
-		 struct smdb_db_kenum *ken)
+static int smdb_dbf_put_env(struct smdb_dbfile_ctx *dfctx,
+			    struct smdb_db_env *env, smdb_u32 hashv,
+			    struct smdb_db_ckey const *key,
+			    struct smdb_db_cdata *data)
 {
-	int match_res;
-	struct smdb_db_env env;
-
-	if (smdb_dbf_grab_env(dfctx, tblid, 0, &env) < 0)
-		return -1;
-
-	MZERO(*ken);
-	ken->tblid = (smdb_u32) tblid;
-	ken->hashv = (smdb_u32) smdb_get_hash(key->data, key->size, SMDB_HASHV_INIT);
-	ken->hsize = (env.tbl->hash.size * env.hdr->blk_size) / sizeof(struct smdb_db_file);
-	ken->idx = ken->hashv % ken->hsize;
+	int put_res;
+	smdb_u32 hsize, hash_blocks;
+
+	if (env->tbl->mode == SMDB_DBF_TBL_LINEAR) {
+		if ((put_res = smdb_dbf_lh_put(dfctx, env, hashv, key,
+					       data)) > 0) {
+			env->tbl->num_recs++;
+			smdb_cf_set_range_dirty(dfctx->cfctx, env->tbcn, env->tbl,
+						sizeof(*env->tbl));
+		}
 
-	if ((match_res = smdb_dbf_find_key(dfctx, &env, key, NULL,
-					   rec, ken, 0)) > 0)
-		ken->idx++;
+		return put_res;
+	}
+	hsize = smdb_dbf_hash_slots(env->hdr, env->tbl->hash.size);
 
-	smdb_dbf_release_env(dfctx, &env);
+	/*
+	 * We need to make sure that there is enough free space inside the
+	 * hash, so that chain walks can properly terminate.  If we do not
+	 * do that, we end up looping endlessly. Deleted slots take space
+	 * within the chains as well, and when they are the ones filling the
+	 * hash, this is rebuilt with the same size to purge them.
+	 */
+	if (5 * hsize < 6 * (env->tbl->num_recs + env->tbl->num_dels)) {
+		hash_blocks = env->tbl->hash.size;
+		if (5 * hsize < 12 * env->tbl->num_recs)
+			hash_blocks *= 2;
+		if (smdb_dbf_hash_resize(dfctx, env, hash_blocks) < 0)
+			return -1;
+		smdb_cf_set_range_dirty(dfctx->cfctx, env->tbcn, env->tbl,
+					sizeof(*env->tbl));
+		smdb_cf_set_range_dirty(dfctx->cfctx, env->mbcn, env->hdr,
+					sizeof(*env->hdr));
+		hsize = smdb_dbf_hash_slots(env->hdr, env->tbl->hash.size);
+	}
+	/*
+	 * Store the key+data couple inside the DB.  We allow multiple storage
+	 * of the same key, so the user will have to take care of it, if he
+	 * needs unicity.
+	 */
+	if ((put_res = smdb_dbf_put_key(dfctx, env, hashv, hsize, key,
+					data)) > 0) {
+		env->tbl->num_recs++;
+		smdb_cf_set_range_dirty(dfctx->cfctx, env->tbcn, env->tbl,
+					sizeof(*env->tbl));
+	}
 
-	return match_res;
+	return put_res;
 }
 
-int smdb_dbf_get_next(struct smdb_dbfile_ctx *dfctx, struct smdb_db_ckey const *key,
-		      struct smdb_db_record *rec, struct smdb_db_kenum *ken)
+int smdb_dbf_put(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
+		 struct smdb_db_ckey const *key, struct smdb_db_cdata *data)
 {
-	int match_res;
+	int put_res;
 	struct smdb_db_env env;
 
-	if (smdb_dbf_grab_env(dfctx, ken->tblid, 0, &env) < 0)
+	if (smdb_dbf_grab_env(dfctx, tblid, 1, &env) < 0)
 		return -1;
 
-	if ((match_res = smdb_dbf_find_key(dfctx, &env, key, NULL,
-					   rec, ken, 0)) > 0)
-		ken->idx++;
+	put_res = smdb_dbf_put_env(dfctx, &env, smdb_dbf_key_hash(&env, key),
+				   key, data);
 
 	smdb_dbf_release_env(dfctx, &env);
 
-	return match_res;
+	return put_res;
 }
 
-int smdb_dbf_first(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
-		   struct smdb_db_record *rec, struct smdb_db_kenum *ken)
+static int smdb_dbf_shrink(struct smdb_dbfile_ctx *dfctx,
+			   struct smdb_db_env *env)
 {
-	int match_res;
-	struct smdb_db_env env;
+	/*
+	 * Linear hashing tables merge back one bucket when below 40% of the
+	 * slots of the main bucket blocks, while classic tables halve the
+	 * hash when below 12.5% of its slots, so that there is room enough
+	 * before the next grow.
+	 */
+	if (env->tbl->mode == SMDB_DBF_TBL_LINEAR) {
+		if (5 * (smdb_u64) env->tbl->num_recs >=
+		    2 * (smdb_u64) smdb_dbf_lh_buckets(env->tbl) *
+		    smdb_dbf_lh_slots(env->hdr))
+			return 0;
 
-	if (smdb_dbf_grab_env(dfctx, tblid, 0, &env) < 0)
+		return smdb_dbf_lh_merge(dfctx, env);
+	}
+	if (env->tbl->hash.size < 2 ||
+	    8 * (smdb_u64) env->tbl->num_recs >=
+	    smdb_dbf_hash_slots(env->hdr, env->tbl->hash.size))
+		return 0;
+	if (smdb_dbf_hash_resize(dfctx, env, env->tbl->hash.size / 2) < 0)
 		return -1;
+	smdb_cf_set_range_dirty(dfctx->cfctx, env->tbcn, env->tbl,
+				sizeof(*env->tbl));
+	smdb_cf_set_range_dirty(dfctx->cfctx, env->mbcn, env->hdr,
+				sizeof(*env->hdr));
 
-	MZERO(*ken);
-	ken->tblid = (smdb_u32) tblid;
-	ken->hsize = (env.tbl->hash.size * env.hdr->blk_size) /
-		sizeof(struct smdb_db_file);
+	return 0;
+}
 
-	if ((match_res = smdb_dbf_enum(dfctx, &env, rec, ken)) > 0)
-		ken->idx++;
+static int smdb_dbf_erase_env(struct smdb_dbfile_ctx *dfctx,
+			      struct smdb_db_env *env, smdb_u32 hashv,
+			      struct smdb_db_ckey const *key,
+			      struct smdb_db_cdata const *data)
+{
+	int match_res;
+	struct smdb_db_kenum ken;
+	struct smdb_db_record rec;
 
-	smdb_dbf_release_env(dfctx, &env);
+	MZERO(ken);
+	ken.hashv = hashv;
+	smdb_dbf_key_start(env, &ken);
+
+	if ((match_res = smdb_dbf_find_key(dfctx, env, key, data, &rec,
+					   &ken, 1)) > 0) {
+		smdb_dbf_free_record(dfctx, &rec);
+		env->tbl->num_recs--;
+		smdb_cf_set_range_dirty(dfctx->cfctx, env->tbcn, env->tbl,
+					sizeof(*env->tbl));
+	}
 
 	return match_res;
 }
 
-int smdb_dbf_next(struct smdb_dbfile_ctx *dfctx, struct smdb_db_record *rec,
-		  struct smdb_db_kenum *ken)
+int smdb_dbf_erase(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
+		   struct smdb_db_ckey const *key,
+		   struct smdb_db_cdata const *data)
 {
 	int match_res;
 	struct smdb_db_env env;
 
-	if (smdb_dbf_grab_env(dfctx, ken->tblid, 0, &env) < 0)
+	if (smdb_dbf_grab_env(dfctx, tblid, 1, &env) < 0)
 		return -1;
 
-	if ((match_res = smdb_dbf_enum(dfctx, &env, rec, ken)) > 0)
-		ken->idx++;
+	if ((match_res = smdb_dbf_erase_env(dfctx, &env,
+					    smdb_dbf_key_hash(&env, key),
+					    key, data)) > 0 &&
+	    smdb_dbf_shrink(dfctx, &env) < 0)
+		match_res = -1;
 
 	smdb_dbf_release_env(dfctx, &env);
 
 	return match_res;
 }
 
-void smdb_dbf_free_record(struct smdb_dbfile_ctx *dfctx,
-			  struct smdb_db_record *rec)
-{
-	if (rec != NULL) {
-		/*
-		 * This may be called multiple times over the same record,
-		 * so nullify the record data pointer afterward.
-		 * The memory interface is supposed to be handling the
-		 * NULL pointer frees just fine.
-		 */
-		SMDBXI_MM_FREE(dfctx->mem, rec->record);
-		rec->record = NULL;
-	}
-}
-
-static int smdb_dbf_falloc_rec(struct smdb_dbfile_ctx *dfctx,
-			       struct smdb_db_env *env,
-			       struct smdb_db_ckey const *key,
-			       struct smdb_db_cdata *data,
-			       smdb_u32 hashv, struct smdb_db_file *dbf)
+int smdb_dbf_batch_create(struct smdb_dbfile_ctx *dfctx,
+			  struct smdb_dbf_batch **pbatch)
 {
-	smdb_u32 rec_blocks;
-	smdb_u64 rsize;
-	smdb_offset_t offset;
-	struct smdb_bc_node *bcn;
-	struct smdb_db_rstorage *stg;
-
-	/*
-	 * Calculate the space for the new record, and allocate the necessary
-	 * number of blocks on file.
-	 */
-	rsize = (smdb_u64) sizeof(struct smdb_db_rstorage) + key->size + data->size;
-	rec_blocks = (smdb_u32) (rsize / env->hdr->blk_size);
-	if ((rsize % env->hdr->blk_size) != 0)
-		rec_blocks++;
-	if (smdb_dbf_alloc_file(dfctx->cfctx, rec_blocks, dbf) < 0)
-		return -1;
-
-	/*
-	 * Setup the record storage header.
-	 */
-	if ((bcn = smdb_cf_get_block(dfctx->cfctx, dbf->blkno,
-				     1)) == NULL) {
-		smdb_dbf_bfree(dfctx->cfctx, dbf->blkno, dbf->size);
-		return -1;
-	}
-	stg = (struct smdb_db_rstorage *) smdb_bc_get_block_data(bcn);
-	stg->hashv = hashv;
-	stg->ksize = key->size;
-	stg->dsize = data->size;
+	struct smdb_dbf_batch *batch;
 
-	smdb_cf_set_block_dirty(dfctx->cfctx, bcn);
-	smdb_cf_release_block(dfctx->cfctx, bcn);
-	/*
-	 * Write key and data into the new space. Key and data follow the record
-	 * storage header.
-	 */
-	offset = (smdb_offset_t) dbf->blkno * env->hdr->blk_size +
-		sizeof(struct smdb_db_rstorage);
-	if (smdb_cf_write(dfctx->cfctx, offset, key->data,
-			  key->size) != (int) key->size ||
-	    smdb_cf_write(dfctx->cfctx, offset + key->size, data->data,
-			  data->size) != (int) data->size) {
-		smdb_dbf_bfree(dfctx->cfctx, dbf->blkno, dbf->size);
+	if ((batch = OBJALLOC(dfctx->mem, struct smdb_dbf_batch)) == NULL)
 		return -1;
-	}
+	batch->dfctx = dfctx;
+	batch->nops = 0;
+	batch->head = NULL;
+	batch->ptail = &batch->head;
+	*pbatch = batch;
 
 	return 0;
 }
 
-static int smdb_dbf_put_key(struct smdb_dbfile_ctx *dfctx,
-			    struct smdb_db_env *env, smdb_u32 hashv,
-			    smdb_u32 hsize, struct smdb_db_ckey const *key,
-			    struct smdb_db_cdata *data)
+void smdb_dbf_batch_free(struct smdb_dbf_batch *batch)
 {
-	smdb_u32 i, idx, dbf_x_blk, istart, blkno;
-	struct smdb_bc_node *bcn;
-	struct smdb_db_file *dbf;
-
-	idx = hashv % hsize;
-	dbf_x_blk = env->hdr->blk_size / sizeof(struct smdb_db_file);
-	for (;;) {
-		blkno = idx / dbf_x_blk;
-		istart = idx % dbf_x_blk;
-		if ((bcn = smdb_cf_get_block(dfctx->cfctx, env->tbl->hash.blkno +
-					     blkno, 1)) == NULL)
-			return -1;
-		dbf = (struct smdb_db_file *) smdb_bc_get_block_data(bcn);
-
-		for (i = istart, dbf += istart; i < dbf_x_blk; i++, dbf++) {
-			if (smdb_dbf_file_available(dbf)) {
-				if (smdb_dbf_falloc_rec(dfctx, env, key, data,
-							hashv, dbf) < 0) {
-					smdb_cf_release_block(dfctx->cfctx, bcn);
-					return -1;
-				}
-				smdb_cf_set_block_dirty(dfctx->cfctx, bcn);
-				smdb_cf_release_block(dfctx->cfctx, bcn);
-
-				return 1;
-			}
-		}
+	struct smdb_dbf_bop *bop;
 
-		smdb_cf_release_block(dfctx->cfctx, bcn);
-		idx += dbf_x_blk - istart;
-		if (idx == hsize)
-			idx = 0;
+	while ((bop = batch->head) != NULL) {
+		batch->head = bop->next;
+		SMDBXI_MM_FREE(batch->dfctx->mem, bop);
 	}
-
-	return 0;
+	SMDBXI_MM_FREE(batch->dfctx->mem, batch);
 }
 
-static int smdb_dbf_get_rec_stg(struct smdb_cfile_ctx *cfctx,
-				struct smdb_db_file const *dbf,
-				struct smdb_db_rstorage *rstg)
+static int smdb_dbf_batch_add(struct smdb_dbf_batch *batch,
+			      unsigned int tblid, int erase,
+			      struct smdb_db_ckey const *key,
+			      struct smdb_db_cdata const *data)
 {
-	struct smdb_bc_node *bcn;
-	struct smdb_db_rstorage *stg;
+	unsigned long dsize = data != NULL ? data->size: 0;
+	char *buf;
+	struct smdb_dbf_bop *bop;
 
-	if ((bcn = smdb_cf_get_block(cfctx, dbf->blkno, 0)) == NULL)
+	/*
+	 * Operations carry their own copy of the key and data, within the
+	 * same allocation, so that the caller buffers can be reused as soon
+	 * as the operation is queued. The sequence number of an operation
+	 * is kept in the low 32 bits of its sort order.
+	 */
+	if (batch->nops >= 0xffffffffUL ||
+	    (bop = (struct smdb_dbf_bop *)
+	     SMDBXI_MM_ALLOC(batch->dfctx->mem,
+			     sizeof(*bop) + key->size + dsize)) == NULL)
 		return -1;
-	stg = (struct smdb_db_rstorage *) smdb_bc_get_block_data(bcn);
-
-	*rstg = *stg;
-
-	smdb_cf_release_block(cfctx, bcn);
+	buf = (char *) (bop + 1);
+	smdb_memcpy(buf, key->data, key->size);
+	if (dsize > 0)
+		smdb_memcpy(buf + key->size, data->data, dsize);
+	bop->next = NULL;
+	bop->tblid = (smdb_u32) tblid;
+	bop->hashv = 0;
+	bop->erase = erase;
+	bop->match = data != NULL;
+	bop->order = 0;
+	bop->key.data = buf;
+	bop->key.size = key->size;
+	bop->data.data = buf + key->size;
+	bop->data.size = dsize;
+	*batch->ptail = bop;
+	batch->ptail = &bop->next;
+	batch->nops++;
 
 	return 0;
 }
 
-static int smdb_dbf_set_hash_ent(struct smdb_cfile_ctx *cfctx,
-				 struct smdb_db_env *env, smdb_u32 hashv,
-				 smdb_u32 hsize, struct smdb_db_file const *rdbf)
+int smdb_dbf_batch_put(struct smdb_dbf_batch *batch, unsigned int tblid,
+		       struct smdb_db_ckey const *key,
+		       struct smdb_db_cdata const *data)
 {
-	smdb_u32 i, idx, dbf_x_blk, istart, blkno;
-	struct smdb_bc_node *bcn;
-	struct smdb_db_file *dbf;
-
-	idx = hashv % hsize;
-	dbf_x_blk = env->hdr->blk_size / sizeof(struct smdb_db_file);
-	for (;;) {
-		blkno = idx / dbf_x_blk;
-		istart = idx % dbf_x_blk;
-		if ((bcn = smdb_cf_get_block(cfctx, env->tbl->hash.blkno +
-					     blkno, 1)) == NULL)
-			return -1;
-		dbf = (struct smdb_db_file *) smdb_bc_get_block_data(bcn);
-
-		for (i = istart, dbf += istart; i < dbf_x_blk; i++, dbf++) {
-			if (smdb_dbf_file_available(dbf)) {
-				*dbf = *rdbf;
-
-				smdb_cf_set_block_dirty(cfctx, bcn);
-				smdb_cf_release_block(cfctx, bcn);
+	return smdb_dbf_batch_add(batch, tblid, 0, key, data);
+}
 
-				return 1;
-			}
-		}
+int smdb_dbf_batch_erase(struct smdb_dbf_batch *batch, unsigned int tblid,
+			 struct smdb_db_ckey const *key,
+			 struct smdb_db_cdata const *data)
+{
+	return smdb_dbf_batch_add(batch, tblid, 1, key, data);
+}
 
-		smdb_cf_release_block(cfctx, bcn);
-		idx += dbf_x_blk - istart;
-		if (idx == hsize)
-			idx = 0;
+static void smdb_dbf_bop_sift_down(struct smdb_dbf_bop **ops,
+				   unsigned long i, unsigned long n)
+{
+	unsigned long c;
+	struct smdb_dbf_bop *tmp;
+
+	for (; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && ops[c + 1]->order > ops[c]->order)
+			c++;
+		if (ops[i]->order >= ops[c]->order)
+			break;
+		tmp = ops[i];
+		ops[i] = ops[c];
+		ops[c] = tmp;
 	}
-
-	return 0;
 }
 
-static int smdb_dbf_hash_grow(struct smdb_cfile_ctx *cfctx,
-			      struct smdb_db_env *env)
+static void smdb_dbf_sort_bops(struct smdb_dbf_bop **ops, unsigned long n)
 {
-	smdb_u32 i, blkno, hash_blocks, dbf_x_blk, hsize;
-	struct smdb_bc_node *bcn;
-	struct smdb_db_file *dbf;
-	struct smdb_db_file hash, ohash;
-	struct smdb_db_rstorage rstg;
+	unsigned long i;
+	struct smdb_dbf_bop *tmp;
 
 	/*
-	 * Double the size of the current hash, and alloc a new space
-	 * for it.
-	 */
-	hash_blocks = env->tbl->hash.size * 2;
-	if (smdb_dbf_alloc_file(cfctx, hash_blocks, &hash) < 0)
-		return -1;
-	/*
-	 * Properly init/zero the newly allocated hash.
+	 * The sequence number in the low bits makes all the orders distinct,
+	 * so the heap sort keeps the queueing order of the operations which
+	 * land at the same place.
 	 */
-	if (smdb_cf_zero(cfctx, hash.blkno, hash.size) < 0) {
-		smdb_dbf_bfree(cfctx, hash.blkno, hash.size);
-		return -1;
+	for (i = n / 2; i > 0; i--)
+		smdb_dbf_bop_sift_down(ops, i - 1, n);
+	for (i = n; i > 1; i--) {
+		tmp = ops[0];
+		ops[0] = ops[i - 1];
+		ops[i - 1] = tmp;
+		smdb_dbf_bop_sift_down(ops, 0, i - 1);
 	}
+}
 
-	ohash = env->tbl->hash;
-	env->tbl->hash = hash;
+static int smdb_dbf_hash_reserve(struct smdb_dbfile_ctx *dfctx,
+				 struct smdb_db_env *env, smdb_u32 nputs)
+{
+	smdb_u64 nrecs;
+	smdb_u32 hash_blocks;
 
 	/*
-	 * Loop through every old hash entry, and re-insert then into
-	 * the new hash position.  We cannot just copy over here, since
-	 * the new hash size generates different indexes for the same
-	 * hash values.
+	 * Size the hash once for all the puts of a batch, with the same
+	 * thresholds smdb_dbf_put_env() uses, instead of doubling it (and
+	 * rehashing everything) several times along the way. Linear hashing
+	 * tables already grow one bucket at a time.
 	 */
-	hsize = (hash_blocks * env->hdr->blk_size) / sizeof(struct smdb_db_file);
-	dbf_x_blk = env->hdr->blk_size / sizeof(struct smdb_db_file);
-	for (blkno = 0; blkno < ohash.size; blkno++) {
-		if ((bcn = smdb_cf_get_block(cfctx, ohash.blkno +
-					     blkno, 0)) == NULL) {
-			smdb_dbf_bfree(cfctx, ohash.blkno, ohash.size);
-			return -1;
-		}
-		dbf = (struct smdb_db_file *) smdb_bc_get_block_data(bcn);
-
-		for (i = 0; i < dbf_x_blk; i++, dbf++) {
-			if (dbf->size == 0 || dbf->blkno == 0)
-				continue;
-
-			if (smdb_dbf_get_rec_stg(cfctx, dbf, &rstg) < 0 ||
-			    smdb_dbf_set_hash_ent(cfctx, env, rstg.hashv,
-						  hsize, dbf) < 0) {
-				smdb_cf_release_block(cfctx, bcn);
-				smdb_dbf_bfree(cfctx, ohash.blkno, ohash.size);
-				return -1;
-			}
-		}
-
-		smdb_cf_release_block(cfctx, bcn);
-	}
-
-	smdb_dbf_bfree(cfctx, ohash.blkno, ohash.size);
+	if (env->tbl->mode == SMDB_DBF_TBL_LINEAR)
+		return 0;
+	nrecs = (smdb_u64) env->tbl->num_recs + nputs;
+	if (5 * (smdb_u64) smdb_dbf_hash_slots(env->hdr, env->tbl->hash.size) >=
+	    6 * (nrecs + env->tbl->num_dels))
+		return 0;
+	for (hash_blocks = env->tbl->hash.size;
+	     5 * (smdb_u64) smdb_dbf_hash_slots(env->hdr, hash_blocks) <
+		     12 * nrecs; hash_blocks *= 2)
+		;
+	if (smdb_dbf_hash_resize(dfctx, env, hash_blocks) < 0)
+		return -1;
+	smdb_cf_set_range_dirty(dfctx->cfctx, env->tbcn, env->tbl,
+				sizeof(*env->tbl));
+	smdb_cf_set_range_dirty(dfctx->cfctx, env->mbcn, env->hdr,
+				sizeof(*env->hdr));
 
 	return 0;
 }
 
-int smdb_dbf_put(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
-		 struct smdb_db_ckey const *key, struct smdb_db_cdata *data)
+static int smdb_dbf_batch_table(struct smdb_dbfile_ctx *dfctx,
+				struct smdb_dbf_bop **ops, unsigned long n)
 {
-	int put_res;
-	smdb_u32 hashv, hsize;
+	int res = 0;
+	unsigned long i;
+	smdb_u32 home, nputs = 0;
 	struct smdb_db_env env;
+	struct smdb_db_kenum ken;
+	struct smdb_dbf_bop *bop;
 
-	if (smdb_dbf_grab_env(dfctx, tblid, 1, &env) < 0)
+	if (smdb_dbf_grab_env(dfctx, ops[0]->tblid, 1, &env) < 0)
 		return -1;
-
-	hashv = (smdb_u32) smdb_get_hash(key->data, key->size, SMDB_HASHV_INIT);
-	hsize = (env.tbl->hash.size * env.hdr->blk_size) / sizeof(struct smdb_db_file);
-
+	for (i = 0; i < n; i++) {
+		ops[i]->hashv = smdb_dbf_key_hash(&env, &ops[i]->key);
+		if (!ops[i]->erase)
+			nputs++;
+	}
+	if (smdb_dbf_hash_reserve(dfctx, &env, nputs) < 0) {
+		smdb_dbf_release_env(dfctx, &env);
+		return -1;
+	}
 	/*
-	 * We need to make sure that there is enough free space inside the
-	 * hash, so that chain walks can properly terminate.  If we do not
-	 * do that, we end up looping endlessly.
+	 * Apply the operations in home slot (or bucket) order, so that every
+	 * hash block is visited once, in file order, by the whole batch.
+	 * Splits, merges and rebuilds along the way may move things around,
+	 * which only makes the order less perfect.
 	 */
-	if (5 * hsize < 6 * env.tbl->num_recs) {
-		if (smdb_dbf_hash_grow(dfctx->cfctx, &env) < 0) {
-			smdb_dbf_release_env(dfctx, &env);
-			return -1;
+	MZERO(ken);
+	for (i = 0; i < n; i++) {
+		bop = ops[i];
+		if (env.tbl->mode == SMDB_DBF_TBL_LINEAR)
+			home = smdb_dbf_lh_bucket(env.tbl, bop->hashv);
+		else {
+			ken.hashv = bop->hashv;
+			smdb_dbf_key_start(&env, &ken);
+			home = ken.idx;
 		}
-		smdb_cf_set_block_dirty(dfctx->cfctx, env.tbcn);
-		smdb_cf_set_block_dirty(dfctx->cfctx, env.mbcn);
-		hsize = (env.tbl->hash.size * env.hdr->blk_size) / sizeof(struct smdb_db_file);
+		bop->order = ((smdb_u64) home << 32) |
+			(bop->order & 0xffffffffUL);
+	}
+	smdb_dbf_sort_bops(ops, n);
+	for (i = 0; i < n && res >= 0; i++) {
+		bop = ops[i];
+		if (bop->erase)
+			res = smdb_dbf_erase_env(dfctx, &env, bop->hashv,
+						 &bop->key,
+						 bop->match ? &bop->data: NULL);
+		else
+			res = smdb_dbf_put_env(dfctx, &env, bop->hashv,
+					       &bop->key, &bop->data);
 	}
 	/*
-	 * Store the key+data couple inside the DB.  We allow multiple storage
-	 * of the same key, so the user will have to take care of it, if he
-	 * needs unicity.
+	 * One shrink check for the whole batch, rather than one per erase.
 	 */
-	if ((put_res = smdb_dbf_put_key(dfctx, &env, hashv, hsize, key,
-					data)) > 0) {
-		env.tbl->num_recs++;
-		smdb_cf_set_block_dirty(dfctx->cfctx, env.tbcn);
-	}
+	if (res >= 0 && smdb_dbf_shrink(dfctx, &env) < 0)
+		res = -1;
 
 	smdb_dbf_release_env(dfctx, &env);
 
-	return put_res;
+	return res < 0 ? -1: 0;
 }
 
-int smdb_dbf_erase(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
-		   struct smdb_db_ckey const *key,
-		   struct smdb_db_cdata const *data)
+int smdb_dbf_batch_apply(struct smdb_dbf_batch *batch)
 {
-	int match_res;
-	struct smdb_db_env env;
-	struct smdb_db_kenum ken;
-	struct smdb_db_record rec;
+	int res = 0, owntx;
+	unsigned long i, j, n = batch->nops;
+	struct smdb_dbfile_ctx *dfctx = batch->dfctx;
+	struct smdb_dbf_bop *bop, **ops;
 
-	if (smdb_dbf_grab_env(dfctx, tblid, 1, &env) < 0)
+	if (n == 0)
+		return 0;
+	if ((ops = (struct smdb_dbf_bop **)
+	     SMDBXI_MM_ALLOC(dfctx->mem, n * sizeof(*ops))) == NULL)
 		return -1;
-
-	MZERO(ken);
-	ken.hashv = (smdb_u32) smdb_get_hash(key->data, key->size, SMDB_HASHV_INIT);
-	ken.hsize = (env.tbl->hash.size * env.hdr->blk_size) / sizeof(struct smdb_db_file);
-	ken.idx = ken.hashv % ken.hsize;
-
-	if ((match_res = smdb_dbf_find_key(dfctx, &env, key, data, &rec,
-					   &ken, 1)) > 0) {
-		smdb_dbf_free_record(dfctx, &rec);
-		env.tbl->num_recs--;
-		smdb_cf_set_block_dirty(dfctx->cfctx, env.tbcn);
+	/*
+	 * Group the operations by table, keeping their queueing order
+	 * within each table.
+	 */
+	for (i = 0, bop = batch->head; bop != NULL; bop = bop->next, i++) {
+		bop->order = ((smdb_u64) bop->tblid << 32) | i;
+		ops[i] = bop;
+	}
+	smdb_dbf_sort_bops(ops, n);
+	/*
+	 * Without a transaction already open, the batch runs within its
+	 * own, so that it is applied as a whole or not at all. Within the
+	 * caller's one, a failure leaves the rollback to the caller.
+	 */
+	owntx = !dfctx->intx;
+	if (owntx && smdb_dbf_begin(dfctx) < 0) {
+		SMDBXI_MM_FREE(dfctx->mem, ops);
+		return -1;
+	}
+	for (i = 0; i < n && res >= 0; i = j) {
+		for (j = i + 1; j < n && ops[j]->tblid == ops[i]->tblid; j++)
+			;
+		res = smdb_dbf_batch_table(dfctx, ops + i, j - i);
 	}
+	SMDBXI_MM_FREE(dfctx->mem, ops);
+	if (owntx) {
+		if (res < 0) {
+			smdb_dbf_rollback(dfctx);
+			return -1;
+		}
 
-	smdb_dbf_release_env(dfctx, &env);
+		return smdb_dbf_end(dfctx);
+	}
 
-	return match_res;
+	return res;
 }
-
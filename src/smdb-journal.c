@@ -18,12 +18,31 @@
 #include "smdb-incl.h"
 
 #define SMDB_BHASH_MINSIZE 512
+#define SMDB_REHASH_STEP 16
 #define SMDB_NO_OFFSET 0xffffffff
-#define SMDB_JFILE_MAGIC "SMDBJF01"
+#define SMDB_DEL_OFFSET 0xfffffffe
+#define SMDB_FRESH_OFFSET 0xfffffffd
+#define SMDB_ZERO_OFFSET 0xfffffffc
+#define SMDB_JFILE_MAGIC "SMDBJF05"
+#define SMDB_JHEADER_MAGIC "SMDBJH01"
+#define SMDB_JHEADER_SLOTS 2
+#define SMDB_PLAY_MAXBLOCKS 64
+#define SMDB_SYNC_MS 1000
+#define SMDB_DELTA_RATIO 4
+
+struct smdb_jfile_header {
+	smdb_u8 magic[8];
+	smdb_u64 seq;
+	smdb_u32 crc;
+};
 
 struct smdb_jfile_trailer {
 	smdb_u8 magic[8];
 	smdb_offset_t offset;
+	smdb_offset_t boffset;
+	smdb_u64 seq;
+	smdb_u32 tcrc;
+	smdb_u32 crc;
 };
 
 static char *smdb_jf_journal_path(struct smdbxi_mem *mem, char const *path)
@@ -42,6 +61,11 @@ static char *smdb_jf_journal_path(struct smdbxi_mem *mem, char const *path)
 	return jpath;
 }
 
+static smdb_offset_t smdb_jf_data_offset(struct smdb_jfile_ctx *jfctx)
+{
+	return (smdb_offset_t) SMDB_JHEADER_SLOTS * jfctx->blk_size;
+}
+
 static unsigned long smdb_jf_offset_index(smdb_u32 offset, unsigned long bhbits,
 					  unsigned long bhmask)
 {
@@ -50,180 +74,619 @@ static unsigned long smdb_jf_offset_index(smdb_u32 offset, unsigned long bhbits,
 	return (unsigned long) offset & bhmask;
 }
 
-static void smdb_jf_reset_blkhash(struct smdb_jfile_ctx *jfctx)
+static int smdb_jf_sync_file(struct smdb_jfile_ctx *jfctx,
+			     struct smdbxi_file *file)
 {
-	smdb_memset(jfctx->bhash, 0xff,
-		    (jfctx->bhmask + 1) * sizeof(smdb_offset_t));
-	jfctx->bcount = 0;
+	/*
+	 * A commit group whose strongest transaction asked for data-only
+	 * durability does not need the file metadata to hit the disk.
+	 */
+	return jfctx->glevel == SMDB_DUR_DATA ? SMDBXI_FL_DATASYNC(file):
+		SMDBXI_FL_SYNC(file);
+}
+
+static struct smdb_jbhash_node *smdb_jf_new_blkhash(struct smdb_jfile_ctx *jfctx,
+						    unsigned long bhbits)
+{
+	unsigned long size;
+	struct smdb_jbhash_node *bhash;
+
+	size = 1UL << bhbits;
+	if ((bhash = (struct smdb_jbhash_node *)
+	     SMDBXI_MM_ALLOC(jfctx->mem, size *
+			     sizeof(struct smdb_jbhash_node))) == NULL)
+		return NULL;
+	smdb_memset(bhash, 0xff, size * sizeof(struct smdb_jbhash_node));
+
+	return bhash;
+}
+
+static void smdb_jf_set_blkhash(struct smdb_jfile_ctx *jfctx,
+				struct smdb_jbhash_node *bhash,
+				unsigned long bhbits)
+{
+	jfctx->bhash = bhash;
+	jfctx->bhmask = (1UL << bhbits) - 1;
+	jfctx->bhbits = bhbits;
+	jfctx->bused = 0;
 	jfctx->bdeleted = 0;
 	jfctx->bfree = jfctx->bhmask + 1;
 }
 
-static int smdb_jf_alloc_blkhash(struct smdb_jfile_ctx *jfctx)
+static unsigned long smdb_jf_min_bits(void)
 {
-	unsigned long i, n, hsize;
-	smdb_offset_t fsize;
+	unsigned long n;
 
-	if ((fsize = SMDBXI_FL_SEEK(jfctx->bfile, 0, SMDBXI_FL_SEEKEND)) < 0)
-		return -1;
-	hsize = (unsigned long) (fsize / jfctx->blk_size);
-	if (hsize < SMDB_BHASH_MINSIZE)
-		hsize = SMDB_BHASH_MINSIZE;
-	for (i = 1, n = 0; i < hsize; i <<= 1, n++);
+	for (n = 0; (1UL << n) < SMDB_BHASH_MINSIZE; n++);
 
-	if ((jfctx->bhash = (struct smdb_jbhash_node *)
-	     SMDBXI_MM_ALLOC(jfctx->mem, i * sizeof(struct smdb_jbhash_node))) == NULL)
-		return -1;
-	smdb_memset(jfctx->bhash, 0xff, i * sizeof(struct smdb_jbhash_node));
+	return n;
+}
 
-	jfctx->bhmask = i - 1;
-	jfctx->bhbits = n;
-	jfctx->bfree = i;
+static void smdb_jf_reset_blkhash(struct smdb_jfile_ctx *jfctx)
+{
+	unsigned long bhbits;
+	struct smdb_jbhash_node *bhash;
 
-	return 0;
+	SMDBXI_MM_FREE(jfctx->mem, jfctx->obhash);
+	jfctx->obhash = NULL;
+	/*
+	 * The map only holds the blocks written since the last checkpoint,
+	 * so once empty it goes back to its minimum size.
+	 */
+	bhbits = smdb_jf_min_bits();
+	if (jfctx->bhbits > bhbits &&
+	    (bhash = smdb_jf_new_blkhash(jfctx, bhbits)) != NULL) {
+		SMDBXI_MM_FREE(jfctx->mem, jfctx->bhash);
+		smdb_jf_set_blkhash(jfctx, bhash, bhbits);
+	} else {
+		smdb_memset(jfctx->bhash, 0xff,
+			    (jfctx->bhmask + 1) * sizeof(struct smdb_jbhash_node));
+		smdb_jf_set_blkhash(jfctx, jfctx->bhash, jfctx->bhbits);
+	}
+	jfctx->bcount = 0;
 }
 
-static int smdb_jf_resize_blkhash(struct smdb_jfile_ctx *jfctx,
-				  unsigned long bhbits)
+static int smdb_jf_alloc_blkhash(struct smdb_jfile_ctx *jfctx)
 {
-	unsigned long i, idx, bhmask;
-	struct smdb_jbhash_node *bhash, *obhash;
+	unsigned long bhbits;
+	struct smdb_jbhash_node *bhash;
 
-	bhmask = (1UL << bhbits) - 1;
-	if ((bhash = (struct smdb_jbhash_node *)
-	     SMDBXI_MM_ALLOC(jfctx->mem, (bhmask + 1) *
-			     sizeof(struct smdb_jbhash_node))) == NULL)
+	/*
+	 * The map is sized after the blocks written by the transactions,
+	 * not after the DB file, and starts small.
+	 */
+	bhbits = smdb_jf_min_bits();
+	if ((bhash = smdb_jf_new_blkhash(jfctx, bhbits)) == NULL)
 		return -1;
-	smdb_memset(bhash, 0xff, (bhmask + 1) * sizeof(struct smdb_jbhash_node));
+	smdb_jf_set_blkhash(jfctx, bhash, bhbits);
+
+	return 0;
+}
+
+static struct smdb_jbhash_node *smdb_jf_probe_node(struct smdb_jbhash_node *bhash,
+						    unsigned long bhbits,
+						    unsigned long bhmask,
+						    smdb_u32 offset, int insert)
+{
+	unsigned long idx;
 
 	/*
-	 * Reassign the hashed blocks according to the new hash size.
+	 * Look for the slot of an offset, or for the first slot an offset can
+	 * be inserted into.
+	 */
+	idx = smdb_jf_offset_index(offset, bhbits, bhmask);
+	for (;;) {
+		if (bhash[idx].joffset == SMDB_NO_OFFSET)
+			return insert ? &bhash[idx]: NULL;
+		if (insert ? bhash[idx].offset == SMDB_NO_OFFSET:
+		    bhash[idx].offset == offset)
+			return &bhash[idx];
+		if (idx < bhmask)
+			idx++;
+		else
+			idx = 0;
+	}
+}
+
+static void smdb_jf_rehash_step(struct smdb_jfile_ctx *jfctx,
+				unsigned long count)
+{
+	struct smdb_jbhash_node *bhn, *nbhn;
+
+	/*
+	 * Move the live entries of the old map into the new one, a few slots
+	 * at a time. Moved slots keep their journal offset, so that they do
+	 * not break the probe chains of the old map.
 	 * Yes, we might end up forgetting about some block we could use
 	 * due to a truncate/trim-blocks, but it should not be a problem
 	 * worth dealing with.
 	 */
-	for (i = 0, obhash = jfctx->bhash; i <= jfctx->bhmask; i++) {
-		if (obhash[i].joffset == SMDB_NO_OFFSET ||
-		    obhash[i].offset == SMDB_NO_OFFSET)
+	for (; count > 0 && jfctx->obnext <= jfctx->obmask;
+	     count--, jfctx->obnext++) {
+		bhn = &jfctx->obhash[jfctx->obnext];
+		if (bhn->joffset == SMDB_NO_OFFSET ||
+		    bhn->offset == SMDB_NO_OFFSET)
 			continue;
-
-		idx = smdb_jf_offset_index(obhash[i].offset, bhbits, bhmask);
-		for (;;) {
-			if (bhash[idx].joffset == SMDB_NO_OFFSET ||
-			    bhash[idx].offset == SMDB_NO_OFFSET)
-				break;
-			if (idx < bhmask)
-				idx++;
-			else
-				idx = 0;
-		}
-		bhash[idx] = obhash[i];
+		nbhn = smdb_jf_probe_node(jfctx->bhash, jfctx->bhbits,
+					  jfctx->bhmask, bhn->offset, 1);
+		if (nbhn->joffset == SMDB_NO_OFFSET)
+			jfctx->bused++;
+		*nbhn = *bhn;
+		bhn->offset = SMDB_NO_OFFSET;
+	}
+	if (jfctx->obnext > jfctx->obmask) {
+		SMDBXI_MM_FREE(jfctx->mem, jfctx->obhash);
+		jfctx->obhash = NULL;
 	}
+}
 
-	SMDBXI_MM_FREE(jfctx->mem, jfctx->bhash);
-	jfctx->bhash = bhash;
-	jfctx->bhmask = bhmask;
-	jfctx->bhbits = bhbits;
-	jfctx->bfree = bhmask + 1;
-	jfctx->bdeleted = 0;
+static void smdb_jf_finish_rehash(struct smdb_jfile_ctx *jfctx)
+{
+	if (jfctx->obhash != NULL)
+		smdb_jf_rehash_step(jfctx, jfctx->obmask + 1);
+}
+
+static int smdb_jf_start_rehash(struct smdb_jfile_ctx *jfctx,
+				unsigned long bhbits)
+{
+	struct smdb_jbhash_node *bhash;
+
+	smdb_jf_finish_rehash(jfctx);
+	if ((bhash = smdb_jf_new_blkhash(jfctx, bhbits)) == NULL)
+		return -1;
+	jfctx->obhash = jfctx->bhash;
+	jfctx->obmask = jfctx->bhmask;
+	jfctx->obbits = jfctx->bhbits;
+	jfctx->obnext = 0;
+	smdb_jf_set_blkhash(jfctx, bhash, bhbits);
 
 	return 0;
 }
 
-static int smdb_jf_fetch_block(struct smdb_jfile_ctx *jfctx, smdb_offset_t foffset,
-			       smdb_offset_t *pjoffset)
+static int smdb_jf_resize_blkhash(struct smdb_jfile_ctx *jfctx,
+				  unsigned long bhbits)
 {
-	unsigned long idx;
-	smdb_u32 offset;
-	struct smdb_jbhash_node *bhash;
+	if (smdb_jf_start_rehash(jfctx, bhbits) < 0)
+		return -1;
+	smdb_jf_finish_rehash(jfctx);
+	jfctx->bcount = jfctx->bused;
 
-	offset = (smdb_u32) (foffset / jfctx->blk_size);
-	idx = smdb_jf_offset_index(offset, jfctx->bhbits, jfctx->bhmask);
-	for (bhash = jfctx->bhash;;) {
-		if (bhash[idx].joffset == SMDB_NO_OFFSET)
-			break;
-		if (bhash[idx].offset == offset) {
-			*pjoffset = (smdb_offset_t) bhash[idx].joffset *
-				jfctx->blk_size;
+	return 0;
+}
+
+static struct smdb_jbhash_node *smdb_jf_find_node(struct smdb_jfile_ctx *jfctx,
+						   smdb_u32 offset)
+{
+	struct smdb_jbhash_node *bhn;
+
+	/*
+	 * While the map is being resized, entries not moved yet are still
+	 * inside the old one.
+	 */
+	if ((bhn = smdb_jf_probe_node(jfctx->bhash, jfctx->bhbits,
+				      jfctx->bhmask, offset, 0)) == NULL &&
+	    jfctx->obhash != NULL)
+		bhn = smdb_jf_probe_node(jfctx->obhash, jfctx->obbits,
+					 jfctx->obmask, offset, 0);
+
+	return bhn;
+}
+
+static int smdb_jf_zeroed(struct smdb_jfile_ctx *jfctx, smdb_u32 offset)
+{
+	unsigned long i;
+
+	/*
+	 * Zero extents are few (one per zeroed range), so a linear scan
+	 * does the job.
+	 */
+	for (i = 0; i < jfctx->zcount; i++)
+		if (offset >= jfctx->zext[i].offset &&
+		    offset - jfctx->zext[i].offset < jfctx->zext[i].doffset)
 			return 1;
-		}
-		if (idx < jfctx->bhmask)
-			idx++;
-		else
-			idx = 0;
+
+	return 0;
+}
+
+static int smdb_jf_append_hit(struct smdb_jfile_ctx *jfctx, smdb_u32 joffset)
+{
+	smdb_offset_t offset;
+
+	offset = (smdb_offset_t) joffset * jfctx->blk_size;
+
+	return jfctx->acount > 0 && offset >= jfctx->aoffset &&
+		offset < jfctx->aoffset + (smdb_offset_t) jfctx->acount;
+}
+
+static int smdb_jf_append_flush(struct smdb_jfile_ctx *jfctx)
+{
+	if (jfctx->acount > 0) {
+		if (smdb_off_write(jfctx->jfile, jfctx->aoffset, jfctx->abuf,
+				   (int) jfctx->acount) != (int) jfctx->acount)
+			return -1;
+		jfctx->acount = 0;
 	}
 
 	return 0;
 }
 
-static int smdb_jf_alloc_block(struct smdb_jfile_ctx *jfctx, smdb_offset_t foffset,
-			       smdb_offset_t *pjoffset)
+static int smdb_jf_write_image(struct smdb_jfile_ctx *jfctx, smdb_u32 joffset,
+			       void const *buf)
 {
-	unsigned long i, n, idx;
-	smdb_u32 offset;
-	smdb_offset_t joffset;
-	struct smdb_jbhash_node *bhash;
+	smdb_offset_t offset;
+
+	offset = (smdb_offset_t) joffset * jfctx->blk_size;
+	if (jfctx->abuf != NULL) {
+		/*
+		 * Images of the blocks appended to the journal are gathered,
+		 * and written with large sequential writes.
+		 */
+		if (smdb_jf_append_hit(jfctx, joffset)) {
+			smdb_memcpy(jfctx->abuf + (offset - jfctx->aoffset), buf,
+				    jfctx->blk_size);
+			return 0;
+		}
+		if (offset + jfctx->blk_size == jfctx->jend) {
+			if (offset != jfctx->aoffset +
+			    (smdb_offset_t) jfctx->acount ||
+			    jfctx->acount == jfctx->append_blocks * jfctx->blk_size) {
+				if (smdb_jf_append_flush(jfctx) < 0)
+					return -1;
+				jfctx->aoffset = offset;
+			}
+			smdb_memcpy(jfctx->abuf + jfctx->acount, buf,
+				    jfctx->blk_size);
+			jfctx->acount += jfctx->blk_size;
+			return 0;
+		}
+	}
+
+	return smdb_off_write(jfctx->jfile, offset, buf,
+			      jfctx->blk_size) != (int) jfctx->blk_size ? -1: 0;
+}
 
+static int smdb_jf_read_block(struct smdb_jfile_ctx *jfctx, smdb_offset_t foffset,
+			      char *buf)
+{
+	struct smdb_jbhash_node *bhn;
+
+	if ((bhn = smdb_jf_find_node(jfctx, (smdb_u32) (foffset /
+							 jfctx->blk_size))) != NULL &&
+	    bhn->joffset == SMDB_FRESH_OFFSET)
+		bhn = NULL;
+	if (bhn != NULL && smdb_jf_append_hit(jfctx, bhn->joffset)) {
+		if (bhn->dsize == 0) {
+			smdb_memcpy(buf, jfctx->abuf +
+				    ((smdb_offset_t) bhn->joffset * jfctx->blk_size -
+				     jfctx->aoffset), jfctx->blk_size);
+			return 0;
+		}
+		if (smdb_jf_append_flush(jfctx) < 0)
+			return -1;
+	}
+	if (bhn != NULL && bhn->dsize == 0)
+		return smdb_off_read(jfctx->jfile,
+				     (smdb_offset_t) bhn->joffset * jfctx->blk_size,
+				     buf, jfctx->blk_size) != (int) jfctx->blk_size ?
+			-1: 0;
 	/*
-	 * Check if we are running out of space inside our hash table.
+	 * Blocks logged as deltas are rebuilt by laying the changed range
+	 * over the DB file block, or over a zero block if a zero extent
+	 * logged after the last checkpoint covers it.
 	 */
-	if (6 * jfctx->bcount > 5 * jfctx->bhmask &&
-	    smdb_jf_resize_blkhash(jfctx, jfctx->bhbits + 1) < 0)
+	if (smdb_jf_zeroed(jfctx, (smdb_u32) (foffset / jfctx->blk_size)))
+		smdb_memset(buf, 0, jfctx->blk_size);
+	else if (smdb_off_read(jfctx->bfile, foffset, buf,
+			       jfctx->blk_size) != (int) jfctx->blk_size)
+		return -1;
+	if (bhn != NULL &&
+	    smdb_off_read(jfctx->jfile,
+			  (smdb_offset_t) bhn->joffset * jfctx->blk_size +
+			  bhn->doffset, buf + bhn->dstart,
+			  (int) bhn->dsize) != (int) bhn->dsize)
 		return -1;
+
+	return 0;
+}
+
+static int smdb_jf_push_undo(struct smdb_jfile_ctx *jfctx,
+			     struct smdb_jbhash_node const *bhn)
+{
+	unsigned long usize;
+	struct smdb_jbhash_node *undo;
+
+	if (jfctx->ucount == jfctx->usize) {
+		usize = 2 * jfctx->usize + 64;
+		if ((undo = (struct smdb_jbhash_node *)
+		     SMDBXI_MM_ALLOC(jfctx->mem, usize *
+				     sizeof(struct smdb_jbhash_node))) == NULL)
+			return -1;
+		if (jfctx->ucount > 0)
+			smdb_memcpy(undo, jfctx->undo, jfctx->ucount *
+				    sizeof(struct smdb_jbhash_node));
+		SMDBXI_MM_FREE(jfctx->mem, jfctx->undo);
+		jfctx->undo = undo;
+		jfctx->usize = usize;
+	}
+	jfctx->undo[jfctx->ucount++] = *bhn;
+
+	return 0;
+}
+
+static int smdb_jf_push_drop(struct smdb_jfile_ctx *jfctx,
+			     struct smdb_jbhash_node const *bhn)
+{
+	unsigned long drsize;
+	smdb_u32 *drop;
+
 	/*
-	 * Find a usable slot to where to store the new entry.
+	 * The mapping being dropped might have replaced one written by an
+	 * earlier trailer, which the next trailer needs to drop. Nothing
+	 * needs to go while the journal holds no commit.
 	 */
-	offset = (smdb_u32) (foffset / jfctx->blk_size);
-	idx = smdb_jf_offset_index(offset, jfctx->bhbits, jfctx->bhmask);
-	for (bhash = jfctx->bhash;;) {
-		if (bhash[idx].joffset == SMDB_NO_OFFSET ||
-		    bhash[idx].offset == SMDB_NO_OFFSET)
-			break;
-		if (idx < jfctx->bhmask)
-			idx++;
-		else
-			idx = 0;
+	if (jfctx->committed == 0)
+		return 0;
+	if (jfctx->drcount == jfctx->drsize) {
+		drsize = 2 * jfctx->drsize + 64;
+		if ((drop = (smdb_u32 *)
+		     SMDBXI_MM_ALLOC(jfctx->mem, drsize *
+				     sizeof(smdb_u32))) == NULL)
+			return -1;
+		if (jfctx->drcount > 0)
+			smdb_memcpy(drop, jfctx->drop, jfctx->drcount *
+				    sizeof(smdb_u32));
+		SMDBXI_MM_FREE(jfctx->mem, jfctx->drop);
+		jfctx->drop = drop;
+		jfctx->drsize = drsize;
 	}
-	joffset = -1;
+	jfctx->drop[jfctx->drcount++] = bhn->offset;
+
+	return 0;
+}
+
+static int smdb_jf_new_jblock(struct smdb_jfile_ctx *jfctx,
+			      smdb_offset_t *pjoffset)
+{
+	unsigned long i, n;
+	struct smdb_jbhash_node *bhash;
+
 	if (jfctx->bfree <= jfctx->bhmask) {
 		/*
 		 * Try to fetch from the freed blocks previously allocated.
+		 * Only blocks allocated by the current transaction can be
+		 * recycled, since the ones below the transaction base still
+		 * hold the images of the sealed transactions of the group.
 		 */
-		for (i = jfctx->bfree, n = jfctx->bhmask; i <= n; i++)
+		for (i = jfctx->bfree, n = jfctx->bhmask, bhash = jfctx->bhash;
+		     i <= n; i++)
 			if (bhash[i].offset == SMDB_NO_OFFSET &&
-			    bhash[i].joffset != SMDB_NO_OFFSET)
+			    bhash[i].joffset != SMDB_NO_OFFSET &&
+			    bhash[i].joffset != SMDB_DEL_OFFSET &&
+			    bhash[i].joffset >= jfctx->jbase)
 				break;
 		jfctx->bfree = i;
 		if (i <= n) {
-			joffset = (smdb_offset_t) bhash[i].joffset * jfctx->blk_size;
+			*pjoffset = (smdb_offset_t) bhash[i].joffset *
+				jfctx->blk_size;
+			bhash[i].joffset = SMDB_DEL_OFFSET;
 			jfctx->bdeleted--;
+			return 0;
 		}
 	}
 	/*
 	 * If no previously allocated blocks were free, alloc from the
-	 * end of file.
+	 * end of the journal.
 	 */
-	if (joffset == -1 &&
-	    (joffset = SMDBXI_FL_SEEK(jfctx->jfile, 0, SMDBXI_FL_SEEKEND)) < 0)
+	*pjoffset = jfctx->jend;
+	jfctx->jend += jfctx->blk_size;
+
+	return 0;
+}
+
+static int smdb_jf_cow_block(struct smdb_jfile_ctx *jfctx,
+			     struct smdb_jbhash_node *bhn)
+{
+	smdb_offset_t joffset;
+
+	/*
+	 * The block image belongs to a sealed transaction of the current
+	 * commit group, so it cannot be overwritten in place (or a rollback
+	 * of the current transaction would lose it). Remember the old
+	 * mapping and move the block to a new journal location. Same goes
+	 * for a delta, whose journal block is shared with other deltas.
+	 */
+	if ((bhn->joffset < jfctx->jbase &&
+	     smdb_jf_push_undo(jfctx, bhn) < 0) ||
+	    smdb_jf_new_jblock(jfctx, &joffset) < 0)
 		return -1;
+	bhn->joffset = (smdb_u32) (joffset / jfctx->blk_size);
+	bhn->dsize = 0;
+
+	return 0;
+}
 
-	bhash[idx].offset = offset;
-	bhash[idx].joffset = (smdb_u32) (joffset / jfctx->blk_size);
+static int smdb_jf_alloc_node(struct smdb_jfile_ctx *jfctx, smdb_u32 offset,
+			      struct smdb_jbhash_node **pbhn)
+{
+	struct smdb_jbhash_node *bhn;
+
+	/*
+	 * Check if we are running out of space inside our hash table. The
+	 * slots left behind by dropped blocks end no probe chain, so they
+	 * count as used, and a rehash at the same size purges them when the
+	 * live blocks alone do not need a larger table. The rehash is spread
+	 * over the following insertions, instead of being done in one go.
+	 */
+	if (6 * jfctx->bused > 5 * jfctx->bhmask &&
+	    smdb_jf_start_rehash(jfctx, 3 * jfctx->bcount > 2 * jfctx->bhmask ?
+				 jfctx->bhbits + 1: jfctx->bhbits) < 0)
+		return -1;
+	if (jfctx->obhash != NULL)
+		smdb_jf_rehash_step(jfctx, SMDB_REHASH_STEP);
+	/*
+	 * Find a usable slot to where to store the new entry. The caller
+	 * deals with the freed block the slot might still be pointing to.
+	 */
+	bhn = smdb_jf_probe_node(jfctx->bhash, jfctx->bhbits, jfctx->bhmask,
+				 offset, 1);
+	if (bhn->joffset == SMDB_NO_OFFSET)
+		jfctx->bused++;
+	bhn->offset = offset;
+	bhn->dsize = 0;
 
 	jfctx->bcount++;
 
-	*pjoffset = joffset;
+	*pbhn = bhn;
+
+	return 0;
+}
+
+static int smdb_jf_alloc_block(struct smdb_jfile_ctx *jfctx, smdb_offset_t foffset,
+			       struct smdb_jbhash_node **pbhn)
+{
+	smdb_offset_t joffset;
+	struct smdb_jbhash_node *bhn;
+
+	if (smdb_jf_alloc_node(jfctx, (smdb_u32) (foffset / jfctx->blk_size),
+			       &bhn) < 0)
+		return -1;
+	if (bhn->joffset != SMDB_NO_OFFSET &&
+	    bhn->joffset != SMDB_DEL_OFFSET &&
+	    bhn->joffset >= jfctx->jbase) {
+		/*
+		 * We landed on a freed block of the current transaction,
+		 * so we can re-use it straight away.
+		 */
+		joffset = (smdb_offset_t) bhn->joffset * jfctx->blk_size;
+		jfctx->bdeleted--;
+	} else if (smdb_jf_new_jblock(jfctx, &joffset) < 0)
+		return -1;
+	bhn->joffset = (smdb_u32) (joffset / jfctx->blk_size);
+
+	*pbhn = bhn;
 
 	return 0;
 }
 
 static int smdb_jf_want_block(struct smdb_jfile_ctx *jfctx, smdb_offset_t foffset,
-			      smdb_offset_t *pjoffset)
+			      struct smdb_jbhash_node **pbhn)
+{
+	struct smdb_jbhash_node *bhn;
+
+	if ((bhn = smdb_jf_find_node(jfctx, (smdb_u32) (foffset /
+							jfctx->blk_size))) == NULL)
+		return smdb_jf_alloc_block(jfctx, foffset, pbhn);
+	if ((bhn->joffset < jfctx->jbase || bhn->dsize != 0) &&
+	    smdb_jf_cow_block(jfctx, bhn) < 0)
+		return -1;
+	*pbhn = bhn;
+
+	return 0;
+}
+
+static int smdb_jf_write_delta(struct smdb_jfile_ctx *jfctx, char const *buf,
+			       smdb_u32 dstart, smdb_u32 dsize)
 {
-	if (smdb_jf_fetch_block(jfctx, foffset, pjoffset) > 0)
+	smdb_u32 offset, dend;
+	smdb_offset_t joffset;
+	struct smdb_jbhash_node *bhn;
+
+	/*
+	 * A delta gets applied over the DB file content left by the last
+	 * checkpoint, so the block must have been there since then, and
+	 * must not be already logged as full image.
+	 */
+	if (jfctx->offset + jfctx->blk_size > jfctx->dlimit)
+		return 0;
+	offset = (smdb_u32) (jfctx->offset / jfctx->blk_size);
+	dend = dstart + dsize;
+	if ((bhn = smdb_jf_find_node(jfctx, offset)) != NULL) {
+		if (bhn->dsize == 0)
+			return 0;
+		/*
+		 * A single range is kept per block, covering the ones logged
+		 * by the previous writes.
+		 */
+		if (bhn->dstart < dstart)
+			dstart = bhn->dstart;
+		if (bhn->dstart + bhn->dsize > dend)
+			dend = bhn->dstart + bhn->dsize;
+	} else if (dend == dstart) {
+		jfctx->offset += jfctx->blk_size;
+		return 1;
+	}
+	if ((dsize = dend - dstart) > jfctx->blk_size / SMDB_DELTA_RATIO)
 		return 0;
+	/*
+	 * Deltas are packed inside delta blocks owned by the transaction,
+	 * which get allocated like any other journal block.
+	 */
+	if (jfctx->dblock == SMDB_NO_OFFSET ||
+	    jfctx->dused + dsize > jfctx->blk_size) {
+		if (smdb_jf_new_jblock(jfctx, &joffset) < 0)
+			return -1;
+		jfctx->dblock = (smdb_u32) (joffset / jfctx->blk_size);
+		jfctx->dused = 0;
+	}
+	if ((smdb_jf_append_hit(jfctx, jfctx->dblock) &&
+	     smdb_jf_append_flush(jfctx) < 0) ||
+	    smdb_off_write(jfctx->jfile,
+			   (smdb_offset_t) jfctx->dblock * jfctx->blk_size +
+			   jfctx->dused, buf + dstart,
+			   (int) dsize) != (int) dsize)
+		return -1;
+	if (bhn == NULL) {
+		if (smdb_jf_alloc_node(jfctx, offset, &bhn) < 0)
+			return -1;
+		if (bhn->joffset != SMDB_NO_OFFSET &&
+		    bhn->joffset != SMDB_DEL_OFFSET)
+			jfctx->bdeleted--;
+	} else if (bhn->joffset < jfctx->jbase &&
+		   smdb_jf_push_undo(jfctx, bhn) < 0)
+		return -1;
+	bhn->joffset = jfctx->dblock;
+	bhn->doffset = jfctx->dused;
+	bhn->dstart = dstart;
+	bhn->dsize = dsize;
+	bhn->crc = smdb_crc32c(0, buf + dstart, dsize);
+	jfctx->dused += dsize;
+	jfctx->offset += jfctx->blk_size;
+	jfctx->active = 1;
 
-	return smdb_jf_alloc_block(jfctx, foffset, pjoffset);
+	return 1;
+}
+
+static int smdb_jf_drop_node(struct smdb_jfile_ctx *jfctx,
+			     struct smdb_jbhash_node *bhn)
+{
+	unsigned long i;
+
+	/*
+	 * We mark the freed blocks in such a way that we can re-use them.
+	 * That is, ->offset set to SMDB_NO_OFFSET, and ->joffset left
+	 * pointing to the freed block.
+	 */
+	if ((bhn->joffset < jfctx->jbase &&
+	     smdb_jf_push_undo(jfctx, bhn) < 0) ||
+	    smdb_jf_push_drop(jfctx, bhn) < 0)
+		return -1;
+	bhn->offset = SMDB_NO_OFFSET;
+	jfctx->bcount--;
+	/*
+	 * Delta blocks are shared, and fresh blocks have no journal block,
+	 * so neither can be re-used. Nor can the ones still inside the old
+	 * map of a resize, since that is not scanned for free blocks.
+	 */
+	if (bhn->dsize != 0 || bhn->joffset == SMDB_FRESH_OFFSET ||
+	    bhn < jfctx->bhash || bhn > jfctx->bhash + jfctx->bhmask) {
+		bhn->joffset = SMDB_DEL_OFFSET;
+		return 0;
+	}
+	if ((i = (unsigned long) (bhn - jfctx->bhash)) < jfctx->bfree)
+		jfctx->bfree = i;
+	jfctx->bdeleted++;
+
+	return 0;
 }
 
 static int smdb_jf_trim_blocks(struct smdb_jfile_ctx *jfctx, smdb_offset_t fsize)
@@ -233,22 +696,171 @@ static int smdb_jf_trim_blocks(struct smdb_jfile_ctx *jfctx, smdb_offset_t fsize
 	struct smdb_jbhash_node *bhash;
 
 	/*
-	 * Drop all the blocks which fall above the specified size. We mark
-	 * those freed blocks in such a way that we can re-use them.
-	 * That is, ->offset set to SMDB_NO_OFFSET, and ->joffset left
-	 * pointing to the freed block.
+	 * Drop all the blocks which fall above the specified size.
 	 */
 	size = (smdb_u32) (fsize / jfctx->blk_size);
+	smdb_jf_finish_rehash(jfctx);
 	for (i = 0, bhash = jfctx->bhash; i <= jfctx->bhmask; i++) {
 		if (bhash[i].offset == SMDB_NO_OFFSET ||
 		    bhash[i].joffset == SMDB_NO_OFFSET)
 			continue;
-		if (bhash[i].offset >= size) {
-			bhash[i].offset = SMDB_NO_OFFSET;
-			if (i < jfctx->bfree)
-				jfctx->bfree = i;
-			jfctx->bcount--;
-			jfctx->bdeleted++;
+		if (bhash[i].offset >= size &&
+		    smdb_jf_drop_node(jfctx, &bhash[i]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int smdb_jf_add_zext(struct smdb_jfile_ctx *jfctx, smdb_u32 blkno,
+			    smdb_u32 count)
+{
+	unsigned long zsize;
+	struct smdb_jbhash_node *zext;
+
+	if (jfctx->zcount == jfctx->zsize) {
+		zsize = 2 * jfctx->zsize + 16;
+		if ((zext = (struct smdb_jbhash_node *)
+		     SMDBXI_MM_ALLOC(jfctx->mem, zsize *
+				     sizeof(struct smdb_jbhash_node))) == NULL)
+			return -1;
+		if (jfctx->zcount > 0)
+			smdb_memcpy(zext, jfctx->zext, jfctx->zcount *
+				    sizeof(struct smdb_jbhash_node));
+		SMDBXI_MM_FREE(jfctx->mem, jfctx->zext);
+		jfctx->zext = zext;
+		jfctx->zsize = zsize;
+	}
+	/*
+	 * Zero extents are stored inside the table like the block mappings,
+	 * with SMDB_ZERO_OFFSET as journal offset, and the number of blocks
+	 * inside the ->doffset field.
+	 */
+	zext = &jfctx->zext[jfctx->zcount++];
+	smdb_memset(zext, 0, sizeof(*zext));
+	zext->offset = blkno;
+	zext->joffset = SMDB_ZERO_OFFSET;
+	zext->doffset = count;
+
+	return 0;
+}
+
+static int smdb_jf_zero_run(struct smdb_jfile_ctx *jfctx, smdb_u32 blkno,
+			    smdb_u32 count, int fresh)
+{
+	/*
+	 * Fresh blocks go straight into the DB file like their writes do.
+	 * They cannot be part of a zero extent, which would otherwise get
+	 * played over their new content.
+	 */
+	if (fresh) {
+		if (smdb_off_zero(jfctx->bfile,
+				  (smdb_offset_t) blkno * jfctx->blk_size,
+				  (smdb_offset_t) count * jfctx->blk_size,
+				  jfctx->mem, jfctx->blk_size) < 0)
+			return -1;
+		jfctx->bdirty = 1;
+		return 0;
+	}
+
+	return smdb_jf_add_zext(jfctx, blkno, count);
+}
+
+static int smdb_jf_zero_blocks(struct smdb_jfile_ctx *jfctx, smdb_u32 blkno,
+			       smdb_u32 count)
+{
+	smdb_u32 i, n;
+	int fresh, bfresh;
+	struct smdb_jbhash_node *bhn;
+
+	/*
+	 * The blocks mapped inside the range are dropped, so that all the
+	 * ones mapped within a zero extent have been written after it, and
+	 * the replay can simply play the zero extents first. The range is
+	 * then logged with a single entry, whatever its size.
+	 */
+	for (i = n = 0, fresh = 0; i < count; i++) {
+		bhn = smdb_jf_find_node(jfctx, blkno + i);
+		bfresh = bhn != NULL && bhn->joffset == SMDB_FRESH_OFFSET;
+		if (bfresh != fresh) {
+			if (n > 0 &&
+			    smdb_jf_zero_run(jfctx, blkno + i - n, n, fresh) < 0)
+				return -1;
+			n = 0;
+			fresh = bfresh;
+		}
+		if (bhn != NULL && !bfresh && smdb_jf_drop_node(jfctx, bhn) < 0)
+			return -1;
+		n++;
+	}
+	if (n > 0 && smdb_jf_zero_run(jfctx, blkno + count - n, n, fresh) < 0)
+		return -1;
+	jfctx->active = 1;
+
+	return 0;
+}
+
+static int smdb_jf_undo_blocks(struct smdb_jfile_ctx *jfctx)
+{
+	unsigned long i, idx;
+	struct smdb_jbhash_node *bhash;
+
+	/*
+	 * Drop all the blocks mapped by the current transaction ...
+	 */
+	smdb_jf_finish_rehash(jfctx);
+	for (i = 0, bhash = jfctx->bhash; i <= jfctx->bhmask; i++) {
+		if (bhash[i].joffset == SMDB_NO_OFFSET ||
+		    bhash[i].joffset == SMDB_DEL_OFFSET ||
+		    bhash[i].joffset < jfctx->jbase)
+			continue;
+		bhash[i].offset = SMDB_NO_OFFSET;
+		bhash[i].joffset = SMDB_DEL_OFFSET;
+	}
+	/*
+	 * ... and restore the mappings of the sealed transactions which
+	 * were either moved or trimmed. The rehash will purge the deleted
+	 * entries left around.
+	 */
+	for (i = 0; i < jfctx->ucount; i++) {
+		idx = smdb_jf_offset_index(jfctx->undo[i].offset, jfctx->bhbits,
+					   jfctx->bhmask);
+		for (;;) {
+			if (bhash[idx].joffset == SMDB_NO_OFFSET ||
+			    bhash[idx].offset == SMDB_NO_OFFSET)
+				break;
+			if (idx < jfctx->bhmask)
+				idx++;
+			else
+				idx = 0;
+		}
+		bhash[idx] = jfctx->undo[i];
+	}
+	jfctx->ucount = 0;
+
+	return smdb_jf_resize_blkhash(jfctx, jfctx->bhbits);
+}
+
+static int smdb_jf_buf_write(struct smdbxi_file *file, char *buf,
+			     unsigned long bsize, unsigned long *pn,
+			     smdb_u32 *pcrc, void const *data,
+			     unsigned long size)
+{
+	unsigned long count;
+
+	for (; size > 0; size -= count) {
+		if ((count = bsize - *pn) > size)
+			count = size;
+		if (data != NULL) {
+			smdb_memcpy(buf + *pn, data, (int) count);
+			data = (char const *) data + count;
+		} else
+			smdb_memset(buf + *pn, 0xff, (int) count);
+		if ((*pn += count) == bsize) {
+			if (SMDBXI_FL_WRITE(file, buf, (int) bsize) != (int) bsize)
+				return -1;
+			*pcrc = smdb_crc32c(*pcrc, buf, bsize);
+			*pn = 0;
 		}
 	}
 
@@ -257,57 +869,681 @@ static int smdb_jf_trim_blocks(struct smdb_jfile_ctx *jfctx, smdb_offset_t fsize
 
 static int smdb_jf_finish_journal(struct smdb_jfile_ctx *jfctx)
 {
-	unsigned long i;
-	smdb_offset_t offset;
+	unsigned long i, n, count;
+	smdb_u32 tcrc, cblock;
+	smdb_offset_t offset, toffset;
+	char *buf;
 	struct smdb_jbhash_node *bhash;
+	struct smdb_jbhash_node dbhn;
 	struct smdb_jfile_trailer jft;
 
 	/*
-	 * Write the block mapping table at the end of the file.
+	 * Write the block mapping table at the end of the file. The table
+	 * is padded with unused entries so that the trailer ends on a block
+	 * boundary, from where the blocks of the following transactions
+	 * will be allocated.
 	 */
-	if ((offset = SMDBXI_FL_SEEK(jfctx->jfile, 0, SMDBXI_FL_SEEKEND)) < 0)
+	offset = jfctx->jend;
+	if (SMDBXI_FL_SEEK(jfctx->jfile, offset, SMDBXI_FL_SEEKSET) != offset ||
+	    (buf = (char *) SMDBXI_MM_ALLOC(jfctx->mem, jfctx->blk_size)) == NULL)
 		return -1;
 
-	for (i = 0, bhash = jfctx->bhash; i <= jfctx->bhmask; i++) {
+	/*
+	 * The table only carries what changed since the previous trailer.
+	 * That is, the blocks written by the group, which all live past the
+	 * previous trailer, the mappings it dropped, and its zero extents.
+	 * The recovery merges the tables of the whole chain.
+	 */
+	cblock = (smdb_u32) (jfctx->cend / jfctx->blk_size);
+	smdb_jf_finish_rehash(jfctx);
+	for (i = 0, n = 0, count = 0, tcrc = 0, bhash = jfctx->bhash;
+	     i <= jfctx->bhmask; i++) {
 		/*
 		 * Write only active (not freed) blocks.
 		 */
 		if (bhash[i].joffset == SMDB_NO_OFFSET ||
-		    bhash[i].offset == SMDB_NO_OFFSET)
+		    bhash[i].offset == SMDB_NO_OFFSET ||
+		    bhash[i].joffset == SMDB_FRESH_OFFSET ||
+		    bhash[i].joffset < cblock)
+			continue;
+		if (smdb_jf_buf_write(jfctx->jfile, buf, jfctx->blk_size, &n,
+				      &tcrc, &bhash[i],
+				      sizeof(struct smdb_jbhash_node)) < 0) {
+			SMDBXI_MM_FREE(jfctx->mem, buf);
+			return -1;
+		}
+		count++;
+	}
+	/*
+	 * Dropped mappings are stored with SMDB_DEL_OFFSET as journal offset.
+	 */
+	MZERO(dbhn);
+	dbhn.joffset = SMDB_DEL_OFFSET;
+	for (i = 0; i < jfctx->drcount; i++, count++) {
+		dbhn.offset = jfctx->drop[i];
+		if (smdb_jf_buf_write(jfctx->jfile, buf, jfctx->blk_size, &n,
+				      &tcrc, &dbhn,
+				      sizeof(struct smdb_jbhash_node)) < 0) {
+			SMDBXI_MM_FREE(jfctx->mem, buf);
+			return -1;
+		}
+	}
+	for (i = jfctx->zcommit; i < jfctx->zcount; i++, count++)
+		if (smdb_jf_buf_write(jfctx->jfile, buf, jfctx->blk_size, &n,
+				      &tcrc, &jfctx->zext[i],
+				      sizeof(struct smdb_jbhash_node)) < 0) {
+			SMDBXI_MM_FREE(jfctx->mem, buf);
+			return -1;
+		}
+	toffset = offset + count * sizeof(struct smdb_jbhash_node) + sizeof(jft);
+	count = (unsigned long) ((jfctx->blk_size - toffset % jfctx->blk_size) %
+				 jfctx->blk_size);
+	if (smdb_jf_buf_write(jfctx->jfile, buf, jfctx->blk_size, &n,
+			      &tcrc, NULL, count) < 0 ||
+	    (n > 0 && SMDBXI_FL_WRITE(jfctx->jfile, buf, (int) n) != (int) n)) {
+		SMDBXI_MM_FREE(jfctx->mem, buf);
+		return -1;
+	}
+	if (n > 0)
+		tcrc = smdb_crc32c(tcrc, buf, n);
+	SMDBXI_MM_FREE(jfctx->mem, buf);
+	toffset += (smdb_offset_t) count - (smdb_offset_t) sizeof(jft);
+
+	/*
+	 * The trailer carries the checksum of the table, and the table the
+	 * ones of the blocks written since the previous commit. A trailer
+	 * becoming visible before the data it refers to is detected by the
+	 * replay, so a single sync is enough to commit.
+	 */
+	MZERO(jft);
+	smdb_memcpy(jft.magic, SMDB_JFILE_MAGIC, sizeof(jft.magic));
+	jft.offset = offset;
+	jft.boffset = jfctx->cend;
+	jft.seq = jfctx->seq;
+	jft.tcrc = tcrc;
+	jft.crc = smdb_crc32c(0, &jft, (unsigned long)
+			      OFFSETOF(struct smdb_jfile_trailer, crc));
+	if (SMDBXI_FL_WRITE(jfctx->jfile, &jft, sizeof(jft)) != sizeof(jft) ||
+	    smdb_jf_sync_file(jfctx, jfctx->jfile) < 0)
+		return -1;
+	jfctx->seq++;
+	jfctx->jend = toffset + sizeof(jft);
+	jfctx->drcount = 0;
+	jfctx->zcommit = jfctx->zcount;
+
+	return 0;
+}
+
+static int smdb_jf_write_header(struct smdb_jfile_ctx *jfctx)
+{
+	struct smdb_jfile_header jfh;
+
+	MZERO(jfh);
+	smdb_memcpy(jfh.magic, SMDB_JHEADER_MAGIC, sizeof(jfh.magic));
+	jfh.seq = jfctx->seq;
+	jfh.crc = smdb_crc32c(0, &jfh, (unsigned long)
+			      OFFSETOF(struct smdb_jfile_header, crc));
+	/*
+	 * Alternate between the header slots, so that a torn header write
+	 * leaves the previous header in place.
+	 */
+	jfctx->hslot = (jfctx->hslot + 1) % SMDB_JHEADER_SLOTS;
+	if (smdb_off_write(jfctx->jfile,
+			   (smdb_offset_t) jfctx->hslot * jfctx->blk_size,
+			   &jfh, sizeof(jfh)) != sizeof(jfh))
+		return -1;
+
+	return 0;
+}
+
+static int smdb_jf_read_header(struct smdb_jfile_ctx *jfctx)
+{
+	unsigned int i;
+	int found;
+	struct smdb_jfile_header jfh;
+
+	for (i = 0, found = 0; i < SMDB_JHEADER_SLOTS; i++) {
+		if (smdb_off_read(jfctx->jfile,
+				  (smdb_offset_t) i * jfctx->blk_size,
+				  &jfh, sizeof(jfh)) != sizeof(jfh) ||
+		    smdb_memcmp(jfh.magic, SMDB_JHEADER_MAGIC,
+				sizeof(jfh.magic)) != 0 ||
+		    jfh.crc != smdb_crc32c(0, &jfh, (unsigned long)
+					   OFFSETOF(struct smdb_jfile_header, crc)))
 			continue;
-		if (SMDBXI_FL_WRITE(jfctx->jfile, &bhash[i],
-				    sizeof(struct smdb_jbhash_node)) !=
-		    sizeof(struct smdb_jbhash_node))
+		if (!found || jfh.seq > jfctx->seq) {
+			jfctx->seq = jfh.seq;
+			jfctx->hslot = i;
+			found = 1;
+		}
+	}
+
+	return found;
+}
+
+static int smdb_jf_size_journal(struct smdb_jfile_ctx *jfctx)
+{
+	int size;
+	smdb_offset_t jsize, psize;
+	void *buf;
+
+	psize = (smdb_offset_t) jfctx->prealloc_blocks * jfctx->blk_size;
+	if (psize < smdb_jf_data_offset(jfctx))
+		psize = smdb_jf_data_offset(jfctx);
+	if ((jsize = SMDBXI_FL_SEEK(jfctx->jfile, 0, SMDBXI_FL_SEEKEND)) < 0)
+		return -1;
+	if (jsize == psize)
+		return 0;
+	if (jsize > psize) {
+		/*
+		 * Large transactions grew the journal above its preallocated
+		 * size, get it back in line.
+		 */
+		if (SMDBXI_FL_TRUNCATE(jfctx->jfile, psize) < 0)
+			return -1;
+	} else {
+		/*
+		 * Fill the journal with real data (not holes), so that later
+		 * writes inside it do not need any file metadata update.
+		 */
+		if ((buf = smdb_zalloc(jfctx->mem, jfctx->blk_size)) == NULL)
+			return -1;
+		for (; jsize < psize; jsize += size) {
+			size = (int) (jfctx->blk_size - jsize % jfctx->blk_size);
+			if (SMDBXI_FL_WRITE(jfctx->jfile, buf, size) != size) {
+				SMDBXI_MM_FREE(jfctx->mem, buf);
+				return -1;
+			}
+		}
+		SMDBXI_MM_FREE(jfctx->mem, buf);
+	}
+
+	return SMDBXI_FL_SYNC(jfctx->jfile);
+}
+
+static int smdb_jf_reset_journal(struct smdb_jfile_ctx *jfctx)
+{
+	/*
+	 * Without preallocation the journal is dropped every time it gets
+	 * checkpointed. Otherwise it is kept around, and it is the new header
+	 * sequence number which invalidates the old commits inside it.
+	 */
+	if (jfctx->prealloc_blocks == 0 &&
+	    SMDBXI_FL_TRUNCATE(jfctx->jfile, 0) < 0)
+		return -1;
+	if (smdb_jf_write_header(jfctx) < 0 ||
+	    smdb_jf_sync_file(jfctx, jfctx->jfile) < 0)
+		return -1;
+	/*
+	 * The journal size is only touched once the new header is on disk,
+	 * so that the old commits cannot be partially dropped while still
+	 * valid.
+	 */
+	if (jfctx->prealloc_blocks > 0 && smdb_jf_size_journal(jfctx) < 0)
+		return -1;
+	jfctx->jend = jfctx->cend = smdb_jf_data_offset(jfctx);
+
+	return 0;
+}
+
+static int smdb_jf_group_full(struct smdb_jfile_ctx *jfctx)
+{
+	/*
+	 * Only the transactions left inside the group are counted, and a
+	 * group_max of 0 leaves their count to the flusher.
+	 */
+	if (jfctx->group_max > 0 && jfctx->sealed >= jfctx->group_max)
+		return 1;
+
+	return jfctx->group_blocks > 0 &&
+		(unsigned long) (jfctx->jend / jfctx->blk_size) >=
+		(unsigned long) (jfctx->cend / jfctx->blk_size) +
+		jfctx->group_blocks;
+}
+
+static int smdb_jf_valid_trailer(struct smdb_jfile_ctx *jfctx,
+				 smdb_offset_t toffset,
+				 struct smdb_jfile_trailer const *jft)
+{
+	return smdb_memcmp(jft->magic, SMDB_JFILE_MAGIC,
+			   sizeof(jft->magic)) == 0 &&
+		jft->crc == smdb_crc32c(0, jft, (unsigned long)
+					OFFSETOF(struct smdb_jfile_trailer, crc)) &&
+		jft->offset >= 0 && jft->offset <= toffset &&
+		(jft->offset % jfctx->blk_size) == 0 &&
+		jft->boffset >= 0 && jft->boffset <= jft->offset &&
+		(jft->boffset % jfctx->blk_size) == 0;
+}
+
+static int smdb_jf_valid_block(struct smdb_jfile_ctx *jfctx,
+			       struct smdb_jbhash_node const *bhn, void *buf)
+{
+	smdb_u32 size;
+
+	size = bhn->dsize != 0 ? bhn->dsize: jfctx->blk_size;
+	if (smdb_off_read(jfctx->jfile,
+			  (smdb_offset_t) bhn->joffset * jfctx->blk_size +
+			  (bhn->dsize != 0 ? bhn->doffset: 0),
+			  buf, (int) size) != (int) size)
+		return -1;
+
+	return smdb_crc32c(0, buf, size) == bhn->crc;
+}
+
+static int smdb_jf_load_table(struct smdb_jfile_ctx *jfctx,
+			      smdb_offset_t toffset,
+			      struct smdb_jfile_trailer const *jft, int verify,
+			      struct smdb_jbhash_node **ptbl,
+			      unsigned long *pcount)
+{
+	int size, valid;
+	unsigned long i, count, n;
+	struct smdb_jbhash_node *tbl;
+	void *blkbuf;
+
+	if (toffset - jft->offset > 0x7fffffff)
+		return -1;
+	/*
+	 * The padding at the end of the table might not be a multiple of
+	 * the entry size, but it is covered by the table checksum.
+	 */
+	size = (int) (toffset - jft->offset);
+	count = (unsigned long) size / sizeof(*tbl);
+	if (size == 0) {
+		*ptbl = NULL;
+		*pcount = 0;
+		return 1;
+	}
+	/*
+	 * Load the whole table with a single read, and check it against the
+	 * trailer checksum ...
+	 */
+	if ((tbl = (struct smdb_jbhash_node *)
+	     SMDBXI_MM_ALLOC(jfctx->mem, size)) == NULL)
+		return -1;
+	if (smdb_off_read(jfctx->jfile, jft->offset, tbl, size) != size) {
+		SMDBXI_MM_FREE(jfctx->mem, tbl);
+		return -1;
+	}
+	if (smdb_crc32c(0, tbl, (unsigned long) size) != jft->tcrc) {
+		SMDBXI_MM_FREE(jfctx->mem, tbl);
+		return 0;
+	}
+	/*
+	 * ... drop the padding entries, and make sure that all the blocks
+	 * referenced by a valid table come before it.
+	 */
+	for (i = n = 0; i < count; i++) {
+		if (tbl[i].offset == SMDB_NO_OFFSET)
+			continue;
+		if (tbl[i].joffset == SMDB_DEL_OFFSET ? tbl[i].dsize != 0:
+		    tbl[i].joffset == SMDB_ZERO_OFFSET ?
+		    (tbl[i].doffset == 0 || tbl[i].dsize != 0 ||
+		     tbl[i].offset + tbl[i].doffset < tbl[i].offset):
+		    ((smdb_offset_t) tbl[i].joffset + 1) * jfctx->blk_size >
+		    jft->offset ||
+		    (tbl[i].dsize != 0 &&
+		     (tbl[i].doffset + tbl[i].dsize > jfctx->blk_size ||
+		      tbl[i].dstart + tbl[i].dsize > jfctx->blk_size))) {
+			SMDBXI_MM_FREE(jfctx->mem, tbl);
+			return 0;
+		}
+		tbl[n++] = tbl[i];
+	}
+	/*
+	 * The blocks written by the last commit share its only sync, so they
+	 * might not have made it on disk together with the trailer. Blocks
+	 * of the previous commits cannot be touched by later ones.
+	 */
+	if (verify && n > 0) {
+		if ((blkbuf = SMDBXI_MM_ALLOC(jfctx->mem, jfctx->blk_size)) == NULL) {
+			SMDBXI_MM_FREE(jfctx->mem, tbl);
+			return -1;
+		}
+		for (i = 0, valid = 1; i < n && valid > 0; i++)
+			if (tbl[i].joffset != SMDB_ZERO_OFFSET &&
+			    tbl[i].joffset != SMDB_DEL_OFFSET &&
+			    (smdb_offset_t) tbl[i].joffset * jfctx->blk_size >=
+			    jft->boffset)
+				valid = smdb_jf_valid_block(jfctx, &tbl[i], blkbuf);
+		SMDBXI_MM_FREE(jfctx->mem, blkbuf);
+		if (valid <= 0) {
+			SMDBXI_MM_FREE(jfctx->mem, tbl);
+			return valid;
+		}
+	}
+	if (n == 0) {
+		SMDBXI_MM_FREE(jfctx->mem, tbl);
+		tbl = NULL;
+	}
+	*ptbl = tbl;
+	*pcount = n;
+
+	return 1;
+}
+
+static int smdb_jf_next_trailer(struct smdb_jfile_ctx *jfctx,
+				smdb_offset_t boffset, smdb_offset_t jsize,
+				char *buf, struct smdb_jfile_trailer *jft,
+				smdb_offset_t *ptoffset)
+{
+	int size, valid;
+	unsigned long i, n, count;
+	smdb_offset_t coffset, toffset;
+	struct smdb_jbhash_node *tbl;
+
+	/*
+	 * The trailer of the commit starting at boffset ends on one of the
+	 * following block boundaries. Read the journal in chunks, and look
+	 * at the tail of every block.
+	 */
+	for (coffset = boffset; coffset + jfctx->blk_size <= jsize;
+	     coffset += size) {
+		n = (unsigned long) ((jsize - coffset) / jfctx->blk_size);
+		if (n > SMDB_PLAY_MAXBLOCKS)
+			n = SMDB_PLAY_MAXBLOCKS;
+		size = (int) (n * jfctx->blk_size);
+		if (smdb_off_read(jfctx->jfile, coffset, buf, size) != size)
+			return -1;
+		for (i = 1; i <= n; i++) {
+			toffset = coffset + i * jfctx->blk_size - sizeof(*jft);
+			smdb_memcpy(jft, buf + i * jfctx->blk_size - sizeof(*jft),
+				    sizeof(*jft));
+			if (!smdb_jf_valid_trailer(jfctx, toffset, jft) ||
+			    jft->seq != jfctx->seq || jft->boffset != boffset)
+				continue;
+			if ((valid = smdb_jf_load_table(jfctx, toffset, jft, 0,
+							&tbl, &count)) < 0)
+				return -1;
+			if (valid) {
+				if (tbl != NULL)
+					SMDBXI_MM_FREE(jfctx->mem, tbl);
+				*ptoffset = toffset;
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int smdb_jf_read_table(struct smdb_jfile_ctx *jfctx,
+			      smdb_offset_t toffset, int verify,
+			      struct smdb_jbhash_node **ptbl,
+			      unsigned long *pcount)
+{
+	struct smdb_jfile_trailer jft;
+
+	if (smdb_off_read(jfctx->jfile, toffset, &jft,
+			  sizeof(jft)) != sizeof(jft))
+		return -1;
+
+	return smdb_jf_load_table(jfctx, toffset, &jft, verify, ptbl, pcount);
+}
+
+static int smdb_jf_merge_table(struct smdb_jfile_ctx *jfctx,
+			       struct smdb_jbhash_node const *tbl,
+			       unsigned long count)
+{
+	unsigned long i, j;
+	struct smdb_jbhash_node *bhn;
+
+	/*
+	 * The zero extents and the dropped mappings of a commit go first,
+	 * since the blocks it maps have all been written after them.
+	 */
+	for (i = 0; i < count; i++) {
+		if (tbl[i].joffset == SMDB_ZERO_OFFSET) {
+			smdb_jf_finish_rehash(jfctx);
+			for (j = 0, bhn = jfctx->bhash; j <= jfctx->bhmask;
+			     j++, bhn++) {
+				if (bhn->joffset == SMDB_NO_OFFSET ||
+				    bhn->offset == SMDB_NO_OFFSET ||
+				    bhn->offset - tbl[i].offset >= tbl[i].doffset)
+					continue;
+				bhn->offset = SMDB_NO_OFFSET;
+				bhn->joffset = SMDB_DEL_OFFSET;
+				jfctx->bcount--;
+			}
+			if (smdb_jf_add_zext(jfctx, tbl[i].offset,
+					     tbl[i].doffset) < 0)
+				return -1;
+		} else if (tbl[i].joffset == SMDB_DEL_OFFSET &&
+			   (bhn = smdb_jf_find_node(jfctx,
+						    tbl[i].offset)) != NULL) {
+			bhn->offset = SMDB_NO_OFFSET;
+			bhn->joffset = SMDB_DEL_OFFSET;
+			jfctx->bcount--;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if (tbl[i].joffset == SMDB_ZERO_OFFSET ||
+		    tbl[i].joffset == SMDB_DEL_OFFSET)
+			continue;
+		if ((bhn = smdb_jf_find_node(jfctx, tbl[i].offset)) == NULL &&
+		    smdb_jf_alloc_node(jfctx, tbl[i].offset, &bhn) < 0)
+			return -1;
+		*bhn = tbl[i];
+	}
+
+	return 0;
+}
+
+static int smdb_jf_load_chain(struct smdb_jfile_ctx *jfctx)
+{
+	int error, valid;
+	unsigned long i, j, found, tsize, count, lcount;
+	smdb_offset_t jsize, boffset, toffset;
+	smdb_offset_t *toffs, *ntoffs;
+	char *buf;
+	struct smdb_jfile_trailer jft;
+	struct smdb_jbhash_node *tbl, *ltbl;
+
+	if (smdb_jf_read_header(jfctx) <= 0 ||
+	    (jsize = SMDBXI_FL_SEEK(jfctx->jfile, 0, SMDBXI_FL_SEEKEND)) < 0)
+		return 0;
+	if ((buf = (char *) SMDBXI_MM_ALLOC(jfctx->mem, SMDB_PLAY_MAXBLOCKS *
+					    jfctx->blk_size)) == NULL)
+		return -1;
+
+	/*
+	 * Commits after the last checkpoint follow each other inside the
+	 * journal, starting right after the header, and carry consecutive
+	 * sequence numbers starting from the header one. Stale commits left
+	 * around by older checkpoints, or by a rollback, do not fit the chain.
+	 * Every commit of the chain contributes its table to the block map.
+	 */
+	for (found = tsize = 0, toffs = NULL,
+		     boffset = smdb_jf_data_offset(jfctx);; found++) {
+		if ((error = smdb_jf_next_trailer(jfctx, boffset, jsize, buf, &jft,
+						  &toffset)) <= 0)
+			break;
+		if (found == tsize) {
+			tsize = 2 * tsize + 16;
+			if ((ntoffs = (smdb_offset_t *)
+			     SMDBXI_MM_ALLOC(jfctx->mem, tsize *
+					     sizeof(smdb_offset_t))) == NULL) {
+				error = -1;
+				break;
+			}
+			if (found > 0)
+				smdb_memcpy(ntoffs, toffs, found *
+					    sizeof(smdb_offset_t));
+			SMDBXI_MM_FREE(jfctx->mem, toffs);
+			toffs = ntoffs;
+		}
+		toffs[found] = toffset;
+		boffset = toffset + sizeof(jft);
+		jfctx->seq++;
+	}
+	SMDBXI_MM_FREE(jfctx->mem, buf);
+	if (error < 0) {
+		SMDBXI_MM_FREE(jfctx->mem, toffs);
+		return -1;
+	}
+
+	/*
+	 * The blocks written by the last commit share its only sync, so they
+	 * might not have made it on disk together with the trailer. In such
+	 * case fall back to the previous commit, which was complete before
+	 * the last one started.
+	 */
+	for (i = 0, valid = 0; valid == 0 && i < 2 && i < found; i++)
+		valid = smdb_jf_read_table(jfctx, toffs[found - 1 - i], 1,
+					   &ltbl, &lcount);
+	/*
+	 * Then merge the tables up to the last complete commit, in commit
+	 * order. Their checksums have been verified by the chain walk.
+	 */
+	for (j = 0; valid > 0 && j < found - i; j++) {
+		if (smdb_jf_read_table(jfctx, toffs[j], 0, &tbl, &count) <= 0)
+			valid = -1;
+		else {
+			if (smdb_jf_merge_table(jfctx, tbl, count) < 0)
+				valid = -1;
+			SMDBXI_MM_FREE(jfctx->mem, tbl);
+		}
+	}
+	if (valid > 0) {
+		if (smdb_jf_merge_table(jfctx, ltbl, lcount) < 0)
+			valid = -1;
+		SMDBXI_MM_FREE(jfctx->mem, ltbl);
+	}
+	SMDBXI_MM_FREE(jfctx->mem, toffs);
+
+	return valid;
+}
+
+static int smdb_jf_build_table(struct smdb_jfile_ctx *jfctx,
+			       struct smdb_jbhash_node **ptbl,
+			       unsigned long *pcount)
+{
+	unsigned long i, n;
+	struct smdb_jbhash_node *tbl, *bhash;
+
+	/*
+	 * The blocks to play are the ones mapped by the block map, together
+	 * with the zero extents.
+	 */
+	smdb_jf_finish_rehash(jfctx);
+	for (i = 0, n = jfctx->zcount, bhash = jfctx->bhash;
+	     i <= jfctx->bhmask; i++)
+		if (bhash[i].joffset != SMDB_NO_OFFSET &&
+		    bhash[i].offset != SMDB_NO_OFFSET &&
+		    bhash[i].joffset != SMDB_FRESH_OFFSET)
+			n++;
+	*ptbl = NULL;
+	*pcount = n;
+	if (n == 0)
+		return 0;
+	if ((tbl = (struct smdb_jbhash_node *)
+	     SMDBXI_MM_ALLOC(jfctx->mem, n *
+			     sizeof(struct smdb_jbhash_node))) == NULL)
+		return -1;
+	for (i = 0, n = 0; i <= jfctx->bhmask; i++)
+		if (bhash[i].joffset != SMDB_NO_OFFSET &&
+		    bhash[i].offset != SMDB_NO_OFFSET &&
+		    bhash[i].joffset != SMDB_FRESH_OFFSET)
+			tbl[n++] = bhash[i];
+	if (jfctx->zcount > 0)
+		smdb_memcpy(tbl + n, jfctx->zext, jfctx->zcount *
+			    sizeof(struct smdb_jbhash_node));
+	*ptbl = tbl;
+
+	return 0;
+}
+
+static void smdb_jf_sift_down(struct smdb_jbhash_node *tbl, unsigned long i,
+			      unsigned long n)
+{
+	unsigned long c;
+	struct smdb_jbhash_node tmp;
+
+	for (; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && tbl[c + 1].offset > tbl[c].offset)
+			c++;
+		if (tbl[i].offset >= tbl[c].offset)
+			break;
+		tmp = tbl[i];
+		tbl[i] = tbl[c];
+		tbl[c] = tmp;
+	}
+}
+
+static void smdb_jf_sort_table(struct smdb_jbhash_node *tbl, unsigned long n)
+{
+	unsigned long i;
+	struct smdb_jbhash_node tmp;
+
+	/*
+	 * Heap sort the table by DB file offset. No recursion, and no
+	 * extra memory needed.
+	 */
+	for (i = n / 2; i > 0; i--)
+		smdb_jf_sift_down(tbl, i - 1, n);
+	for (i = n; i > 1; i--) {
+		tmp = tbl[0];
+		tbl[0] = tbl[i - 1];
+		tbl[i - 1] = tmp;
+		smdb_jf_sift_down(tbl, 0, i - 1);
+	}
+}
+
+static int smdb_jf_play_run(struct smdb_jfile_ctx *jfctx,
+			    struct smdb_jbhash_node const *tbl,
+			    unsigned long n, int verify, char *buf)
+{
+	int size;
+	unsigned long i, j;
+
+	/*
+	 * Gather the run blocks from the journal file, reading together the
+	 * ones which happen to be contiguous inside the journal too ...
+	 */
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && tbl[j].joffset == tbl[j - 1].joffset + 1;
+		     j++)
+			;
+		size = (int) ((j - i) * jfctx->blk_size);
+		if (smdb_off_read(jfctx->jfile,
+				  (smdb_offset_t) tbl[i].joffset * jfctx->blk_size,
+				  buf + i * jfctx->blk_size, size) != size)
 			return -1;
 	}
 	/*
-	 * Sync all blocks before (write barrier) ...
+	 * When recovering, a block not matching its checksum means that the
+	 * journal got corrupted after having been committed.
 	 */
-	if (SMDBXI_FL_SYNC(jfctx->jfile) < 0)
-		return -1;
-
+	for (i = 0; verify && i < n; i++)
+		if (smdb_crc32c(0, buf + i * jfctx->blk_size,
+				jfctx->blk_size) != tbl[i].crc)
+			return -1;
 	/*
-	 * Then write trailer and sync again.  We do this since we do not
-	 * want that a re-ordering on the block I/O layer make the trailer
-	 * visible while the referenced block are still not on disk.
+	 * ... and write them with a single write to the underlying DB file.
 	 */
-	MZERO(jft);
-	smdb_memcpy(jft.magic, SMDB_JFILE_MAGIC, sizeof(jft.magic));
-	jft.offset = offset;
-	if (SMDBXI_FL_WRITE(jfctx->jfile, &jft, sizeof(jft)) != sizeof(jft) ||
-	    SMDBXI_FL_SYNC(jfctx->jfile) < 0)
+	size = (int) (n * jfctx->blk_size);
+	if (smdb_off_write(jfctx->bfile,
+			   (smdb_offset_t) tbl[0].offset * jfctx->blk_size,
+			   buf, size) != size)
 		return -1;
 
-	smdb_jf_reset_blkhash(jfctx);
-
 	return 0;
 }
 
-static int smdb_jf_truncate_journal(struct smdb_jfile_ctx *jfctx)
+static int smdb_jf_play_delta(struct smdb_jfile_ctx *jfctx,
+			      struct smdb_jbhash_node const *bhn, int verify,
+			      char *buf)
 {
-	SMDBXI_FL_SEEK(jfctx->jfile, 0, SMDBXI_FL_SEEKSET);
-	if (SMDBXI_FL_TRUNCATE(jfctx->jfile, 0) < 0 ||
-	    SMDBXI_FL_SYNC(jfctx->jfile) < 0)
+	/*
+	 * Deltas get written straight over their DB file block.
+	 */
+	if (smdb_off_read(jfctx->jfile,
+			  (smdb_offset_t) bhn->joffset * jfctx->blk_size +
+			  bhn->doffset, buf, (int) bhn->dsize) != (int) bhn->dsize ||
+	    (verify && smdb_crc32c(0, buf, bhn->dsize) != bhn->crc) ||
+	    smdb_off_write(jfctx->bfile,
+			   (smdb_offset_t) bhn->offset * jfctx->blk_size +
+			   bhn->dstart, buf, (int) bhn->dsize) != (int) bhn->dsize)
 		return -1;
 
 	return 0;
@@ -315,80 +1551,150 @@ static int smdb_jf_truncate_journal(struct smdb_jfile_ctx *jfctx)
 
 static int smdb_jf_play_journal(struct smdb_jfile_ctx *jfctx)
 {
-	smdb_offset_t toffset, foffset, offset, joffset;
-	void *blkbuf;
-	struct smdb_jfile_trailer jft;
-	struct smdb_jbhash_node bhn;
+	int error, verify;
+	unsigned long i, j, count;
+	char *blkbuf = NULL;
+	struct smdb_jbhash_node *tbl;
 
 	/*
-	 * Check to see if the journal file trailer is there and is valid.
+	 * The block map of this context already holds what it committed.
+	 * A recovery rebuilds it from the trailers found inside the journal,
+	 * and needs to verify the blocks, which this context has checksummed
+	 * on their way to the journal.
 	 */
-	if ((toffset = SMDBXI_FL_SEEK(jfctx->jfile,
-				      - (long) sizeof(struct smdb_jfile_trailer),
-				      SMDBXI_FL_SEEKEND)) < 0 ||
-	    SMDBXI_FL_READ(jfctx->jfile, &jft, sizeof(jft)) != sizeof(jft) ||
-	    smdb_memcmp(jft.magic, SMDB_JFILE_MAGIC, sizeof(jft.magic)) != 0) {
+	verify = jfctx->committed == 0;
+	if (verify && (error = smdb_jf_load_chain(jfctx)) <= 0) {
 		/*
 		 * If we are dealing with a broken journal, just nuke it and
 		 * forget it.
 		 */
-		return smdb_jf_truncate_journal(jfctx);
+		return error < 0 ? -1: smdb_jf_reset_journal(jfctx);
+	}
+	if (smdb_jf_build_table(jfctx, &tbl, &count) < 0)
+		return -1;
+	if (verify) {
+		smdb_jf_reset_blkhash(jfctx);
+		jfctx->zcount = 0;
 	}
-	if ((blkbuf = SMDBXI_MM_ALLOC(jfctx->mem, jfctx->blk_size)) == NULL)
+	if (count > 0 &&
+	    (blkbuf = (char *) SMDBXI_MM_ALLOC(jfctx->mem, SMDB_PLAY_MAXBLOCKS *
+					       jfctx->blk_size)) == NULL) {
+		SMDBXI_MM_FREE(jfctx->mem, tbl);
 		return -1;
+	}
 
 	/*
-	 * Go through every table entry, and apply the cached blocks into
-	 * the DB file.
+	 * Zero extents go first, since the blocks mapped inside them have
+	 * all been written after they were logged.
 	 */
-	for (foffset = jft.offset; foffset < toffset; foffset += sizeof(bhn)) {
-		/*
-		 * Seek and read table entry.
-		 */
-		if (smdb_off_read(jfctx->jfile, foffset, &bhn,
-				  sizeof(bhn)) != sizeof(bhn)) {
-			SMDBXI_MM_FREE(jfctx->mem, blkbuf);
-			return -1;
-		}
-
-		offset = (smdb_offset_t) bhn.offset * jfctx->blk_size;
-		joffset = (smdb_offset_t) bhn.joffset * jfctx->blk_size;
-
-		/*
-		 * Read block from journal file ...
-		 */
-		if (smdb_off_read(jfctx->jfile, joffset, blkbuf,
-				  jfctx->blk_size) != (int) jfctx->blk_size) {
+	smdb_jf_sort_table(tbl, count);
+	for (i = 0; i < count; i++) {
+		if (tbl[i].joffset != SMDB_ZERO_OFFSET)
+			continue;
+		if (smdb_off_zero(jfctx->bfile,
+				  (smdb_offset_t) tbl[i].offset * jfctx->blk_size,
+				  (smdb_offset_t) tbl[i].doffset * jfctx->blk_size,
+				  jfctx->mem, jfctx->blk_size) < 0) {
 			SMDBXI_MM_FREE(jfctx->mem, blkbuf);
+			SMDBXI_MM_FREE(jfctx->mem, tbl);
 			return -1;
 		}
-		/*
-		 * ... and write it to the underlying DB file.
-		 */
-		if (smdb_off_write(jfctx->bfile, offset, blkbuf,
-				   jfctx->blk_size) != (int) jfctx->blk_size) {
+	}
+	/*
+	 * Apply the journal blocks to the DB file in offset order, merging
+	 * the ones landing on contiguous DB blocks into a single write.
+	 */
+	for (i = 0; i < count; i = j) {
+		for (j = i + 1; j < count && j - i < SMDB_PLAY_MAXBLOCKS &&
+			     tbl[i].dsize == 0 && tbl[j].dsize == 0 &&
+			     tbl[i].joffset != SMDB_ZERO_OFFSET &&
+			     tbl[j].joffset != SMDB_ZERO_OFFSET &&
+			     tbl[j].offset == tbl[j - 1].offset + 1; j++)
+			;
+		if (tbl[i].joffset == SMDB_ZERO_OFFSET)
+			error = 0;
+		else if (tbl[i].dsize != 0)
+			error = smdb_jf_play_delta(jfctx, tbl + i, verify, blkbuf);
+		else
+			error = smdb_jf_play_run(jfctx, tbl + i, j - i, verify,
+						 blkbuf);
+		if (error < 0) {
 			SMDBXI_MM_FREE(jfctx->mem, blkbuf);
+			SMDBXI_MM_FREE(jfctx->mem, tbl);
 			return -1;
 		}
+		if (jfctx->play_cb != NULL)
+			(*jfctx->play_cb)(jfctx->play_priv, j, count);
+	}
+	if (count > 0) {
+		SMDBXI_MM_FREE(jfctx->mem, blkbuf);
+		SMDBXI_MM_FREE(jfctx->mem, tbl);
 	}
-	SMDBXI_MM_FREE(jfctx->mem, blkbuf);
 
 	/*
 	 * Be sure that the underlying file content hit the disk, before going
 	 * ahead and nuke the journal file.
 	 */
-	if (SMDBXI_FL_SYNC(jfctx->bfile) < 0)
+	if (smdb_jf_sync_file(jfctx, jfctx->bfile) < 0)
 		return -1;
 
 	/*
-	 * Now truncate and sync the journal file.
+	 * Now reset and sync the journal file.
 	 */
-	if (smdb_jf_truncate_journal(jfctx) < 0)
+	if (smdb_jf_reset_journal(jfctx) < 0)
 		return -1;
 
 	return 1;
 }
 
+static int smdb_jf_mapped(struct smdb_jfile_ctx *jfctx)
+{
+	/*
+	 * The journal view of the file is active within a transaction, and
+	 * as long as sealed or committed transactions have blocks living
+	 * inside the journal.
+	 */
+	return jfctx->enabled || jfctx->sealed > 0 || jfctx->committed > 0;
+}
+
+static int smdb_jf_commit_group(struct smdb_jfile_ctx *jfctx)
+{
+	/*
+	 * A failed commit might have lost pages of the journal images which
+	 * the next trailer would reference again, so nothing more is
+	 * committed until the DB is opened again, and the recovery finds
+	 * the last commit which made it on disk.
+	 */
+	if (jfctx->failed)
+		return -1;
+	if (jfctx->sealed > 0) {
+		/*
+		 * Fresh blocks written straight into the DB file must be on
+		 * disk before the commit which makes them reachable.
+		 */
+		if (jfctx->bdirty) {
+			if (smdb_jf_sync_file(jfctx, jfctx->bfile) < 0) {
+				jfctx->failed = 1;
+				return -1;
+			}
+			jfctx->bdirty = 0;
+		}
+		if (smdb_jf_finish_journal(jfctx) < 0) {
+			jfctx->failed = 1;
+			return -1;
+		}
+		jfctx->committed += jfctx->sealed;
+		jfctx->sealed = 0;
+		jfctx->cend = jfctx->jend;
+		jfctx->dseq = jfctx->tseq;
+		jfctx->ptimed = 0;
+		if (jfctx->durable_cb != NULL)
+			(*jfctx->durable_cb)(jfctx->durable_priv, jfctx->dseq);
+	}
+
+	return 0;
+}
+
 static int smdb_jf_open_journal(struct smdb_jfile_ctx *jfctx)
 {
 	if ((jfctx->jfpath =
@@ -397,14 +1703,15 @@ static int smdb_jf_open_journal(struct smdb_jfile_ctx *jfctx)
 		return -1;
 
 	if ((jfctx->jfile = SMDBXI_FS_OPEN(jfctx->fs, jfctx->jfpath,
-					   SMDBXI_FL_RWOPEN)) == NULL) {
-		if ((jfctx->jfile = SMDBXI_FS_OPEN(jfctx->fs, jfctx->jfpath,
-						   SMDBXI_FL_CREATENEW)) == NULL)
-			return -1;
-	} else {
-		if (smdb_jf_play_journal(jfctx) < 0)
-			return -1;
-	}
+					   SMDBXI_FL_RWOPEN)) == NULL &&
+	    (jfctx->jfile = SMDBXI_FS_OPEN(jfctx->fs, jfctx->jfpath,
+					   SMDBXI_FL_CREATENEW)) == NULL)
+		return -1;
+	/*
+	 * Recover an existing journal, or setup a new one.
+	 */
+	if (smdb_jf_play_journal(jfctx) < 0)
+		return -1;
 
 	return 0;
 }
@@ -432,9 +1739,11 @@ static smdb_offset_t smdb_jf_file__seek(void *priv, smdb_offset_t off, int whenc
 	struct smdb_jfile_ctx *jfctx = (struct smdb_jfile_ctx *) priv;
 
 	/*
-	 * Go directly on file if journal is not enabled.
+	 * Go directly on file if journal is not enabled, and there are no
+	 * sealed or committed transactions whose blocks still live inside
+	 * the journal.
 	 */
-	if (!jfctx->enabled)
+	if (!smdb_jf_mapped(jfctx))
 		return SMDBXI_FL_SEEK(jfctx->bfile, off, whence);
 
 	switch (whence) {
@@ -463,12 +1772,13 @@ static int smdb_jf_file__read(void *priv, void *buf, int n)
 {
 	struct smdb_jfile_ctx *jfctx = (struct smdb_jfile_ctx *) priv;
 	int count;
-	smdb_offset_t joffset;
 
 	/*
-	 * Go directly on file if journal is not enabled.
+	 * Go directly on file if journal is not enabled, and there are no
+	 * sealed or committed transactions whose blocks still live inside
+	 * the journal.
 	 */
-	if (!jfctx->enabled)
+	if (!smdb_jf_mapped(jfctx))
 		return SMDBXI_FL_READ(jfctx->bfile, buf, n);
 
 	if (jfctx->offset >= jfctx->fsize)
@@ -487,17 +1797,9 @@ static int smdb_jf_file__read(void *priv, void *buf, int n)
 
 	for (count = 0; count < n;
 	     count += jfctx->blk_size, jfctx->offset += jfctx->blk_size) {
-		if (smdb_jf_fetch_block(jfctx, jfctx->offset, &joffset) > 0) {
-			if (smdb_off_read(jfctx->jfile, joffset,
-					  (char *) buf + count,
-					  jfctx->blk_size) != (int) jfctx->blk_size)
-				break;
-		} else {
-			if (smdb_off_read(jfctx->bfile, jfctx->offset,
-					  (char *) buf + count,
-					  jfctx->blk_size) != (int) jfctx->blk_size)
-				break;
-		}
+		if (smdb_jf_read_block(jfctx, jfctx->offset,
+				       (char *) buf + count) < 0)
+			break;
 	}
 
 	return count;
@@ -507,13 +1809,26 @@ static int smdb_jf_file__write(void *priv, void const *buf, int n)
 {
 	struct smdb_jfile_ctx *jfctx = (struct smdb_jfile_ctx *) priv;
 	int count;
-	smdb_offset_t joffset;
+	struct smdb_jbhash_node *bhn;
 
 	/*
-	 * Go directly on file if journal is not enabled.
+	 * Go directly on file if journal is not enabled. Writes done outside
+	 * of a transaction must not be overwritten by a later play of the
+	 * journal, so the journal needs to be checkpointed first. Nothing
+	 * goes to the DB file after a failure, since the layers above might
+	 * hold content which never made it into a commit.
 	 */
-	if (!jfctx->enabled)
+	if (!jfctx->enabled) {
+		if (jfctx->failed)
+			return -1;
+		if (smdb_jf_mapped(jfctx)) {
+			if (smdb_jf_checkpoint(jfctx) < 0 ||
+			    SMDBXI_FL_SEEK(jfctx->bfile, jfctx->offset,
+					   SMDBXI_FL_SEEKSET) != jfctx->offset)
+				return -1;
+		}
 		return SMDBXI_FL_WRITE(jfctx->bfile, buf, n);
+	}
 
 	/*
 	 * The upper layer is supposed to be a block layer, which
@@ -525,10 +1840,30 @@ static int smdb_jf_file__write(void *priv, void const *buf, int n)
 
 	for (count = 0; count < n;
 	     count += jfctx->blk_size, jfctx->offset += jfctx->blk_size) {
-		if (smdb_jf_want_block(jfctx, jfctx->offset, &joffset) < 0 ||
-		    smdb_off_write(jfctx->jfile, joffset, (char const *) buf + count,
-				   jfctx->blk_size) != (int) jfctx->blk_size)
+		if (smdb_jf_want_block(jfctx, jfctx->offset, &bhn) < 0)
 			break;
+		if (bhn->joffset == SMDB_FRESH_OFFSET) {
+			/*
+			 * Fresh blocks have no committed content to protect,
+			 * and go straight into the DB file.
+			 */
+			if (smdb_off_write(jfctx->bfile, jfctx->offset,
+					   (char const *) buf + count,
+					   jfctx->blk_size) != (int) jfctx->blk_size)
+				break;
+			jfctx->bdirty = 1;
+		} else {
+			if (smdb_jf_write_image(jfctx, bhn->joffset,
+						(char const *) buf + count) < 0)
+				break;
+			/*
+			 * The block checksum goes into the table, and lets the
+			 * replay detect block images which did not make it on
+			 * disk.
+			 */
+			bhn->crc = smdb_crc32c(0, (char const *) buf + count,
+					       jfctx->blk_size);
+		}
 		jfctx->active = 1;
 	}
 	if (jfctx->offset > jfctx->fsize)
@@ -537,6 +1872,61 @@ static int smdb_jf_file__write(void *priv, void const *buf, int n)
 	return count;
 }
 
+static int smdb_jf_file__write_range(void *priv, void const *buf, int n,
+				     int off, int size)
+{
+	struct smdb_jfile_ctx *jfctx = (struct smdb_jfile_ctx *) priv;
+	int error;
+
+	/*
+	 * Only single blocks written within a transaction can be logged as
+	 * deltas, everything else goes through the full block path.
+	 */
+	if (!jfctx->enabled || n != (int) jfctx->blk_size ||
+	    (jfctx->offset % jfctx->blk_size) != 0 || off < 0 || size < 0 ||
+	    off + size > n)
+		return smdb_jf_file__write(priv, buf, n);
+	if ((error = smdb_jf_write_delta(jfctx, (char const *) buf,
+					 (smdb_u32) off, (smdb_u32) size)) < 0)
+		return -1;
+
+	return error > 0 ? n: smdb_jf_file__write(priv, buf, n);
+}
+
+static int smdb_jf_file__zero(void *priv, smdb_offset_t off, smdb_offset_t size)
+{
+	struct smdb_jfile_ctx *jfctx = (struct smdb_jfile_ctx *) priv;
+
+	/*
+	 * Go directly on file if journal is not enabled, after checkpointing
+	 * the journal like a write would.
+	 */
+	if (!jfctx->enabled) {
+		if (jfctx->failed ||
+		    (smdb_jf_mapped(jfctx) && smdb_jf_checkpoint(jfctx) < 0))
+			return -1;
+		return smdb_off_zero(jfctx->bfile, off, size, jfctx->mem,
+				     jfctx->blk_size);
+	}
+
+	/*
+	 * The upper layer is supposed to be a block layer, which zeroes
+	 * whole blocks.
+	 */
+	if (off < 0 || size < 0 || (off % jfctx->blk_size) != 0 ||
+	    (size % jfctx->blk_size) != 0)
+		return -1;
+	if (size == 0)
+		return 0;
+	if (smdb_jf_zero_blocks(jfctx, (smdb_u32) (off / jfctx->blk_size),
+				(smdb_u32) (size / jfctx->blk_size)) < 0)
+		return -1;
+	if (off + size > jfctx->fsize)
+		jfctx->fsize = off + size;
+
+	return 0;
+}
+
 static int smdb_jf_file__truncate(void *priv, smdb_offset_t size)
 {
 	struct smdb_jfile_ctx *jfctx = (struct smdb_jfile_ctx *) priv;
@@ -544,8 +1934,12 @@ static int smdb_jf_file__truncate(void *priv, smdb_offset_t size)
 	/*
 	 * Go directly on file if journal is not enabled.
 	 */
-	if (!jfctx->enabled)
+	if (!jfctx->enabled) {
+		if (jfctx->failed ||
+		    (smdb_jf_mapped(jfctx) && smdb_jf_checkpoint(jfctx) < 0))
+			return -1;
 		return SMDBXI_FL_TRUNCATE(jfctx->bfile, size);
+	}
 
 	/*
 	 * The upper layer is supposed to be a block layer, which
@@ -561,6 +1955,8 @@ static int smdb_jf_file__truncate(void *priv, smdb_offset_t size)
 		return -1;
 
 	jfctx->fsize = size;
+	if (jfctx->dlimit > size)
+		jfctx->dlimit = size;
 
 	return 0;
 }
@@ -569,7 +1965,41 @@ static int smdb_jf_file__sync(void *priv)
 {
 	struct smdb_jfile_ctx *jfctx = (struct smdb_jfile_ctx *) priv;
 
-	return jfctx->enabled ? 0: SMDBXI_FL_SYNC(jfctx->bfile);
+	if (jfctx->enabled)
+		return 0;
+	/*
+	 * A sync outside of a transaction forces the pending commit group
+	 * on disk.
+	 */
+	if (jfctx->sealed > 0 && smdb_jf_flush(jfctx) < 0)
+		return -1;
+
+	return SMDBXI_FL_SYNC(jfctx->bfile);
+}
+
+static int smdb_jf_file__datasync(void *priv)
+{
+	struct smdb_jfile_ctx *jfctx = (struct smdb_jfile_ctx *) priv;
+
+	if (jfctx->enabled)
+		return 0;
+	if (jfctx->sealed > 0 && smdb_jf_flush(jfctx) < 0)
+		return -1;
+
+	return SMDBXI_FL_DATASYNC(jfctx->bfile);
+}
+
+static int smdb_jf_file__readahead(void *priv, smdb_offset_t offset,
+				   smdb_offset_t size)
+{
+	struct smdb_jfile_ctx *jfctx = (struct smdb_jfile_ctx *) priv;
+
+	/*
+	 * Blocks still living inside the journal are the recently written
+	 * ones, which are most likely in memory already, so the hint only
+	 * goes to the DB file.
+	 */
+	return SMDBXI_FL_READAHEAD(jfctx->bfile, offset, size);
 }
 
 static char const *smdb_jf_file__path(void *priv)
@@ -579,8 +2009,29 @@ static char const *smdb_jf_file__path(void *priv)
 	return SMDBXI_FL_PATH(jfctx->bfile);
 }
 
+static void smdb_jf_drop_fresh(struct smdb_jfile_ctx *jfctx)
+{
+	unsigned long i;
+	struct smdb_jbhash_node *bhn;
+
+	/*
+	 * Once the transaction is over, the fresh blocks are live ones like
+	 * any other, whose content is inside the DB file.
+	 */
+	for (i = 0; i < jfctx->frcount; i++) {
+		if ((bhn = smdb_jf_find_node(jfctx, jfctx->fresh[i])) == NULL ||
+		    bhn->joffset != SMDB_FRESH_OFFSET)
+			continue;
+		bhn->offset = SMDB_NO_OFFSET;
+		bhn->joffset = SMDB_DEL_OFFSET;
+		jfctx->bcount--;
+	}
+	jfctx->frcount = 0;
+}
+
 int smdb_jf_create(struct smdbxi_factory *fac, struct smdbxi_file *bfile,
-		   unsigned int blk_size, struct smdb_jfile_ctx **pjfctx)
+		   struct smdb_jf_config const *jcfg,
+		   struct smdb_jfile_ctx **pjfctx)
 {
 	struct smdbxi_mem *mem;
 	struct smdbxi_fs *fs;
@@ -595,10 +2046,25 @@ int smdb_jf_create(struct smdbxi_factory *fac, struct smdbxi_file *bfile,
 		return -1;
 	}
 	SMDBXI_GET(bfile);
+	SMDBXI_GET(fac);
+	jfctx->fac = fac;
 	jfctx->mem = mem;
 	jfctx->fs = fs;
 	jfctx->bfile = bfile;
-	jfctx->blk_size = blk_size;
+	jfctx->blk_size = jcfg->blk_size;
+	jfctx->group_max = jcfg->group_max;
+	jfctx->group_blocks = jcfg->group_blocks;
+	jfctx->ckpt_blocks = jcfg->ckpt_blocks;
+	jfctx->prealloc_blocks = jcfg->prealloc_blocks;
+	jfctx->append_blocks = jcfg->append_blocks;
+	jfctx->play_cb = jcfg->play_cb;
+	jfctx->play_priv = jcfg->play_priv;
+	jfctx->durable_cb = jcfg->durable_cb;
+	jfctx->durable_priv = jcfg->durable_priv;
+	jfctx->durability = jcfg->durability != SMDB_DUR_DEFAULT ?
+		jcfg->durability: SMDB_DUR_FULL;
+	jfctx->sync_ms = jcfg->sync_ms > 0 ? jcfg->sync_ms: SMDB_SYNC_MS;
+	jfctx->glevel = SMDB_DUR_NONE;
 
 	jfctx->file_ifc.priv = jfctx;
 	jfctx->file_ifc.get = smdb_jf_file__get;
@@ -609,7 +2075,15 @@ int smdb_jf_create(struct smdbxi_factory *fac, struct smdbxi_file *bfile,
 	jfctx->file_ifc.truncate = smdb_jf_file__truncate;
 	jfctx->file_ifc.sync = smdb_jf_file__sync;
 	jfctx->file_ifc.path = smdb_jf_file__path;
+	jfctx->file_ifc.write_range = smdb_jf_file__write_range;
+	jfctx->file_ifc.zero = smdb_jf_file__zero;
+	jfctx->file_ifc.datasync = smdb_jf_file__datasync;
+	jfctx->file_ifc.readahead = smdb_jf_file__readahead;
 	if (smdb_jf_alloc_blkhash(jfctx) < 0 ||
+	    (jfctx->append_blocks > 0 &&
+	     (jfctx->abuf = (char *)
+	      SMDBXI_MM_ALLOC(mem, jfctx->append_blocks *
+			      jfctx->blk_size)) == NULL) ||
 	    smdb_jf_open_journal(jfctx) < 0) {
 		smdb_jf_free(jfctx);
 		return -1;
@@ -625,14 +2099,38 @@ void smdb_jf_free(struct smdb_jfile_ctx *jfctx)
 	if (jfctx != NULL) {
 		struct smdbxi_mem *mem = jfctx->mem;
 
+		/*
+		 * An open transaction is dropped, but the sealed ones of the
+		 * current commit group need to make it on disk, and all of them
+		 * need to land inside the DB file before the journal goes away.
+		 */
+		if (jfctx->jfile != NULL && !jfctx->failed &&
+		    (jfctx->sealed > 0 || jfctx->committed > 0)) {
+			if (jfctx->enabled)
+				smdb_jf_rollback(jfctx);
+			smdb_jf_checkpoint(jfctx);
+		}
 		SMDBXI_RELEASE(jfctx->jfile);
 		if (jfctx->jfpath != NULL) {
-			SMDBXI_FS_REMOVE(jfctx->fs, jfctx->jfpath);
+			/*
+			 * A preallocated journal is kept around for the next
+			 * open of the DB, and so is the one of a failed commit,
+			 * which the recovery needs.
+			 */
+			if (jfctx->prealloc_blocks == 0 && !jfctx->failed)
+				SMDBXI_FS_REMOVE(jfctx->fs, jfctx->jfpath);
 			SMDBXI_MM_FREE(mem, jfctx->jfpath);
 		}
 		SMDBXI_RELEASE(jfctx->bfile);
 		SMDBXI_RELEASE(jfctx->fs);
+		SMDBXI_RELEASE(jfctx->fac);
 		SMDBXI_MM_FREE(mem, jfctx->bhash);
+		SMDBXI_MM_FREE(mem, jfctx->obhash);
+		SMDBXI_MM_FREE(mem, jfctx->undo);
+		SMDBXI_MM_FREE(mem, jfctx->abuf);
+		SMDBXI_MM_FREE(mem, jfctx->fresh);
+		SMDBXI_MM_FREE(mem, jfctx->zext);
+		SMDBXI_MM_FREE(mem, jfctx->drop);
 		SMDBXI_MM_FREE(mem, jfctx);
 		SMDBXI_RELEASE(mem);
 	}
@@ -644,23 +2142,51 @@ struct smdbxi_file *smdb_jf_getfile(struct smdb_jfile_ctx *jfctx)
 }
 
 int smdb_jf_begin(struct smdb_jfile_ctx *jfctx)
+{
+	return smdb_jf_begin_level(jfctx, SMDB_DUR_DEFAULT);
+}
+
+int smdb_jf_begin_level(struct smdb_jfile_ctx *jfctx, int level)
 {
 	/*
 	 * Do not allow nested transactions.
 	 */
-	if (jfctx->enabled)
+	if (jfctx->enabled || jfctx->failed || level < SMDB_DUR_DEFAULT ||
+	    level > SMDB_DUR_NONE)
 		return -1;
-
+	if (level == SMDB_DUR_DEFAULT)
+		level = jfctx->durability;
 	/*
-	 * The caller might have previously changed the file without the
-	 * journal enabled, so we want to be sure that everything done
-	 * before is actually on disk, before proceeding.
+	 * The periodic level needs the factory clock to time its period.
 	 */
-	if (SMDBXI_FL_SYNC(jfctx->bfile) < 0 ||
-	    (jfctx->fsize = SMDBXI_FL_SEEK(jfctx->bfile, 0,
-					   SMDBXI_FL_SEEKEND)) < 0)
+	if (level == SMDB_DUR_PERIODIC && jfctx->fac->clock == NULL)
 		return -1;
-	SMDBXI_FL_SEEK(jfctx->bfile, 0, SMDBXI_FL_SEEKSET);
+
+	if (!smdb_jf_mapped(jfctx)) {
+		/*
+		 * The caller might have previously changed the file without the
+		 * journal enabled, so we want to be sure that everything done
+		 * before is actually on disk, before proceeding.
+		 */
+		if (SMDBXI_FL_SYNC(jfctx->bfile) < 0 ||
+		    (jfctx->fsize = SMDBXI_FL_SEEK(jfctx->bfile, 0,
+						   SMDBXI_FL_SEEKEND)) < 0)
+			return -1;
+		SMDBXI_FL_SEEK(jfctx->bfile, 0, SMDBXI_FL_SEEKSET);
+		jfctx->dlimit = jfctx->fsize;
+	}
+	/*
+	 * Journal blocks below the base belong to the sealed and committed
+	 * transactions which have not been checkpointed yet.
+	 */
+	jfctx->jbase = (smdb_u32) (jfctx->jend / jfctx->blk_size);
+	jfctx->bsize = jfctx->fsize;
+	jfctx->dblock = SMDB_NO_OFFSET;
+	jfctx->dused = 0;
+	jfctx->ucount = 0;
+	jfctx->drbase = jfctx->drcount;
+	jfctx->zbase = jfctx->zcount;
+	jfctx->level = level;
 	jfctx->enabled = 1;
 	jfctx->active = 0;
 	jfctx->offset = 0;
@@ -668,29 +2194,273 @@ int smdb_jf_begin(struct smdb_jfile_ctx *jfctx)
 	return 0;
 }
 
-int smdb_jf_end(struct smdb_jfile_ctx *jfctx)
+static int smdb_jf_period_over(struct smdb_jfile_ctx *jfctx)
+{
+	smdb_u64 now = SMDBXI_FC_CLOCK(jfctx->fac);
+
+	/*
+	 * The period starts with the first periodic transaction sealed
+	 * inside the commit group, so the clock is only read for them.
+	 */
+	if (!jfctx->ptimed) {
+		jfctx->ctime = now;
+		jfctx->ptimed = 1;
+	}
+
+	return now >= jfctx->ctime + jfctx->sync_ms;
+}
+
+static int smdb_jf_seal(struct smdb_jfile_ctx *jfctx, int async,
+			smdb_u64 *pseq)
 {
 	jfctx->enabled = 0;
+	smdb_jf_drop_fresh(jfctx);
 	if (jfctx->active) {
-		if (smdb_jf_finish_journal(jfctx) < 0 ||
-		    smdb_jf_play_journal(jfctx) < 0)
+		if (smdb_jf_append_flush(jfctx) < 0)
 			return -1;
+		/*
+		 * Seal the transaction inside the current commit group.
+		 */
+		jfctx->sealed++;
+		jfctx->tseq++;
+		jfctx->ucount = 0;
 		jfctx->active = 0;
-	}
+		if (jfctx->level < jfctx->glevel)
+			jfctx->glevel = jfctx->level;
+		if (pseq != NULL)
+			*pseq = jfctx->tseq;
+		/*
+		 * A synchronous end of a durable transaction commits the whole
+		 * group, so that a successful return means it is on disk.
+		 * Asynchronous, periodic and non durable transactions are left
+		 * inside the group until it reaches its limits, the periodic
+		 * ones also until their period expires.
+		 */
+		if (!async && jfctx->level < SMDB_DUR_PERIODIC)
+			return smdb_jf_flush(jfctx);
+		if (smdb_jf_group_full(jfctx) ||
+		    (jfctx->level == SMDB_DUR_PERIODIC &&
+		     smdb_jf_period_over(jfctx)))
+			return smdb_jf_flush(jfctx);
+	} else if (pseq != NULL)
+		*pseq = jfctx->tseq;
 
 	return 0;
 }
 
+int smdb_jf_end(struct smdb_jfile_ctx *jfctx)
+{
+	return smdb_jf_seal(jfctx, 0, NULL);
+}
+
+int smdb_jf_end_async(struct smdb_jfile_ctx *jfctx, smdb_u64 *pseq)
+{
+	/*
+	 * The transaction is sealed inside the commit group, and becomes
+	 * durable with the next flush of the group. Its sequence number is
+	 * the one the durable sequence will reach then.
+	 */
+	return smdb_jf_seal(jfctx, 1, pseq);
+}
+
 int smdb_jf_rollback(struct smdb_jfile_ctx *jfctx)
 {
 	jfctx->enabled = 0;
+	jfctx->frcount = 0;
 	if (jfctx->active) {
-		if (smdb_jf_truncate_journal(jfctx) < 0)
+		jfctx->acount = 0;
+		jfctx->zcount = jfctx->zbase;
+		/*
+		 * Fresh blocks might have grown the DB file, and whatever they
+		 * left past its former end must not show up as content.
+		 */
+		if (jfctx->bdirty) {
+			if (SMDBXI_FL_TRUNCATE(jfctx->bfile, jfctx->bsize) < 0)
+				return -1;
+			jfctx->bdirty = 0;
+		}
+		if (jfctx->sealed == 0 && jfctx->committed == 0)
+			smdb_jf_reset_blkhash(jfctx);
+		else {
+			/*
+			 * Only the blocks of the current transaction must go,
+			 * the ones of the sealed and committed transactions
+			 * need to stay.
+			 */
+			if (smdb_jf_undo_blocks(jfctx) < 0)
+				return -1;
+			jfctx->fsize = jfctx->bsize;
+		}
+		/*
+		 * Give back the journal space used by the transaction. A
+		 * preallocated journal is left alone, since the dropped blocks
+		 * are not part of any commit chain.
+		 */
+		jfctx->jend = (smdb_offset_t) jfctx->jbase * jfctx->blk_size;
+		if (jfctx->prealloc_blocks == 0 &&
+		    SMDBXI_FL_TRUNCATE(jfctx->jfile, jfctx->jend) < 0)
 			return -1;
-		smdb_jf_reset_blkhash(jfctx);
 		jfctx->active = 0;
 	}
+	jfctx->ucount = 0;
+	jfctx->drcount = jfctx->drbase;
+
+	return 0;
+}
+
+void smdb_jf_fail(struct smdb_jfile_ctx *jfctx)
+{
+	/*
+	 * The upper layers lost track of the state of the file, so the
+	 * journal stops committing and writing like after a failed commit,
+	 * and the recovery at the next open brings back the last commit.
+	 */
+	jfctx->failed = 1;
+}
+
+int smdb_jf_flush(struct smdb_jfile_ctx *jfctx)
+{
+	/*
+	 * Cannot flush while a transaction is open, since its blocks
+	 * share the journal with the sealed ones.
+	 */
+	if (jfctx->enabled)
+		return -1;
+	if (jfctx->sealed == 0)
+		return 0;
+	if (smdb_jf_commit_group(jfctx) < 0)
+		return -1;
+	/*
+	 * The committed transactions are durable at this point, and their
+	 * blocks can be served from the journal until the next checkpoint.
+	 */
+	if (jfctx->cend >= (smdb_offset_t) jfctx->ckpt_blocks * jfctx->blk_size &&
+	    smdb_jf_checkpoint(jfctx) < 0)
+		return -1;
+	jfctx->glevel = SMDB_DUR_NONE;
+
+	return 0;
+}
+
+smdb_u64 smdb_jf_durable_seq(struct smdb_jfile_ctx *jfctx)
+{
+	return jfctx->dseq;
+}
+
+int smdb_jf_wait_durable(struct smdb_jfile_ctx *jfctx, smdb_u64 seq)
+{
+	if (seq <= jfctx->dseq)
+		return 0;
+	if (seq > jfctx->tseq)
+		return -1;
+
+	return smdb_jf_flush(jfctx);
+}
+
+int smdb_jf_checkpoint(struct smdb_jfile_ctx *jfctx)
+{
+	if (jfctx->enabled)
+		return -1;
+	if (smdb_jf_commit_group(jfctx) < 0)
+		return -1;
+	if (jfctx->committed == 0)
+		return 0;
+	/*
+	 * Play all the blocks committed since the last checkpoint into the
+	 * DB file, and start over with an empty journal.
+	 */
+	if (smdb_jf_play_journal(jfctx) < 0)
+		return -1;
+	smdb_jf_reset_blkhash(jfctx);
+	jfctx->zcount = 0;
+	jfctx->zcommit = 0;
+	jfctx->drcount = 0;
+	jfctx->committed = 0;
+	jfctx->glevel = SMDB_DUR_NONE;
+
+	return 0;
+}
+
+int smdb_jf_fresh_blocks(struct smdb_jfile_ctx *jfctx, smdb_u32 blkno,
+			 smdb_u32 count)
+{
+	unsigned long frsize;
+	smdb_u32 *fresh;
+	struct smdb_jbhash_node *bhn;
+
+	/*
+	 * Fresh blocks can bypass the journal only if the state the
+	 * transaction started from is durable, since a crash would otherwise
+	 * bring back sealed transactions where the blocks were still live.
+	 */
+	if (!jfctx->enabled || jfctx->sealed > 0)
+		return 0;
+	for (; count > 0; count--, blkno++) {
+		/*
+		 * Zero extents are played before the journal blocks, so a
+		 * block inside one must keep going through the journal.
+		 */
+		if (smdb_jf_zeroed(jfctx, blkno))
+			continue;
+		if (jfctx->frcount == jfctx->frsize) {
+			frsize = 2 * jfctx->frsize + 64;
+			if ((fresh = (smdb_u32 *)
+			     SMDBXI_MM_ALLOC(jfctx->mem, frsize *
+					     sizeof(smdb_u32))) == NULL)
+				return -1;
+			if (jfctx->frcount > 0)
+				smdb_memcpy(fresh, jfctx->fresh, jfctx->frcount *
+					    sizeof(smdb_u32));
+			SMDBXI_MM_FREE(jfctx->mem, jfctx->fresh);
+			jfctx->fresh = fresh;
+			jfctx->frsize = frsize;
+		}
+		/*
+		 * A mapping left around by the committed transactions must not
+		 * be played over the new content. The journal block of one
+		 * made by the current transaction is simply leaked.
+		 */
+		if ((bhn = smdb_jf_find_node(jfctx, blkno)) != NULL) {
+			if (bhn->joffset == SMDB_FRESH_OFFSET)
+				continue;
+			if ((bhn->joffset < jfctx->jbase &&
+			     smdb_jf_push_undo(jfctx, bhn) < 0) ||
+			    smdb_jf_push_drop(jfctx, bhn) < 0)
+				return -1;
+		} else {
+			if (smdb_jf_alloc_node(jfctx, blkno, &bhn) < 0)
+				return -1;
+			if (bhn->joffset != SMDB_NO_OFFSET &&
+			    bhn->joffset != SMDB_DEL_OFFSET)
+				jfctx->bdeleted--;
+		}
+		bhn->joffset = SMDB_FRESH_OFFSET;
+		bhn->dsize = 0;
+		jfctx->fresh[jfctx->frcount++] = blkno;
+		jfctx->active = 1;
+	}
 
 	return 0;
 }
 
+int smdb_jf_txn_block(struct smdb_jfile_ctx *jfctx, smdb_u32 blkno)
+{
+	unsigned long i;
+	struct smdb_jbhash_node *bhn;
+
+	/*
+	 * Tells whether the content of a block comes from the current
+	 * transaction, that is, either from one of its journal blocks, or
+	 * from one of its zero extents.
+	 */
+	if (!jfctx->enabled || !jfctx->active)
+		return 0;
+	if ((bhn = smdb_jf_find_node(jfctx, blkno)) != NULL)
+		return bhn->joffset >= jfctx->jbase;
+	for (i = jfctx->zbase; i < jfctx->zcount; i++)
+		if (blkno >= jfctx->zext[i].offset &&
+		    blkno - jfctx->zext[i].offset < jfctx->zext[i].doffset)
+			return 1;
+
+	return 0;
+}
@@ -15,9 +15,94 @@
  */
 
 
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "smdb-incl.h"
 
 
+#if !defined(__SSE4_2__) && !defined(__ARM_FEATURE_CRC32)
+/*
+ * CRC32C (Castagnoli) lookup table, for the cases where the CPU does not
+ * provide the instruction (or the compiler is not told to use it).
+ */
+static smdb_u32 const smdb_crc32c_table[256] = {
+	0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4,
+	0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+	0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+	0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+	0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b,
+	0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+	0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54,
+	0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+	0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+	0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+	0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5,
+	0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+	0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45,
+	0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+	0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+	0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+	0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48,
+	0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+	0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687,
+	0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+	0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+	0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+	0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8,
+	0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+	0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096,
+	0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+	0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+	0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+	0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9,
+	0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+	0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36,
+	0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+	0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+	0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+	0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043,
+	0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+	0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3,
+	0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+	0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+	0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+	0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652,
+	0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+	0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d,
+	0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+	0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+	0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+	0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2,
+	0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+	0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530,
+	0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+	0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+	0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+	0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f,
+	0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+	0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90,
+	0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+	0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+	0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+	0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321,
+	0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+	0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81,
+	0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+	0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+	0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+#endif
+
 void *smdb_zalloc(struct smdbxi_mem *mem, unsigned int size)
 {
 	void *data;
@@ -76,50 +161,185 @@ void smdb_bits_clear(smdb_u32 *bmp, unsigned long start_bit, unsigned long nbits
 	}
 }
 
+static smdb_u64 smdb_bits_word(smdb_u32 const *bmp, unsigned long wordno)
+{
+	/*
+	 * Bitmaps are arrays of 32 bit words, which are fetched in pairs
+	 * to scan them 64 bits at a time. This keeps the bit order of the
+	 * 32 bit layout, whatever the host endianness and alignment.
+	 */
+	bmp += 2 * wordno;
+
+	return (smdb_u64) bmp[0] | ((smdb_u64) bmp[1] << 32);
+}
+
+static int smdb_bits_ctz(smdb_u64 bits)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(bits);
+#else
+	int n;
+
+	for (n = 0; (bits & 0xff) == 0; bits >>= 8, n += 8);
+	for (; (bits & 1) == 0; bits >>= 1, n++);
+
+	return n;
+#endif
+}
+
+static int smdb_bits_clz(smdb_u64 bits)
+{
+#if defined(__GNUC__)
+	return __builtin_clzll(bits);
+#else
+	int n;
+
+	for (n = 0; (bits >> 56) == 0; bits <<= 8, n += 8);
+	for (; (bits >> 63) == 0; bits <<= 1, n++);
+
+	return n;
+#endif
+}
+
+static unsigned long smdb_bits_skip(smdb_u32 const *bmp, unsigned long wordno,
+				    unsigned long nwords, int set)
+{
+	/*
+	 * Skips the 64 bit words which are all set (or all clear), which is
+	 * what long runs searches spend their time on.
+	 */
+#if defined(__AVX2__)
+	__m256i vcmp = _mm256_set1_epi32(set ? -1: 0);
+
+	for (; wordno + 4 <= nwords; wordno += 4)
+		if (_mm256_movemask_epi8(
+			    _mm256_cmpeq_epi32(
+				    _mm256_loadu_si256((__m256i const *)
+						       (bmp + 2 * wordno)),
+				    vcmp)) != -1)
+			break;
+#elif defined(__SSE2__)
+	__m128i vcmp = _mm_set1_epi32(set ? -1: 0);
+
+	for (; wordno + 2 <= nwords; wordno += 2)
+		if (_mm_movemask_epi8(
+			    _mm_cmpeq_epi32(
+				    _mm_loadu_si128((__m128i const *)
+						    (bmp + 2 * wordno)),
+				    vcmp)) != 0xffff)
+			break;
+#endif
+	for (; wordno < nwords; wordno++)
+		if (smdb_bits_word(bmp, wordno) != (set ? ~(smdb_u64) 0: 0))
+			break;
+
+	return wordno;
+}
+
+static int smdb_bits_fit(smdb_u64 clear, unsigned long count)
+{
+	unsigned long n, shift;
+
+	/*
+	 * Folds the clear bits of a word onto themselves, so that a bit
+	 * remains set only when it starts a clear run of count bits.
+	 */
+	for (n = 1; n < count && clear != 0; n += shift) {
+		shift = n < count - n ? n: count - n;
+		clear &= clear >> shift;
+	}
+
+	return clear != 0 ? smdb_bits_ctz(clear): -1;
+}
+
+static int smdb_bits_find_tail(smdb_u32 const *bmp, unsigned long start_bit,
+			       unsigned long nbits, unsigned long bsize,
+			       unsigned long base, unsigned long *pbccount,
+			       unsigned long *pbfirst)
+{
+	unsigned long bitno, bccount, bfirst;
+
+	/*
+	 * Bit by bit scan, for the parts of the bitmap which do not span
+	 * whole 64 bit words.
+	 */
+	bccount = *pbccount;
+	bfirst = *pbfirst;
+	for (bitno = start_bit; bitno < nbits; bitno++) {
+		if ((bmp[bitno / 32] & ((smdb_u32) 1 << (bitno % 32))) == 0) {
+			if (bccount == 0)
+				bfirst = bitno + base;
+			if (++bccount == bsize) {
+				*pbfirst = bfirst;
+				return 1;
+			}
+		} else
+			bccount = 0;
+	}
+	*pbccount = bccount;
+	*pbfirst = bfirst;
+
+	return 0;
+}
+
 int smdb_bits_find_clear(smdb_u32 const *bmp, unsigned long start_bit,
 			 unsigned long nbits, unsigned long bsize,
 			 struct smdb_bits_find_ctx *fctx, unsigned long *pbitno)
 {
-	smdb_u32 bit;
-	unsigned long bitno, bccount, bfirst;
+	int pos;
+	unsigned long wordno, nwords, bccount, bfirst, lead;
+	smdb_u64 bits;
 
-	bmp += start_bit / 32;
-	bit = (smdb_u32) (1UL << (start_bit % 32));
 	bccount = fctx->bccount;
 	bfirst = fctx->bfirst;
-	for (bitno = start_bit; bitno < nbits; bit <<= 1, bitno++) {
-		if (bit == 0) {
-			bit = 1;
-			bmp++;
-			if (*bmp == 0xffffffff) {
-				bccount = 0;
-				while (bitno + 32 < nbits &&
-				       *bmp == 0xffffffff) {
-					bitno += 32;
-					bmp++;
-				}
-			} else if (*bmp == 0) {
-				if (bccount == 0)
-					bfirst = bitno + fctx->base;
-				while (bccount + 32 < bsize &&
-				       bitno + 32 < nbits && *bmp == 0) {
-					bitno += 32;
-					bmp++;
-					bccount += 32;
-				}
-			}
-		}
-
-		if ((*bmp & bit) == 0) {
-			if (bccount == 0)
-				bfirst = bitno + fctx->base;
-			bccount++;
-			if (bccount == bsize) {
+	if ((wordno = (start_bit + 63) / 64) > nbits / 64)
+		wordno = nbits / 64;
+	nwords = nbits / 64;
+	if (start_bit < wordno * 64 &&
+	    smdb_bits_find_tail(bmp, start_bit, wordno * 64, bsize, fctx->base,
+				&bccount, &bfirst)) {
+		*pbitno = bfirst;
+		return 1;
+	}
+	for (; wordno < nwords; wordno++) {
+		/*
+		 * Outside of a clear run, the words with no clear bits are
+		 * skipped in bulk.
+		 */
+		if (bccount == 0 &&
+		    (wordno = smdb_bits_skip(bmp, wordno, nwords, 1)) >= nwords)
+			break;
+		if (bccount == 0)
+			bfirst = wordno * 64 + fctx->base;
+		if ((bits = smdb_bits_word(bmp, wordno)) == 0) {
+			if ((bccount += 64) >= bsize) {
 				*pbitno = bfirst;
 				return 1;
 			}
-		} else
-			bccount = 0;
+			continue;
+		}
+		/*
+		 * A run started in the words before can end within this one,
+		 * otherwise look for a run inside the word. The clear bits at
+		 * the end of the word can start a new run.
+		 */
+		lead = smdb_bits_ctz(bits);
+		if (bccount + lead >= bsize) {
+			*pbitno = bfirst;
+			return 1;
+		}
+		if (bsize <= 64 && (pos = smdb_bits_fit(~bits, bsize)) >= 0) {
+			*pbitno = wordno * 64 + pos + fctx->base;
+			return 1;
+		}
+		bccount = smdb_bits_clz(bits);
+		bfirst = wordno * 64 + 64 - bccount + fctx->base;
+	}
+	if (smdb_bits_find_tail(bmp, nwords * 64 > start_bit ? nwords * 64:
+				start_bit, nbits, bsize, fctx->base,
+				&bccount, &bfirst)) {
+		*pbitno = bfirst;
+		return 1;
 	}
 	fctx->bccount = bccount;
 	fctx->bfirst = bfirst;
@@ -127,6 +347,82 @@ int smdb_bits_find_clear(smdb_u32 const *bmp, unsigned long start_bit,
 	return 0;
 }
 
+void smdb_bits_get_runs(smdb_u32 const *bmp, unsigned long nbits,
+			struct smdb_bits_runs *runs)
+{
+	int inhead;
+	unsigned long wordno, nwords, swordno, count, pos, limit, n;
+	smdb_u64 bits;
+
+	/*
+	 * Collects the clear bits at the start and at the end of the bitmap,
+	 * and the longest clear run within it. The bitmap size must be a
+	 * multiple of 32 bits.
+	 */
+	MZERO(*runs);
+	inhead = 1;
+	count = 0;
+	nwords = (nbits + 63) / 64;
+	for (wordno = 0; wordno < nwords; wordno++) {
+		if (wordno < nbits / 64) {
+			/*
+			 * Whole words all clear extend the current run, and
+			 * whole words all set close it.
+			 */
+			swordno = smdb_bits_skip(bmp, wordno, nbits / 64, 0);
+			count += (swordno - wordno) * 64;
+			if ((wordno = swordno) < nbits / 64 &&
+			    smdb_bits_word(bmp, wordno) == ~(smdb_u64) 0) {
+				if (inhead) {
+					runs->head = count;
+					inhead = 0;
+				}
+				if (count > runs->run)
+					runs->run = count;
+				count = 0;
+				wordno = smdb_bits_skip(bmp, wordno, nbits / 64, 1) - 1;
+				continue;
+			}
+			if (wordno >= nwords)
+				break;
+		}
+		if (wordno < nbits / 64) {
+			limit = 64;
+			bits = smdb_bits_word(bmp, wordno);
+		} else {
+			limit = nbits - wordno * 64;
+			bits = bmp[2 * wordno];
+		}
+		for (pos = 0; pos < limit;) {
+			/*
+			 * Alternate the clear and the set runs of the word.
+			 */
+			n = (bits >> pos) != 0 ? smdb_bits_ctz(bits >> pos):
+				64 - (int) pos;
+			if (n > limit - pos)
+				n = limit - pos;
+			count += n;
+			if ((pos += n) >= limit)
+				break;
+			if (inhead) {
+				runs->head = count;
+				inhead = 0;
+			}
+			if (count > runs->run)
+				runs->run = count;
+			count = 0;
+			n = (~bits >> pos) != 0 ? smdb_bits_ctz(~bits >> pos):
+				64 - (int) pos;
+			pos += n;
+		}
+	}
+	if (inhead)
+		runs->head = count;
+	if (count > runs->run)
+		runs->run = count;
+	runs->tail = count;
+}
+
 int smdb_get_order(unsigned long count)
 {
 	int i;
@@ -156,6 +452,98 @@ unsigned long smdb_get_hash(void const *data, unsigned long size,
         return hashv;
 }
 
+#define SMDB_XXH_P1 0x9e3779b185ebca87ULL
+#define SMDB_XXH_P2 0xc2b2ae3d27d4eb4fULL
+#define SMDB_XXH_P3 0x165667b19e3779f9ULL
+#define SMDB_XXH_P4 0x85ebca77c2b2ae63ULL
+#define SMDB_XXH_P5 0x27d4eb2f165667c5ULL
+
+#define SMDB_ROTL64(v, n) (((v) << (n)) | ((v) >> (64 - (n))))
+
+static smdb_u64 smdb_hash_read64(smdb_u8 const *data)
+{
+	/*
+	 * Hash values get stored inside the DB file, so input words are
+	 * always read as little endian.
+	 */
+	return (smdb_u64) data[0] | ((smdb_u64) data[1] << 8) |
+		((smdb_u64) data[2] << 16) | ((smdb_u64) data[3] << 24) |
+		((smdb_u64) data[4] << 32) | ((smdb_u64) data[5] << 40) |
+		((smdb_u64) data[6] << 48) | ((smdb_u64) data[7] << 56);
+}
+
+static smdb_u64 smdb_hash_round(smdb_u64 acc, smdb_u64 input)
+{
+	acc += input * SMDB_XXH_P2;
+	acc = SMDB_ROTL64(acc, 31);
+
+	return acc * SMDB_XXH_P1;
+}
+
+static smdb_u64 smdb_hash_merge(smdb_u64 hashv, smdb_u64 acc)
+{
+	hashv ^= smdb_hash_round(0, acc);
+
+	return hashv * SMDB_XXH_P1 + SMDB_XXH_P4;
+}
+
+smdb_u64 smdb_get_hash64(void const *data, unsigned long size, smdb_u64 seed)
+{
+	smdb_u8 const *udata, *end;
+	smdb_u64 hashv, v1, v2, v3, v4;
+
+	/*
+	 * XXH64. Inputs of 32 bytes or more are consumed by four independent
+	 * lanes, 8 bytes at a time each.
+	 */
+	udata = (smdb_u8 const *) data;
+	end = udata + size;
+	if (size >= 32) {
+		v1 = seed + SMDB_XXH_P1 + SMDB_XXH_P2;
+		v2 = seed + SMDB_XXH_P2;
+		v3 = seed;
+		v4 = seed - SMDB_XXH_P1;
+		for (; end - udata >= 32; udata += 32) {
+			v1 = smdb_hash_round(v1, smdb_hash_read64(udata));
+			v2 = smdb_hash_round(v2, smdb_hash_read64(udata + 8));
+			v3 = smdb_hash_round(v3, smdb_hash_read64(udata + 16));
+			v4 = smdb_hash_round(v4, smdb_hash_read64(udata + 24));
+		}
+		hashv = SMDB_ROTL64(v1, 1) + SMDB_ROTL64(v2, 7) +
+			SMDB_ROTL64(v3, 12) + SMDB_ROTL64(v4, 18);
+		hashv = smdb_hash_merge(hashv, v1);
+		hashv = smdb_hash_merge(hashv, v2);
+		hashv = smdb_hash_merge(hashv, v3);
+		hashv = smdb_hash_merge(hashv, v4);
+	} else
+		hashv = seed + SMDB_XXH_P5;
+	hashv += (smdb_u64) size;
+
+	for (; end - udata >= 8; udata += 8) {
+		hashv ^= smdb_hash_round(0, smdb_hash_read64(udata));
+		hashv = SMDB_ROTL64(hashv, 27) * SMDB_XXH_P1 + SMDB_XXH_P4;
+	}
+	if (end - udata >= 4) {
+		hashv ^= ((smdb_u64) udata[0] | ((smdb_u64) udata[1] << 8) |
+			  ((smdb_u64) udata[2] << 16) |
+			  ((smdb_u64) udata[3] << 24)) * SMDB_XXH_P1;
+		hashv = SMDB_ROTL64(hashv, 23) * SMDB_XXH_P2 + SMDB_XXH_P3;
+		udata += 4;
+	}
+	for (; udata < end; udata++) {
+		hashv ^= *udata * SMDB_XXH_P5;
+		hashv = SMDB_ROTL64(hashv, 11) * SMDB_XXH_P1;
+	}
+
+	hashv ^= hashv >> 33;
+	hashv *= SMDB_XXH_P2;
+	hashv ^= hashv >> 29;
+	hashv *= SMDB_XXH_P3;
+	hashv ^= hashv >> 32;
+
+	return hashv;
+}
+
 int smdb_off_read(struct smdbxi_file *file, smdb_offset_t offset,
 		  void *data, int size)
 {
@@ -174,3 +562,64 @@ int smdb_off_write(struct smdbxi_file *file, smdb_offset_t offset,
 	return SMDBXI_FL_WRITE(file, data, size);
 }
 
+int smdb_off_zero(struct smdbxi_file *file, smdb_offset_t offset,
+		  smdb_offset_t size, struct smdbxi_mem *mem,
+		  unsigned int blk_size)
+{
+	int count, error;
+	void *zbuf;
+
+	if (file->zero != NULL)
+		return SMDBXI_FL_ZERO(file, offset, size);
+	/*
+	 * Files with no zero method get zero blocks written over the range.
+	 */
+	if (SMDBXI_FL_SEEK(file, offset, SMDBXI_FL_SEEKSET) != offset ||
+	    (zbuf = smdb_zalloc(mem, blk_size)) == NULL)
+		return -1;
+	for (error = 0; error == 0 && size > 0; size -= count) {
+		count = size > (smdb_offset_t) blk_size ? (int) blk_size: (int) size;
+		if (SMDBXI_FL_WRITE(file, zbuf, count) != count)
+			error = -1;
+	}
+	SMDBXI_MM_FREE(mem, zbuf);
+
+	return error;
+}
+
+smdb_u32 smdb_crc32c(smdb_u32 crc, void const *data, unsigned long size)
+{
+	smdb_u8 const *ptr = (smdb_u8 const *) data;
+#if (defined(__SSE4_2__) && defined(__x86_64__)) || \
+	defined(__ARM_FEATURE_CRC32)
+	smdb_u64 word;
+#endif
+
+	/*
+	 * The data carries no alignment guarantee, so the words are copied
+	 * out instead of being loaded in place.
+	 */
+	crc = ~crc;
+#if defined(__SSE4_2__)
+#if defined(__x86_64__)
+	for (; size >= 8; size -= 8, ptr += 8) {
+		smdb_memcpy(&word, ptr, sizeof(word));
+		crc = (smdb_u32) _mm_crc32_u64(crc, word);
+	}
+#endif
+	for (; size > 0; size--, ptr++)
+		crc = _mm_crc32_u8(crc, *ptr);
+#elif defined(__ARM_FEATURE_CRC32)
+	for (; size >= 8; size -= 8, ptr += 8) {
+		smdb_memcpy(&word, ptr, sizeof(word));
+		crc = __crc32cd(crc, word);
+	}
+	for (; size > 0; size--, ptr++)
+		crc = __crc32cb(crc, *ptr);
+#else
+	for (; size > 0; size--, ptr++)
+		crc = smdb_crc32c_table[(crc ^ *ptr) & 0xff] ^ (crc >> 8);
+#endif
+
+	return ~crc;
+}
@@ -0,0 +1,172 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "smdb-incl.h"
+#include "smdb-xif-posix.h"
+#include "smdb-bits-ref.h"
+
+/*
+ * Microbenchmark of smdb_bits_find_clear() and smdb_bits_get_runs() over
+ * the bitmap block sizes of 512 and 4096 byte DB blocks, with a few
+ * fragmentation patterns. The bit at a time versions give the baseline.
+ */
+
+#define MAX_BITS 32768
+#define MIN_MS 200
+
+#define PAT_SPARSE 0
+#define PAT_FRAG 1
+#define PAT_TAIL 2
+#define PAT_EMPTY 3
+#define PAT_COUNT 4
+
+static char const * const pat_names[PAT_COUNT] = {
+	"full, sparse holes",
+	"short runs",
+	"7/8 full, free tail",
+	"empty",
+};
+
+static smdb_u32 bmp[MAX_BITS / 32];
+static volatile unsigned long sink;
+
+static void set_bit(unsigned long bitno)
+{
+	bmp[bitno / 32] |= (smdb_u32) 1 << (bitno % 32);
+}
+
+static void fill_bitmap(int pat, unsigned long nbits)
+{
+	unsigned long i, j, used, hole;
+
+	srand(9);
+	MZERO(bmp);
+	switch (pat) {
+	case PAT_SPARSE:
+		for (i = 0; i < nbits; i++)
+			set_bit(i);
+		for (i = 0; i < nbits / 500; i++) {
+			j = (unsigned long) rand() % nbits;
+			bmp[j / 32] &= ~((smdb_u32) 1 << (j % 32));
+		}
+		break;
+
+	case PAT_FRAG:
+		for (i = 0; i < nbits;) {
+			used = (unsigned long) rand() % 24 + 1;
+			hole = (unsigned long) rand() % 6 + 1;
+			for (j = 0; j < used && i < nbits; j++, i++)
+				set_bit(i);
+			i += hole;
+		}
+		break;
+
+	case PAT_TAIL:
+		for (i = 0; i < nbits - nbits / 8; i++)
+			set_bit(i);
+		break;
+	}
+}
+
+static int run_find(int ref, unsigned long nbits, unsigned long bsize)
+{
+	unsigned long bitno = 0;
+	struct smdb_bits_find_ctx fctx;
+
+	MZERO(fctx);
+	if (ref)
+		return ref_bits_find_clear(bmp, 0, nbits, bsize, &fctx, &bitno) +
+			(int) bitno;
+
+	return smdb_bits_find_clear(bmp, 0, nbits, bsize, &fctx, &bitno) +
+		(int) bitno;
+}
+
+static int run_runs(int ref, unsigned long nbits)
+{
+	struct smdb_bits_runs runs;
+
+	if (ref)
+		ref_bits_get_runs(bmp, nbits, &runs);
+	else
+		smdb_bits_get_runs(bmp, nbits, &runs);
+
+	return (int) runs.run;
+}
+
+static double time_op(struct smdbxi_factory *fac, int ref, unsigned long nbits,
+		      unsigned long bsize)
+{
+	unsigned long i, reps;
+	smdb_u64 start, elapsed;
+
+	/*
+	 * The factory clock has millisecond resolution, so the repetitions
+	 * grow until a measurement lasts long enough. A zero bsize times
+	 * smdb_bits_get_runs().
+	 */
+	for (reps = 64;; reps *= 2) {
+		start = SMDBXI_FC_CLOCK(fac);
+		for (i = 0; i < reps; i++)
+			sink += bsize != 0 ? run_find(ref, nbits, bsize):
+				run_runs(ref, nbits);
+		if ((elapsed = SMDBXI_FC_CLOCK(fac) - start) >= MIN_MS)
+			break;
+	}
+
+	return (double) elapsed * 1e6 / (double) reps;
+}
+
+static void bench(struct smdbxi_factory *fac, char const *name, int pat,
+		  unsigned long nbits, unsigned long bsize)
+{
+	double tref, tlib;
+
+	tref = time_op(fac, 1, nbits, bsize);
+	tlib = time_op(fac, 0, nbits, bsize);
+	fprintf(stdout, "%5lu bits  %-20s  %-8s  ref %9.1f ns  lib %9.1f ns  "
+		"%6.1fx\n", nbits, pat_names[pat], name, tref, tlib,
+		tref / tlib);
+}
+
+int main(int ac, char **av)
+{
+	int pat;
+	unsigned int i, j;
+	char name[32];
+	static unsigned long const sizes[] = { 4096, MAX_BITS };
+	static unsigned long const bsizes[] = { 1, 17, 64, 300 };
+	struct smdbxi_factory *fac;
+
+	if ((fac = smdb_xif_factory()) == NULL)
+		return 2;
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		for (pat = 0; pat < PAT_COUNT; pat++) {
+			fill_bitmap(pat, sizes[i]);
+			for (j = 0; j < sizeof(bsizes) / sizeof(bsizes[0]); j++) {
+				sprintf(name, "find %lu", bsizes[j]);
+				bench(fac, name, pat, sizes[i], bsizes[j]);
+			}
+			bench(fac, "runs", pat, sizes[i], 0);
+		}
+	SMDBXI_RELEASE(fac);
+
+	return 0;
+}
@@ -0,0 +1,177 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "smdb-incl.h"
+#include "smdb-bits-ref.h"
+
+/*
+ * Differential fuzzer for smdb_bits_find_clear() and smdb_bits_get_runs(),
+ * which checks them against the bit at a time versions over random
+ * bitmaps, ranges, run sizes and carried over search state.
+ */
+
+#define MAX_WORDS 256
+#define MAX_FAILS 8
+
+static smdb_u64 rng_state = 1;
+
+static smdb_u32 rng_next(void)
+{
+	/*
+	 * xorshift64*, so that a seed gives the same runs everywhere.
+	 */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+
+	return (smdb_u32) ((rng_state * 2685821657736338717ULL) >> 32);
+}
+
+static smdb_u32 rng_word(int kind)
+{
+	switch (kind) {
+	case 0:
+		return rng_next();
+
+	case 1:
+		/*
+		 * Mostly full, with sparse holes.
+		 */
+		return rng_next() % 8 ? 0xffffffff:
+			~((smdb_u32) 1 << (rng_next() % 32));
+
+	case 2:
+		/*
+		 * Mostly empty, with sparse allocations.
+		 */
+		return rng_next() % 8 ? 0: (smdb_u32) 1 << (rng_next() % 32);
+
+	default:
+		/*
+		 * Whole word runs mixed with random words.
+		 */
+		switch (rng_next() % 3) {
+		case 0:
+			return 0;
+		case 1:
+			return 0xffffffff;
+		default:
+			return rng_next();
+		}
+	}
+}
+
+static int check_find(smdb_u32 const *bmp, unsigned long nbits, long iter)
+{
+	int res, rres;
+	unsigned long start_bit, bsize, bitno = 0, rbitno = 0;
+	struct smdb_bits_find_ctx fctx, rfctx;
+
+	start_bit = rng_next() % (nbits + 1);
+	bsize = rng_next() % 4 ? rng_next() % 80 + 1: rng_next() % 4000 + 1;
+	MZERO(fctx);
+	fctx.base = 4096 * (rng_next() % 4);
+	if (rng_next() % 3 == 0) {
+		/*
+		 * A run carried over from the previous bitmap block.
+		 */
+		fctx.bccount = rng_next() % bsize;
+		fctx.bfirst = fctx.base - fctx.bccount;
+	}
+	rfctx = fctx;
+	res = smdb_bits_find_clear(bmp, start_bit, nbits, bsize, &fctx, &bitno);
+	rres = ref_bits_find_clear(bmp, start_bit, nbits, bsize, &rfctx,
+				   &rbitno);
+	if (res != rres || (res && bitno != rbitno) ||
+	    (!res && (fctx.bccount != rfctx.bccount ||
+		      (fctx.bccount != 0 && fctx.bfirst != rfctx.bfirst)))) {
+		fprintf(stderr, "find_clear mismatch: iter=%ld nbits=%lu "
+			"start=%lu bsize=%lu res=%d/%d bitno=%lu/%lu "
+			"bccount=%lu/%lu bfirst=%lu/%lu\n", iter, nbits,
+			start_bit, bsize, res, rres, bitno, rbitno,
+			fctx.bccount, rfctx.bccount, fctx.bfirst, rfctx.bfirst);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int check_runs(smdb_u32 const *bmp, unsigned long nbits, long iter)
+{
+	struct smdb_bits_runs runs, rruns;
+
+	smdb_bits_get_runs(bmp, nbits, &runs);
+	ref_bits_get_runs(bmp, nbits, &rruns);
+	if (runs.head != rruns.head || runs.tail != rruns.tail ||
+	    runs.run != rruns.run) {
+		fprintf(stderr, "get_runs mismatch: iter=%ld nbits=%lu "
+			"head=%lu/%lu tail=%lu/%lu run=%lu/%lu\n", iter, nbits,
+			runs.head, rruns.head, runs.tail, rruns.tail,
+			runs.run, rruns.run);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int ac, char **av)
+{
+	int i, kind, nwords, fails = 0;
+	long iter, niters = 200000;
+	unsigned long nbits;
+	smdb_u32 *bmp;
+
+	for (i = 1; i < ac; i++) {
+		if (strcmp(av[i], "-n") == 0) {
+			if (++i < ac)
+				niters = strtol(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-s") == 0) {
+			if (++i < ac)
+				rng_state = strtoull(av[i], NULL, 0);
+		} else
+			break;
+	}
+	if (rng_state == 0)
+		rng_state = 1;
+	/*
+	 * The kernels may load whole 64 bit words, so the bitmap is sized to
+	 * a multiple of them, and the words past the range are left random.
+	 */
+	if ((bmp = (smdb_u32 *) malloc((MAX_WORDS + 2) *
+				       sizeof(smdb_u32))) == NULL)
+		return 2;
+	for (iter = 0; iter < niters && fails < MAX_FAILS; iter++) {
+		kind = (int) (rng_next() % 4);
+		nwords = (int) (rng_next() % MAX_WORDS) + 1;
+		for (i = 0; i < MAX_WORDS + 2; i++)
+			bmp[i] = rng_word(kind);
+		nbits = (unsigned long) nwords * 32;
+		if (check_runs(bmp, nbits, iter) < 0)
+			fails++;
+		if (rng_next() % 3 == 0)
+			nbits -= rng_next() % 32;
+		if (check_find(bmp, nbits, iter) < 0)
+			fails++;
+	}
+	free(bmp);
+	fprintf(stdout, "Iterations: %ld, failures: %d\n", iter, fails);
+
+	return fails != 0;
+}
@@ -0,0 +1,81 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#include "smdb-incl.h"
+#include "smdb-bits-ref.h"
+
+/*
+ * Bit at a time versions of the bitmap kernels, which the fuzzer checks
+ * the library against, and the benchmark uses as baseline.
+ */
+
+static int ref_bit_clear(smdb_u32 const *bmp, unsigned long bitno)
+{
+	return (bmp[bitno / 32] & ((smdb_u32) 1 << (bitno % 32))) == 0;
+}
+
+int ref_bits_find_clear(smdb_u32 const *bmp, unsigned long start_bit,
+			unsigned long nbits, unsigned long bsize,
+			struct smdb_bits_find_ctx *fctx, unsigned long *pbitno)
+{
+	unsigned long bitno, bccount, bfirst;
+
+	bccount = fctx->bccount;
+	bfirst = fctx->bfirst;
+	for (bitno = start_bit; bitno < nbits; bitno++) {
+		if (ref_bit_clear(bmp, bitno)) {
+			if (bccount == 0)
+				bfirst = bitno + fctx->base;
+			if (++bccount == bsize) {
+				*pbitno = bfirst;
+				return 1;
+			}
+		} else
+			bccount = 0;
+	}
+	fctx->bccount = bccount;
+	fctx->bfirst = bfirst;
+
+	return 0;
+}
+
+void ref_bits_get_runs(smdb_u32 const *bmp, unsigned long nbits,
+		       struct smdb_bits_runs *runs)
+{
+	int inhead = 1;
+	unsigned long bitno, count = 0;
+
+	MZERO(*runs);
+	for (bitno = 0; bitno < nbits; bitno++) {
+		if (ref_bit_clear(bmp, bitno)) {
+			count++;
+			continue;
+		}
+		if (inhead) {
+			runs->head = count;
+			inhead = 0;
+		}
+		if (count > runs->run)
+			runs->run = count;
+		count = 0;
+	}
+	if (inhead)
+		runs->head = count;
+	if (count > runs->run)
+		runs->run = count;
+	runs->tail = count;
+}
@@ -0,0 +1,27 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#ifndef _SMDB_BITS_REF_H
+#define _SMDB_BITS_REF_H
+
+int ref_bits_find_clear(smdb_u32 const *bmp, unsigned long start_bit,
+			unsigned long nbits, unsigned long bsize,
+			struct smdb_bits_find_ctx *fctx, unsigned long *pbitno);
+void ref_bits_get_runs(smdb_u32 const *bmp, unsigned long nbits,
+		       struct smdb_bits_runs *runs);
+
+#endif
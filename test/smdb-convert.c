@@ -0,0 +1,291 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "smdb-incl.h"
+#include "smdb-xif-posix.h"
+
+/*
+ * Copies the records of an SMSIDB01 database into a new database of the
+ * current format. The old file is parsed directly, since the library does
+ * not read that format anymore. Its layout is a header block, followed by
+ * the allocation bitmap and the tables array. Each table points to a hash
+ * of record locations, and each record is a storage header followed by
+ * the key and data bytes.
+ */
+
+#define V1_MAGIC "SMSIDB01"
+#define V1_MAX_ORDER 32
+
+struct v1_file {
+	smdb_u32 blkno;
+	smdb_u32 size;
+};
+
+struct v1_rstorage {
+	smdb_u32 hashv;
+	smdb_u32 ksize;
+	smdb_u32 dsize;
+};
+
+struct v1_table {
+	struct v1_file hash;
+	smdb_u32 num_recs;
+};
+
+struct v1_header {
+	smdb_u8 magic[8];
+	smdb_u32 blk_size;
+	smdb_u32 blk_count;
+	smdb_u32 blk_alloc;
+	smdb_u32 first_free[V1_MAX_ORDER];
+	struct v1_file bitmap;
+	smdb_u32 num_tables;
+	struct v1_file tables;
+	smdb_u32 num_recs;
+};
+
+static int file_exists(char const *path)
+{
+	FILE *file;
+
+	if ((file = fopen(path, "rb")) == NULL)
+		return 0;
+	fclose(file);
+
+	return 1;
+}
+
+static int journal_exists(char const *path)
+{
+	int exists;
+	char *jpath;
+
+	if ((jpath = (char *) malloc(strlen(path) + 16)) == NULL)
+		return -1;
+	sprintf(jpath, "%s.journal", path);
+	exists = file_exists(jpath);
+	free(jpath);
+
+	return exists;
+}
+
+static int copy_record(struct smdbxi_file *ofile, struct v1_header const *hdr,
+		       struct v1_file const *dbf, struct smdb_dbfile_ctx *dfctx,
+		       unsigned int tblid)
+{
+	int error;
+	smdb_offset_t offset;
+	void *buf;
+	struct v1_rstorage stg;
+	struct smdb_db_ckey ckey;
+	struct smdb_db_cdata cdata;
+
+	offset = (smdb_offset_t) dbf->blkno * hdr->blk_size;
+	if (smdb_off_read(ofile, offset, &stg, sizeof(stg)) != sizeof(stg) ||
+	    (smdb_u64) sizeof(stg) + stg.ksize + stg.dsize >
+	    (smdb_u64) dbf->size * hdr->blk_size)
+		return -1;
+	if ((buf = malloc((size_t) stg.ksize + stg.dsize + 1)) == NULL)
+		return -1;
+	if (smdb_off_read(ofile, offset + sizeof(stg), buf,
+			  (int) (stg.ksize + stg.dsize)) !=
+	    (int) (stg.ksize + stg.dsize)) {
+		free(buf);
+		return -1;
+	}
+	ckey.data = buf;
+	ckey.size = stg.ksize;
+	cdata.data = (char *) buf + stg.ksize;
+	cdata.size = stg.dsize;
+	error = smdb_dbf_put(dfctx, tblid, &ckey, &cdata);
+	free(buf);
+
+	return error < 0 ? -1: 0;
+}
+
+static long copy_table(struct smdbxi_file *ofile, struct v1_header const *hdr,
+		       struct v1_table const *tbl, struct smdb_dbfile_ctx *dfctx,
+		       unsigned int tblid, int tblmode, int hashfn)
+{
+	smdb_u32 i, j, dbf_x_blk;
+	long count = 0;
+	struct v1_file *dbf;
+
+	if (smdb_dbf_create_table_hash(dfctx, tblid, tbl->num_recs + 16,
+				       tblmode, hashfn) < 0)
+		return -1;
+	if ((dbf = (struct v1_file *) malloc(hdr->blk_size)) == NULL)
+		return -1;
+	dbf_x_blk = hdr->blk_size / sizeof(struct v1_file);
+	for (i = 0; i < tbl->hash.size; i++) {
+		if (smdb_off_read(ofile, (smdb_offset_t) (tbl->hash.blkno + i) *
+				  hdr->blk_size, dbf, (int) hdr->blk_size) !=
+		    (int) hdr->blk_size) {
+			free(dbf);
+			return -1;
+		}
+		for (j = 0; j < dbf_x_blk; j++) {
+			/*
+			 * Empty slots have a zero size, and deleted ones a
+			 * zero block number.
+			 */
+			if (dbf[j].size == 0 || dbf[j].blkno == 0)
+				continue;
+			if (copy_record(ofile, hdr, &dbf[j], dfctx, tblid) < 0) {
+				free(dbf);
+				return -1;
+			}
+			count++;
+		}
+	}
+	free(dbf);
+
+	return count;
+}
+
+static int convert_db(struct smdbxi_factory *fac, char const *opath,
+		      char const *npath, struct smdb_db_config *dbcfg,
+		      int tblmode, int hashfn)
+{
+	int error = 0;
+	unsigned int tblid;
+	long count;
+	struct smdbxi_file *ofile, *nfile;
+	struct smdb_dbfile_ctx *dfctx;
+	struct v1_header hdr;
+	struct v1_table tbl;
+
+	if ((ofile = smdb_xif_file(-1, 0, opath, SMDBXI_FL_ROPEN, 0)) == NULL) {
+		perror(opath);
+		return -1;
+	}
+	if (smdb_off_read(ofile, 0, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr.magic, V1_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.blk_size < sizeof(struct v1_rstorage)) {
+		fprintf(stderr, "Not an SMSIDB01 database: '%s'\n", opath);
+		SMDBXI_RELEASE(ofile);
+		return -1;
+	}
+	if (dbcfg->blk_size == 0)
+		dbcfg->blk_size = hdr.blk_size;
+	if (dbcfg->blk_count == 0)
+		dbcfg->blk_count = hdr.blk_count;
+	dbcfg->num_tables = hdr.num_tables;
+	if ((nfile = smdb_xif_file(-1, 0, npath, SMDBXI_FL_CREATENEW,
+				   0)) == NULL) {
+		perror(npath);
+		SMDBXI_RELEASE(ofile);
+		return -1;
+	}
+	if (smdb_dbf_create(fac, nfile, dbcfg, &dfctx) < 0) {
+		fprintf(stderr, "Unable to create database: '%s'\n", npath);
+		SMDBXI_RELEASE(nfile);
+		SMDBXI_RELEASE(ofile);
+		remove(npath);
+		return -1;
+	}
+
+	for (tblid = 0; tblid < hdr.num_tables && error == 0; tblid++) {
+		if (smdb_off_read(ofile, (smdb_offset_t) hdr.tables.blkno *
+				  hdr.blk_size + tblid * sizeof(tbl), &tbl,
+				  sizeof(tbl)) != sizeof(tbl)) {
+			error = -1;
+			break;
+		}
+		/*
+		 * Tables which were never created, or were freed, have no
+		 * hash blocks.
+		 */
+		if (tbl.hash.size == 0)
+			continue;
+		if ((count = copy_table(ofile, &hdr, &tbl, dfctx, tblid,
+					tblmode, hashfn)) < 0) {
+			fprintf(stderr, "Unable to convert table %u\n", tblid);
+			error = -1;
+		} else
+			fprintf(stdout, "Table %u: %ld records\n", tblid, count);
+	}
+	if (error == 0 && smdb_dbf_sync(dfctx) < 0)
+		error = -1;
+	smdb_dbf_free(dfctx);
+	SMDBXI_RELEASE(nfile);
+	SMDBXI_RELEASE(ofile);
+	if (error < 0)
+		remove(npath);
+
+	return error;
+}
+
+int main(int ac, char **av)
+{
+	int i, tblmode = SMDB_DBF_TBL_HASH, hashfn = SMDB_DBF_HASH_OAT;
+	struct smdbxi_factory *fac;
+	struct smdb_db_config dbcfg;
+
+	MZERO(dbcfg);
+	dbcfg.cache_size = 1024 * 1024;
+	for (i = 1; i < ac; i++) {
+		if (strcmp(av[i], "-b") == 0) {
+			if (++i < ac)
+				dbcfg.blk_size = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-c") == 0) {
+			if (++i < ac)
+				dbcfg.blk_count = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-s") == 0) {
+			if (++i < ac)
+				dbcfg.cache_size = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-L") == 0)
+			tblmode = SMDB_DBF_TBL_LINEAR;
+		else if (strcmp(av[i], "-H") == 0)
+			tblmode = SMDB_DBF_TBL_ROBIN;
+		else if (strcmp(av[i], "-X") == 0)
+			hashfn = SMDB_DBF_HASH_XXH64;
+		else
+			break;
+	}
+	if (ac - i != 2) {
+		fprintf(stderr, "Usage: %s [-b BLKSIZE] [-c BLKCOUNT] [-s CACHESIZE] "
+			"[-L | -H] [-X] OLDDB NEWDB\n", av[0]);
+		return 1;
+	}
+	/*
+	 * A journal left by a crash holds changes the old file does not
+	 * have yet, and only the library version which wrote it can play it.
+	 */
+	if (journal_exists(av[i]) != 0) {
+		fprintf(stderr, "Journal found for '%s': open the database with "
+			"the library which wrote it first\n", av[i]);
+		return 2;
+	}
+	if (file_exists(av[i + 1])) {
+		fprintf(stderr, "Target database already exists: '%s'\n",
+			av[i + 1]);
+		return 2;
+	}
+	if ((fac = smdb_xif_factory()) == NULL)
+		return 3;
+	if (convert_db(fac, av[i], av[i + 1], &dbcfg, tblmode, hashfn) < 0) {
+		SMDBXI_RELEASE(fac);
+		return 4;
+	}
+	SMDBXI_RELEASE(fac);
+
+	return 0;
+}
@@ -0,0 +1,233 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "smdb-incl.h"
+#include "smdb-xif-posix.h"
+
+/*
+ * Measures the smdb_dbf_multi_get() lookup throughput against the batch
+ * size, with smdb_dbf_get() as baseline. The database is filled with a
+ * mix of small and large records, and every run opens it again, so that
+ * all of them start from a cold block cache. One key out of ten misses.
+ */
+
+#define MAX_BATCH 1024
+
+static smdb_u64 rng_state = 1;
+
+static unsigned long rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+
+	return (unsigned long) ((rng_state * 2685821657736338717ULL) >> 33);
+}
+
+static void make_key(char *buf, unsigned long k)
+{
+	sprintf(buf, "key-%08lu", k);
+}
+
+static unsigned long data_size(unsigned long k)
+{
+	return k % 5 == 0 ? 1000 + k % 2000: 20 + k % 100;
+}
+
+static int fill_db(struct smdbxi_factory *fac, char const *path,
+		   struct smdb_db_config const *dbcfg, int tblmode,
+		   unsigned long nkeys)
+{
+	unsigned long k;
+	char key[32];
+	static char data[4096];
+	struct smdbxi_file *file;
+	struct smdb_dbfile_ctx *dfctx;
+	struct smdb_db_ckey ckey;
+	struct smdb_db_cdata cdata;
+
+	if ((file = smdb_xif_file(-1, 0, path, SMDBXI_FL_CREATENEW,
+				  0)) == NULL)
+		return -1;
+	if (smdb_dbf_create(fac, file, dbcfg, &dfctx) < 0) {
+		SMDBXI_RELEASE(file);
+		return -1;
+	}
+	if (smdb_dbf_create_table_mode(dfctx, 0, (unsigned int) nkeys,
+				       tblmode) < 0 ||
+	    smdb_dbf_begin(dfctx) < 0) {
+		smdb_dbf_free(dfctx);
+		SMDBXI_RELEASE(file);
+		return -1;
+	}
+	for (k = 0; k < nkeys; k++) {
+		make_key(key, k);
+		ckey.data = key;
+		ckey.size = strlen(key);
+		memset(data, (int) (k & 0xff), data_size(k));
+		cdata.data = data;
+		cdata.size = data_size(k);
+		if (smdb_dbf_put(dfctx, 0, &ckey, &cdata) < 0 ||
+		    ((k + 1) % 10000 == 0 &&
+		     (smdb_dbf_end(dfctx) < 0 || smdb_dbf_begin(dfctx) < 0))) {
+			smdb_dbf_free(dfctx);
+			SMDBXI_RELEASE(file);
+			return -1;
+		}
+	}
+	if (smdb_dbf_end(dfctx) < 0 || smdb_dbf_checkpoint(dfctx) < 0) {
+		smdb_dbf_free(dfctx);
+		SMDBXI_RELEASE(file);
+		return -1;
+	}
+	smdb_dbf_free(dfctx);
+	SMDBXI_RELEASE(file);
+
+	return 0;
+}
+
+static long run_lookups(struct smdbxi_factory *fac, char const *path,
+			struct smdb_db_config const *dbcfg,
+			unsigned long nkeys, unsigned long nlookups,
+			unsigned long batch, smdb_u64 *pelapsed)
+{
+	unsigned long i, n, done;
+	long found = 0;
+	smdb_u64 start;
+	static char keybufs[MAX_BATCH][32];
+	static struct smdb_db_ckey keys[MAX_BATCH];
+	static struct smdb_db_record recs[MAX_BATCH];
+	struct smdbxi_file *file;
+	struct smdb_dbfile_ctx *dfctx;
+	struct smdb_db_kenum ken;
+
+	if ((file = smdb_xif_file(-1, 0, path, SMDBXI_FL_RWOPEN, 0)) == NULL)
+		return -1;
+	if (smdb_dbf_open(fac, file, dbcfg, &dfctx) < 0) {
+		SMDBXI_RELEASE(file);
+		return -1;
+	}
+	/*
+	 * The same key sequence is looked up by every run.
+	 */
+	rng_state = 0x5eed;
+	start = SMDBXI_FC_CLOCK(fac);
+	for (done = 0; done < nlookups; done += n) {
+		n = nlookups - done < batch ? nlookups - done: batch;
+		for (i = 0; i < n; i++) {
+			make_key(keybufs[i], rng_next() % (nkeys + nkeys / 10));
+			keys[i].data = keybufs[i];
+			keys[i].size = strlen(keybufs[i]);
+		}
+		if (batch == 1) {
+			/*
+			 * A batch size of one is the smdb_dbf_get() baseline.
+			 */
+			if (smdb_dbf_get(dfctx, 0, &keys[0], &recs[0], &ken) > 0) {
+				smdb_dbf_free_record(dfctx, &recs[0]);
+				found++;
+			}
+			continue;
+		}
+		if (smdb_dbf_multi_get(dfctx, 0, keys, n, recs) < 0) {
+			smdb_dbf_free(dfctx);
+			SMDBXI_RELEASE(file);
+			return -1;
+		}
+		for (i = 0; i < n; i++)
+			if (recs[i].record != NULL) {
+				smdb_dbf_free_record(dfctx, &recs[i]);
+				found++;
+			}
+	}
+	*pelapsed = SMDBXI_FC_CLOCK(fac) - start;
+	smdb_dbf_free(dfctx);
+	SMDBXI_RELEASE(file);
+
+	return found;
+}
+
+int main(int ac, char **av)
+{
+	int i, tblmode = SMDB_DBF_TBL_HASH;
+	unsigned long nkeys = 100000, nlookups = 200000, batch;
+	long found;
+	smdb_u64 elapsed;
+	char const *path = NULL;
+	struct smdbxi_factory *fac;
+	struct smdb_db_config dbcfg;
+
+	MZERO(dbcfg);
+	dbcfg.blk_size = 1024;
+	dbcfg.blk_count = 100 * 1024;
+	dbcfg.cache_size = 1024 * 1024;
+	dbcfg.num_tables = 1;
+	for (i = 1; i < ac; i++) {
+		if (strcmp(av[i], "-f") == 0) {
+			if (++i < ac)
+				path = av[i];
+		} else if (strcmp(av[i], "-b") == 0) {
+			if (++i < ac)
+				dbcfg.blk_size = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-s") == 0) {
+			if (++i < ac)
+				dbcfg.cache_size = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-n") == 0) {
+			if (++i < ac)
+				nkeys = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-r") == 0) {
+			if (++i < ac)
+				nlookups = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-L") == 0)
+			tblmode = SMDB_DBF_TBL_LINEAR;
+		else if (strcmp(av[i], "-H") == 0)
+			tblmode = SMDB_DBF_TBL_ROBIN;
+		else
+			break;
+	}
+	if (path == NULL || nkeys == 0) {
+		fprintf(stderr, "Usage: %s -f DBPATH [-b BLKSIZE] [-s CACHESIZE] "
+			"[-n NKEYS] [-r NLOOKUPS] [-L | -H]\n", av[0]);
+		return 1;
+	}
+	if ((fac = smdb_xif_factory()) == NULL)
+		return 2;
+	if (fill_db(fac, path, &dbcfg, tblmode, nkeys) < 0) {
+		fprintf(stderr, "Unable to create database: '%s'\n", path);
+		return 3;
+	}
+	fprintf(stdout, "%lu keys, %lu lookups, %lu byte cache\n", nkeys,
+		nlookups, (unsigned long) dbcfg.cache_size);
+	for (batch = 1; batch <= MAX_BATCH; batch *= 2) {
+		if ((found = run_lookups(fac, path, &dbcfg, nkeys, nlookups,
+					 batch, &elapsed)) < 0) {
+			fprintf(stderr, "Lookups failed at batch size %lu\n",
+				batch);
+			return 4;
+		}
+		fprintf(stdout, "batch %5lu  %8lu ms  %10.0f keys/s  found %ld\n",
+			batch, (unsigned long) elapsed,
+			elapsed > 0 ? (double) nlookups * 1000.0 / elapsed: 0.0,
+			found);
+	}
+	SMDBXI_RELEASE(fac);
+
+	return 0;
+}
@@ -28,6 +28,7 @@
 #define MODE_DUMP 5
 #define MODE_RMTABLE 6
 #define MODE_MKTABLE 7
+#define MODE_BIGVIEW 8
 
 static void *load_file(char const *path, long *pfsize)
 {
@@ -109,6 +110,16 @@ static char **get_flist(char **ifiles, int infiles, char const *flpath,
 	return flist;
 }
 
+static int end_record(struct smdb_dbfile_ctx *dfctx, int async, smdb_u64 *pseq)
+{
+	return async ? smdb_dbf_end_async(dfctx, pseq): smdb_dbf_end(dfctx);
+}
+
+static void play_progress(void *priv, unsigned long done, unsigned long total)
+{
+	fprintf(stderr, "Journal replay: %lu/%lu blocks\n", done, total);
+}
+
 static void free_flist(char **flist, int n)
 {
 	if (flist != NULL) {
@@ -118,9 +129,82 @@ static void free_flist(char **flist, int n)
 	free(flist);
 }
 
+static int view_differs(struct smdb_db_view const *view, void const *fdata,
+			long fsize)
+{
+	unsigned long i, off, size;
+	char const *data = (char const *) fdata;
+	struct smdb_db_iovec const *iov = SMDB_DBF_VIEW_IOV(view);
+
+	if (view->data.size != (unsigned long) fsize)
+		return 1;
+	if (view->data.data != NULL)
+		return memcmp(view->data.data, fdata, fsize) != 0;
+	/*
+	 * Walk the record blocks, skipping the key bytes in front of the data.
+	 */
+	for (i = 0, off = view->key.size; i < view->niov; i++) {
+		if (off >= iov[i].size) {
+			off -= iov[i].size;
+			continue;
+		}
+		size = iov[i].size - off;
+		if (memcmp((char const *) iov[i].data + off, data,
+			   size) != 0)
+			return 1;
+		data += size;
+		off = 0;
+	}
+
+	return 0;
+}
+
+static int big_view(struct smdb_dbfile_ctx *dfctx, unsigned int tblid,
+		    unsigned long size)
+{
+	int error;
+	unsigned long i;
+	char *data;
+	struct smdb_db_ckey ckey;
+	struct smdb_db_cdata cdata;
+	struct smdb_db_kenum ken;
+	struct smdb_db_view view;
+
+	/*
+	 * Stores a record larger than the whole cache, and reads it back
+	 * through a view, which cannot pin all its blocks.
+	 */
+	if ((data = (char *) malloc(size)) == NULL)
+		return -1;
+	for (i = 0; i < size; i++)
+		data[i] = (char) (i * 131 + (i >> 8));
+	ckey.data = "smdbtest-bigview";
+	ckey.size = strlen("smdbtest-bigview");
+	cdata.data = data;
+	cdata.size = size;
+	if (smdb_dbf_put(dfctx, tblid, &ckey, &cdata) < 0) {
+		free(data);
+		return -1;
+	}
+	if ((error = smdb_dbf_get_view(dfctx, tblid, &ckey, &view, &ken)) > 0) {
+		if (view_differs(&view, data, (long) size))
+			error = -1;
+		smdb_dbf_release_view(dfctx, &view);
+	} else
+		error = -1;
+	if (smdb_dbf_erase(dfctx, tblid, &ckey, NULL) <= 0)
+		error = -1;
+	free(data);
+
+	return error < 0 ? -1: 0;
+}
+
 int main(int ac, char **av)
 {
-	int i, error, nfiles, mode = MODE_PUT, journal = 0;
+	int i, error, nfiles, mode = MODE_PUT, journal = 0, txrec = 0, async = 0,
+		tblmode = SMDB_DBF_TBL_HASH, hashfn = SMDB_DBF_HASH_OAT, usebatch = 0,
+		useview = 0;
+	smdb_u64 seq = 0;
 	unsigned int tblsize = 16000, tblid = 0;
 	long fsize, rcount;
 	void *fdata;
@@ -129,11 +213,13 @@ int main(int ac, char **av)
 	struct smdbxi_factory *fac;
 	struct smdbxi_file *file;
 	struct smdb_dbfile_ctx *dfctx;
+	struct smdb_dbf_batch *batch = NULL;
 	struct smdb_db_config dbcfg;
-	struct smdb_db_ckey ckey;
+	struct smdb_db_ckey ckey, *ckeys = NULL;
 	struct smdb_db_cdata cdata;
-	struct smdb_db_record rec;
+	struct smdb_db_record rec, *recs;
 	struct smdb_db_kenum ken;
+	struct smdb_db_view view;
 
 	MZERO(dbcfg);
 	dbcfg.blk_size = 1024;
@@ -159,9 +245,30 @@ int main(int ac, char **av)
 		} else if (strcmp(av[i], "-x") == 0) {
 			if (++i < ac)
 				tblsize = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-G") == 0) {
+			if (++i < ac)
+				dbcfg.group_max = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-K") == 0) {
+			if (++i < ac)
+				dbcfg.ckpt_blocks = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-p") == 0) {
+			if (++i < ac)
+				dbcfg.prealloc_blocks = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-S") == 0) {
+			if (++i < ac)
+				dbcfg.pin_size = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-D") == 0) {
+			if (++i < ac)
+				dbcfg.durability = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-Y") == 0) {
+			if (++i < ac)
+				dbcfg.sync_ms = strtoul(av[i], NULL, 0);
 		} else if (strcmp(av[i], "-T") == 0) {
 			if (++i < ac)
 				tblid = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-V") == 0) {
+			if (++i < ac)
+				dbcfg.hash_seed = strtoull(av[i], NULL, 0);
 		} else if (strcmp(av[i], "-g") == 0)
 			mode = MODE_GET;
 		else if (strcmp(av[i], "-e") == 0)
@@ -174,8 +281,26 @@ int main(int ac, char **av)
 			mode = MODE_RMTABLE;
 		else if (strcmp(av[i], "-M") == 0)
 			mode = MODE_MKTABLE;
+		else if (strcmp(av[i], "-W") == 0)
+			mode = MODE_BIGVIEW;
 		else if (strcmp(av[i], "-j") == 0)
 			journal = 1;
+		else if (strcmp(av[i], "-J") == 0)
+			txrec = 1;
+		else if (strcmp(av[i], "-A") == 0)
+			txrec = async = 1;
+		else if (strcmp(av[i], "-P") == 0)
+			dbcfg.play_cb = play_progress;
+		else if (strcmp(av[i], "-L") == 0)
+			tblmode = SMDB_DBF_TBL_LINEAR;
+		else if (strcmp(av[i], "-H") == 0)
+			tblmode = SMDB_DBF_TBL_ROBIN;
+		else if (strcmp(av[i], "-X") == 0)
+			hashfn = SMDB_DBF_HASH_XXH64;
+		else if (strcmp(av[i], "-B") == 0)
+			usebatch = 1;
+		else if (strcmp(av[i], "-Z") == 0)
+			useview = 1;
 		else
 			break;
 	}
@@ -190,11 +315,15 @@ int main(int ac, char **av)
 			return 3;
 		if (smdb_dbf_create(fac, file, &dbcfg, &dfctx) < 0)
 			return 4;
-		if (smdb_dbf_create_table(dfctx, tblid, tblsize) < 0)
+		if (smdb_dbf_create_table_hash(dfctx, tblid, tblsize,
+					       tblmode, hashfn) < 0)
 			return 5;
-	} else {
-		if (smdb_dbf_open(fac, file, &dbcfg, &dfctx) < 0)
-			return 4;
+	} else if ((error = smdb_dbf_open(fac, file, &dbcfg,
+					  &dfctx)) < 0) {
+		if (error == SMDB_DBF_ERR_FORMAT)
+			fprintf(stderr, "Unsupported database format: '%s' "
+				"(see smdbconv)\n", path);
+		return 4;
 	}
 
 	if ((files = get_flist(&av[i], ac - i, flpath, &nfiles)) == NULL)
@@ -204,12 +333,47 @@ int main(int ac, char **av)
 
 	if (journal && smdb_dbf_begin(dfctx) < 0)
 		return 7;
+	if (usebatch && smdb_dbf_batch_create(dfctx, &batch) < 0)
+		return 13;
 
-	if (mode == MODE_GET) {
+	if (mode == MODE_GET && batch != NULL) {
+		if ((ckeys = (struct smdb_db_ckey *)
+		     malloc(nfiles * sizeof(*ckeys))) == NULL ||
+		    (recs = (struct smdb_db_record *)
+		     malloc(nfiles * sizeof(*recs))) == NULL) {
+			free(ckeys);
+			free_flist(files, nfiles);
+			return 13;
+		}
+		for (i = 0; i < nfiles; i++) {
+			ckeys[i].data = files[i];
+			ckeys[i].size = strlen(files[i]);
+		}
+		if (smdb_dbf_multi_get(dfctx, tblid, ckeys, nfiles, recs) < 0) {
+			fprintf(stderr, "Multi get failed!\n");
+			free(recs);
+			free(ckeys);
+			free_flist(files, nfiles);
+			return 13;
+		}
+		for (i = 0; i < nfiles; i++) {
+			if (recs[i].record == NULL)
+				fprintf(stderr, "Record not found: '%s'\n", files[i]);
+			smdb_dbf_free_record(dfctx, &recs[i]);
+		}
+		free(recs);
+		free(ckeys);
+	} else if (mode == MODE_GET) {
 		for (i = 0; i < nfiles; i++) {
 			ckey.data = files[i];
 			ckey.size = strlen(files[i]);
-			if (smdb_dbf_get(dfctx, tblid, &ckey, &rec, &ken) > 0) {
+			if (useview) {
+				if (smdb_dbf_get_view(dfctx, tblid, &ckey, &view,
+						      &ken) > 0)
+					smdb_dbf_release_view(dfctx, &view);
+				else
+					fprintf(stderr, "Record not found: '%s'\n", files[i]);
+			} else if (smdb_dbf_get(dfctx, tblid, &ckey, &rec, &ken) > 0) {
 
 				smdb_dbf_free_record(dfctx, &rec);
 			} else {
@@ -220,11 +384,21 @@ int main(int ac, char **av)
 		for (i = 0; i < nfiles; i++) {
 			ckey.data = files[i];
 			ckey.size = strlen(files[i]);
+			if (batch != NULL) {
+				if (smdb_dbf_batch_erase(batch, tblid, &ckey,
+							 NULL) < 0)
+					return 13;
+				continue;
+			}
+			if (txrec && smdb_dbf_begin(dfctx) < 0)
+				return 7;
 			if (smdb_dbf_erase(dfctx, tblid, &ckey, NULL) > 0) {
 
 			} else {
 				fprintf(stderr, "Record not found: '%s'\n", files[i]);
 			}
+			if (txrec && end_record(dfctx, async, &seq) < 0)
+				return 12;
 		}
 	} else if (mode == MODE_PUT) {
 		for (i = 0; i < nfiles; i++) {
@@ -237,11 +411,24 @@ int main(int ac, char **av)
 			ckey.size = strlen(files[i]);
 			cdata.data = fdata;
 			cdata.size = fsize;
+			if (batch != NULL) {
+				if (smdb_dbf_batch_put(batch, tblid, &ckey,
+						       &cdata) < 0) {
+					free_flist(files, nfiles);
+					return 13;
+				}
+				free(fdata);
+				continue;
+			}
+			if (txrec && smdb_dbf_begin(dfctx) < 0)
+				return 7;
 			if (smdb_dbf_put(dfctx, tblid, &ckey, &cdata) < 0) {
 				fprintf(stderr, "DD insert failed: '%s'\n", files[i]);
 				free_flist(files, nfiles);
 				return 9;
 			}
+			if (txrec && end_record(dfctx, async, &seq) < 0)
+				return 12;
 			free(fdata);
 		}
 	} else if (mode == MODE_CMP) {
@@ -253,7 +440,18 @@ int main(int ac, char **av)
 
 			ckey.data = files[i];
 			ckey.size = strlen(files[i]);
-			if (smdb_dbf_get(dfctx, tblid, &ckey, &rec, &ken) > 0) {
+			if (useview) {
+				if (smdb_dbf_get_view(dfctx, tblid, &ckey, &view,
+						      &ken) > 0) {
+					if (view_differs(&view, fdata, fsize))
+						fprintf(stderr, "Record in DB differs: '%s'\n",
+							files[i]);
+
+					smdb_dbf_release_view(dfctx, &view);
+				} else {
+					fprintf(stderr, "Record not found: '%s'\n", files[i]);
+				}
+			} else if (smdb_dbf_get(dfctx, tblid, &ckey, &rec, &ken) > 0) {
 				if (rec.data.size != (unsigned long) fsize ||
 				    memcmp(rec.data.data, fdata, fsize) != 0)
 					fprintf(stderr, "Record in DB differs: '%s'\n",
@@ -290,16 +488,32 @@ int main(int ac, char **av)
 			fprintf(stderr, "Table remove failed!\n");
 			return 11;
 		}
+	} else if (mode == MODE_BIGVIEW) {
+		if (big_view(dfctx, tblid, 2 * dbcfg.cache_size +
+			     dbcfg.blk_size) < 0) {
+			fprintf(stderr, "Big record view failed!\n");
+			return 14;
+		}
 	} else if (mode == MODE_MKTABLE) {
-		if (smdb_dbf_create_table(dfctx, tblid, tblsize) < 0) {
+		if (smdb_dbf_create_table_hash(dfctx, tblid, tblsize,
+					       tblmode, hashfn) < 0) {
 			fprintf(stderr, "Table create failed!\n");
 			return 11;
 		}
 	}
 
 	free_flist(files, nfiles);
+	if (batch != NULL) {
+		if (smdb_dbf_batch_apply(batch) < 0) {
+			fprintf(stderr, "Batch apply failed!\n");
+			return 13;
+		}
+		smdb_dbf_batch_free(batch);
+	}
 	if (journal && smdb_dbf_end(dfctx) < 0)
 		return 12;
+	if (async && smdb_dbf_wait_durable(dfctx, seq) < 0)
+		return 12;
 
 	smdb_dbf_free(dfctx);
 	SMDBXI_RELEASE(file);
@@ -39,9 +39,13 @@
 #define write(f, d, n) _write(f, d, n)
 #define lseek(f, o, w) _lseek(f, o, w)
 #define fsync(f) _commit(f)
+#define fdatasync(f) _commit(f)
 #define mkdir(n, p) _mkdir(n)
 #define rmdir(n) _rmdir(n)
 
+#else
+#include <time.h>
+
 #endif
 
 
@@ -195,6 +199,47 @@ static int smdb_xif_file__write(void *priv, void const *buf, int n)
 	return write(pif->fd, buf, n);
 }
 
+static int smdb_xif_file__write_range(void *priv, void const *buf, int n,
+				      int off, int size)
+{
+	struct smdbxi_file_px *pif = (struct smdbxi_file_px *) priv;
+	off_t pos;
+
+	/*
+	 * Only the changed bytes hit the file, and the file position is
+	 * left past the whole buffer, as a full write would do.
+	 */
+	if (off < 0 || size < 0 || off + size > n)
+		return write(pif->fd, buf, n);
+	if ((pos = lseek(pif->fd, 0, SEEK_CUR)) == (off_t) -1 ||
+	    lseek(pif->fd, pos + off, SEEK_SET) != pos + off ||
+	    write(pif->fd, (char const *) buf + off, size) != size ||
+	    lseek(pif->fd, pos + n, SEEK_SET) != pos + n)
+		return -1;
+
+	return n;
+}
+
+static int smdb_xif_file__zero(void *priv, smdb_offset_t off,
+			       smdb_offset_t size)
+{
+	struct smdbxi_file_px *pif = (struct smdbxi_file_px *) priv;
+	int count;
+	char buf[4096];
+
+	memset(buf, 0, sizeof(buf));
+	if (lseek(pif->fd, (off_t) off, SEEK_SET) != (off_t) off)
+		return -1;
+	for (; size > 0; size -= count) {
+		count = size > (smdb_offset_t) sizeof(buf) ? (int) sizeof(buf):
+			(int) size;
+		if (write(pif->fd, buf, count) != count)
+			return -1;
+	}
+
+	return 0;
+}
+
 static int smdb_xif_file__truncate(void *priv, smdb_offset_t size)
 {
 	struct smdbxi_file_px *pif = (struct smdbxi_file_px *) priv;
@@ -209,6 +254,26 @@ static int smdb_xif_file__sync(void *priv)
 	return fsync(pif->fd);
 }
 
+static int smdb_xif_file__datasync(void *priv)
+{
+	struct smdbxi_file_px *pif = (struct smdbxi_file_px *) priv;
+
+	return fdatasync(pif->fd);
+}
+
+static int smdb_xif_file__readahead(void *priv, smdb_offset_t offset,
+				    smdb_offset_t size)
+{
+#ifdef POSIX_FADV_WILLNEED
+	struct smdbxi_file_px *pif = (struct smdbxi_file_px *) priv;
+
+	return posix_fadvise(pif->fd, (off_t) offset, (off_t) size,
+			     POSIX_FADV_WILLNEED) != 0 ? -1: 0;
+#else
+	return 0;
+#endif
+}
+
 static char const *smdb_xif_file__path(void *priv)
 {
 	struct smdbxi_file_px *pif = (struct smdbxi_file_px *) priv;
@@ -264,6 +329,10 @@ struct smdbxi_file *smdb_xif_file(int fd, int closefd, char const *filename,
 	pif->ifc.truncate = smdb_xif_file__truncate;
 	pif->ifc.sync = smdb_xif_file__sync;
 	pif->ifc.path = smdb_xif_file__path;
+	pif->ifc.write_range = smdb_xif_file__write_range;
+	pif->ifc.zero = smdb_xif_file__zero;
+	pif->ifc.datasync = smdb_xif_file__datasync;
+	pif->ifc.readahead = smdb_xif_file__readahead;
 	pif->usecnt = 1;
 	pif->fd = fd;
 	pif->closefd = closefd;
@@ -381,6 +450,19 @@ static struct smdbxi_file *smdb_xif_factory__file(void *priv)
 	return smdb_xif_file(-1, 1, filename, O_CREAT | O_RDWR | O_TRUNC, 1);
 }
 
+static smdb_u64 smdb_xif_factory__clock(void *priv)
+{
+#ifdef _WIN32
+	return (smdb_u64) GetTickCount64();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (smdb_u64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
 struct smdbxi_factory *smdb_xif_factory(void)
 {
 	struct smdbxi_factory_px *pif;
@@ -394,6 +476,7 @@ struct smdbxi_factory *smdb_xif_factory(void)
 	pif->ifc.mem = smdb_xif_factory__mem;
 	pif->ifc.file = smdb_xif_factory__file;
 	pif->ifc.fs = smdb_xif_factory__fs;
+	pif->ifc.clock = smdb_xif_factory__clock;
 	pif->usecnt = 1;
 	pif->seqf = 0;
 